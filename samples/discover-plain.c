@@ -0,0 +1,26 @@
+/*
+ * Built without the multiverse plugin: a direct call, a call through the
+ * GOT (pick_got is pick, see CMakeLists.txt), a call through a pointer
+ * the program may reassign and a tail jump
+ */
+
+int pick(void);
+int pick_got(void) __attribute__((noplt));
+
+int (*hook)(void) = pick; // NOLINT
+
+__attribute__((noinline)) int call_direct(void) {
+    return pick() + 1;
+}
+
+__attribute__((noinline)) int call_got(void) {
+    return pick_got() + 1;
+}
+
+__attribute__((noinline)) int call_hook(void) {
+    return hook() + 1;
+}
+
+__attribute__((noinline)) int jump_direct(void) {
+    return pick();
+}
@@ -0,0 +1,41 @@
+/*
+ * Executable with calls to a multiverse function that are missing in
+ * __multiverse_callsite_, they are in discover-plain.c
+ */
+
+#include <stdio.h>
+#ifdef MVINSTALLED
+#include <multiverse.h>
+#else
+#include "multiverse.h"
+#endif
+
+__attribute__((multiverse)) int config_pick; // NOLINT
+__attribute__((multiverse)) int config_other; // NOLINT
+
+int __attribute__((multiverse, noinline)) pick() { // NOLINT
+    if (config_pick)
+        return 1;
+    return 2;
+}
+
+void __attribute__((multiverse)) other() { // NOLINT
+    if (config_other)
+        puts("other");
+}
+
+int call_direct(void);
+int call_got(void);
+int call_hook(void);
+int jump_direct(void);
+
+int main()
+{
+    multiverse_init();
+
+    other();
+    printf("%d %d %d %d\n", call_direct(), call_got(), call_hook(),
+           jump_direct());
+
+    return 0;
+}
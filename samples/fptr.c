@@ -0,0 +1,38 @@
+/*
+ * Executable with a pointer to a multiverse function, a callsite that
+ * branches on the constant its variants return, a variable in .data
+ * read by main and one main writes
+ */
+
+#include <stdio.h>
+#ifdef MVINSTALLED
+#include <multiverse.h>
+#else
+#include "multiverse.h"
+#endif
+
+__attribute__((multiverse)) int config_fast; // NOLINT
+__attribute__((multiverse)) int config_level = 2; // NOLINT
+__attribute__((multiverse)) int config_runs = 1; // NOLINT
+
+int __attribute__((multiverse, noinline)) fast() { // NOLINT
+    return config_fast;
+}
+
+int (*handlers[])(void) = {fast}; // NOLINT
+unsigned long not_a_pointer = 42; // NOLINT
+
+int main()
+{
+    multiverse_init();
+
+    if (fast())
+        puts("fast");
+    else
+        puts("slow");
+    printf("level %d\n", config_level);
+    config_runs++;
+    printf("runs %d\n", config_runs);
+
+    return handlers[0]() + (int)not_a_pointer;
+}
@@ -0,0 +1,190 @@
+#include <bintail/bintail.hpp>
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <future>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+#include "pool.h"
+
+using namespace std;
+
+static string file_name(const string& path) {
+  return path.substr(path.find_last_of('/') + 1);
+}
+
+static void list_dir(const string& dir, vector<string>& files) {
+  auto d = opendir(dir.c_str());
+  if (d == nullptr)
+    throw std::runtime_error("opendir " + dir + " failed. " + strerror(errno));
+  vector<string> names;
+  struct dirent* e;
+  while ((e = readdir(d)) != nullptr)
+    if (e->d_name[0] != '.') names.push_back(e->d_name);
+  closedir(d);
+
+  sort(names.begin(), names.end());
+  for (auto& n : names) {
+    struct stat st;
+    auto path = dir + "/" + n;
+    if (stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+      files.push_back(path);
+  }
+}
+
+/*
+ * name [-A] [-D] [-f] [-F] [-g] [-G] [-L] [-M] [-O] [-P] [-S] [-V] [-W]
+ *      [-a var]... [-C var=lower..upper]... [-s var=value]...
+ */
+static map<string, BatchJob> read_config(const char* config) {
+  map<string, BatchJob> jobs;
+  ifstream f{config};
+  if (!f.good()) throw std::runtime_error("Cannot read "s + config);
+
+  string line;
+  while (getline(f, line)) {
+    istringstream ss{line};
+    string name, opt;
+    if (!(ss >> name) || name[0] == '#') continue;
+    BatchJob job;
+    while (ss >> opt) {
+      if (opt == "-A") {
+        job.apply_all = true;
+      } else if (opt == "-D") {
+        job.discover = true;
+      } else if (opt == "-f") {
+        job.retarget = true;
+      } else if (opt == "-F") {
+        job.fold_vars = true;
+      } else if (opt == "-W") {
+        job.retarget = job.retarget_words = true;
+      } else if (opt == "-g") {
+        job.guard = false;
+      } else if (opt == "-G") {
+        job.strip = job.split_debug = true;
+      } else if (opt == "-L") {
+        job.prelink = true;
+      } else if (opt == "-M") {
+        job.move_vars = true;
+      } else if (opt == "-O") {
+        job.peephole = true;
+      } else if (opt == "-P") {
+        job.script = true;
+      } else if (opt == "-S") {
+        job.strip = true;
+      } else if (opt == "-V") {
+        job.verify = true;
+      } else if (opt == "-C" && ss >> opt) {
+        job.constraints.push_back(opt);
+      } else if (opt == "-a" && ss >> opt) {
+        job.apply.push_back(opt);
+      } else if (opt == "-s" && ss >> opt) {
+        job.changes.push_back(opt);
+      } else {
+        throw std::runtime_error("Bad option " + opt + " for " + name +
+                                 " in " + config);
+      }
+    }
+    jobs[name] = job;
+  }
+  return jobs;
+}
+
+vector<BatchJob> batch_jobs(const vector<string>& paths, const string& outdir,
+                            const BatchJob& defaults, const char* config) {
+  vector<string> files;
+  for (auto& p : paths) {
+    struct stat st;
+    if (stat(p.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+      list_dir(p, files);
+    else
+      files.push_back(p);
+  }
+
+  map<string, BatchJob> configured;
+  if (config != nullptr) configured = read_config(config);
+
+  /* Jobs run in parallel, one output would replace the other */
+  vector<BatchJob> jobs;
+  map<string, string> written;  // output -> infile
+  auto claim = [&](const string& out, const string& in) {
+    auto w = written.emplace(out, in);
+    if (!w.second)
+      throw std::runtime_error(w.first->second + " and " + in +
+                               " would both write " + out);
+  };
+  for (auto& f : files) {
+    auto it = configured.find(file_name(f));
+    auto job = it != configured.end() ? it->second : defaults;
+    job.infile = f;
+    job.outfile = outdir + "/" + file_name(f);
+    claim(job.outfile, f);
+    if (job.strip && job.split_debug) claim(job.outfile + ".debug", f);
+    jobs.push_back(job);
+  }
+
+  if (mkdir(outdir.c_str(), 0755) == -1 && errno != EEXIST)
+    throw std::runtime_error("mkdir " + outdir + " failed. " +
+                             strerror(errno));
+  return jobs;
+}
+
+static void tailor(const BatchJob& job) {
+  auto pre = preflight(job.infile);  // headers only, before reading it all
+  if (!pre.ok) throw std::runtime_error(pre.reason);
+  Bintail bintail{job.infile.c_str(), 1};  // files run in parallel
+  if (job.discover) bintail.discover_callsites();
+  auto debug_file = job.outfile + ".debug";
+  if (job.strip) bintail.strip(job.split_debug ? debug_file.c_str() : nullptr);
+  bintail.init_write(job.outfile.c_str(), job.apply_all);
+  for (auto& e : job.constraints) bintail.constrain(e, job.guard);
+  for (auto& e : job.changes) bintail.change(e);
+  for (auto& e : job.apply) bintail.apply(e, job.guard);
+  if (job.apply_all) bintail.apply_all(job.guard);
+  if (job.fold_vars) bintail.fold_frozen_vars();
+  if (job.move_vars) bintail.move_frozen_vars();
+  if (job.retarget) bintail.retarget_pointers(job.retarget_words);
+  if (job.peephole) bintail.peephole();
+  if (job.script) bintail.patch_script();
+  if (job.prelink) bintail.enable_prelink();
+  bintail.write();
+
+  if (!job.verify) return;
+  auto report = bintail.verify();
+  if (!report.ok())
+    throw std::runtime_error("verify: " + report.errors.front() + " (" +
+                             to_string(report.errors.size()) + " errors)");
+}
+
+vector<BatchResult> tailor_batch(const vector<BatchJob>& jobs,
+                                 unsigned threads) {
+  vector<BatchResult> results(jobs.size());
+  {
+    bintail::ThreadPool pool{threads};
+    vector<future<void>> done;
+    for (auto i = 0ul; i < jobs.size(); i++)
+      done.push_back(pool.submit([&jobs, &results, i] {
+        auto& r = results[i];
+        r.infile = jobs[i].infile;
+        auto start = chrono::steady_clock::now();
+        try {
+          tailor(jobs[i]);
+          r.ok = true;
+        } catch (const std::exception& e) {
+          r.error = e.what();
+        }
+        chrono::duration<double> d = chrono::steady_clock::now() - start;
+        r.seconds = d.count();
+      }));
+    for (auto& d : done) d.get();
+  }
+  return results;
+}
@@ -1,17 +1,24 @@
 #include <bintail/bintail.hpp>
 
 #include <assert.h>
-#include <err.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <cstdlib>
+#include <cstring>
+#include <future>
 #include <iomanip>
 #include <iostream>
 #include <regex>
 
+#include "checksum.h"
 #include "elf.h"
 #include "mvelem.h"
+#include "patch.h"
+#include "pool.h"
+#include "probe.h"
+#include "writer.h"
 
 using namespace std;
 
@@ -34,20 +41,37 @@ static Elf_Scn* get_scn(vector<struct sec>& secs, const char* name) {
 
 Bintail::~Bintail() {
   elf_end(e_out);
-  close(outfd);
+  if (outfd != -1) close(outfd);
+  if (!tmp_path.empty()) unlink(tmp_path.c_str());
   elf_end(e_in);
   close(infd);
 }
 
-Bintail::Bintail(const char* infile) {
-  exe_ = make_unique<bintail::ElfExe>(infile);
-
-  /* init libelf state */
-  if (elf_version(EV_CURRENT) == EV_NONE) errx(1, "libelf init failed");
+Bintail::Bintail(const char* infile, unsigned jobs, bool lazy)
+    : path{infile}, jobs{jobs} {
+  bintail::init_libelf();
   if ((infd = open(infile, O_RDONLY)) == -1)
-    errx(1, "open %s failed. %s", infile, strerror(errno));
-  if ((e_in = elf_begin(infd, ELF_C_READ, NULL)) == nullptr)
-    errx(1, "elf_begin infile failed.");
+    throw std::runtime_error("open "s + infile + " failed. " + strerror(errno));
+  if ((e_in = elf_begin(infd, ELF_C_READ, NULL)) == nullptr) {
+    close(infd);
+    throw std::runtime_error("elf_begin infile failed.");
+  }
+
+  try {
+    load();
+    BINTAIL_PROBE1(load, secs.size());
+    if (!lazy) require(LOAD_ALL);
+  } catch (...) {
+    elf_end(e_in);
+    close(infd);
+    throw;
+  }
+}
+
+/* Section lookup, everything else is read by require() */
+void Bintail::load() {
+  if (elf_kind(e_in) != ELF_K_ELF)
+    throw std::runtime_error("Not an ELF file.");
 
   /* EHDR */
   gelf_getehdr(e_in, &ehdr_in);
@@ -119,97 +143,186 @@ Bintail::Bintail(const char* infile) {
     mvdata.load(mvdata_scn);
     scn_handler[mvdata_scn] = &mvdata;
   }
+}
 
-  /* read info sections */
-  auto mvvar_infos = mvvar.read();
-  auto mvcs_infos = mvcs.read();
-  auto mvfn_infos = mvfn.read();
-  for (auto e : *mvvar_infos)
-    vars.push_back(make_unique<MVVar>(e, &rodata, &data));
-  for (auto e : *mvcs_infos) pps.push_back(make_unique<MVPP>(e, &text));
-  for (auto e : *mvfn_infos) {
-    auto f = make_unique<MVFn>(e, &mvdata, &text, &rodata);
-    auto pp = make_unique<MVPP>(f.get());
-    f->add_pp(pp.get());
-    fns.push_back(move(f));
-    pps.push_back(move(pp));
-  }
-
-  /* multiverse_init equivalent */
-  // find var & save ptr to it
-  //    add fn to var.functions_head
-  for (auto& fn : fns)
-    for (auto& var : vars) fn->probe_var(var.get());
-
-  // 1. Find function
-  // 2. Create patchpoint
-  // 3. Append pp to fn ll
-  for (auto& pp : pps)
-    for (auto& fn : fns) {
-      if (fn->location() != pp->function_body) continue;
-      fn->add_pp(pp.get());
-      pp->set_fn(fn.get());
+/*
+ * Read the missing parts as a task graph:
+ *
+ *   ElfExe copy ------------------------------------------.
+ *   symbols -----------> boundaries -> probe symbols (per  |
+ *   vars, callsites, fns -> link ----'  slice of fns)      |
+ *   relocations -------------------> claim relocations ----+-> done
+ *
+ * libelf reads section data lazily and without locks, so every section the
+ * tasks read is fetched before they start. Tasks fill their own results,
+ * which are joined in a fixed order: the model does not depend on jobs.
+ */
+void Bintail::require(unsigned parts) {
+  if (parts & (LOAD_MODEL | LOAD_RELOCS)) parts |= LOAD_SYMS;
+  parts &= ~loaded;
+  if (parts == 0) return;
+  BINTAIL_PROBE1(require_start, parts);
+
+  auto want = [&](unsigned part) { return (parts & part) != 0; };
+
+  /* Prefetch for the tasks */
+  GElf_Shdr sym_shdr, rela_shdr;
+  Elf_Data *sym_d = nullptr, *rela_d = nullptr;
+  if (want(LOAD_SYMS)) {
+    gelf_getshdr(symtab_scn, &sym_shdr);
+    sym_d = elf_getdata(symtab_scn, nullptr);
+    elf_getdata(elf_getscn(e_in, sym_shdr.sh_link), nullptr);
+  }
+  if (want(LOAD_RELOCS)) {
+    gelf_getshdr(reloc_scn_in, &rela_shdr);
+    rela_d = elf_getdata(reloc_scn_in, nullptr);
+  }
+  unique_ptr<vector<mv_info_var>> mvvar_infos;
+  unique_ptr<vector<mv_info_callsite>> mvcs_infos;
+  unique_ptr<vector<mv_info_fn>> mvfn_infos;
+  if (want(LOAD_MODEL)) {
+    mvvar_infos = mvvar.read();
+    mvcs_infos = mvcs.read();
+    mvfn_infos = mvfn.read();
+    model.vars.reserve(mvvar_infos->size());
+    model.fns.reserve(mvfn_infos->size());
+    model.pps.reserve(mvcs_infos->size() + mvfn_infos->size());
+  }
+  vector<MVPP> callsites;
+  vector<GElf_Rela> relas;
+
+  /* Declared after everything the tasks write: drained before unwinding */
+  unique_ptr<bintail::ThreadPool> pool;
+  if (jobs != 1) pool = make_unique<bintail::ThreadPool>(jobs);
+  auto spawn = [&](auto f) -> future<decltype(f())> {
+    if (pool == nullptr) return async(launch::deferred, move(f));
+    return pool->submit(move(f));
+  };
+
+  future<unique_ptr<bintail::ElfExe>> exe;
+  future<void> symbols, relocations, vars, decoded, fns;
+  if (want(LOAD_EXE))
+    exe = spawn([this] { return make_unique<bintail::ElfExe>(path.c_str()); });
+  if (want(LOAD_SYMS))
+    symbols = spawn([&] {
+      /* Keep symbols the same (refs to index) */
+      GElf_Sym sym;
+      for (size_t i = 0; i < sym_d->d_size / sym_shdr.sh_entsize; i++) {
+        gelf_getsym(sym_d, i, &sym);
+        struct symbol s;
+        s.sym = sym;
+        s.name = elf_strptr(e_in, sym_shdr.sh_link, sym.st_name);
+        syms.push_back(s);
+      }
+    });
+  if (want(LOAD_RELOCS))
+    relocations = spawn([&] {
+      relas.resize(rela_d->d_size / rela_shdr.sh_entsize);
+      for (size_t i = 0; i < relas.size(); i++)
+        gelf_getrela(rela_d, i, &relas[i]);
+    });
+  if (want(LOAD_MODEL)) {
+    vars = spawn([&] {
+      for (auto e : *mvvar_infos)
+        model.vars.emplace_back(e, &model, &rodata, &data);
+    });
+    decoded = spawn([&] {
+      for (auto e : *mvcs_infos) callsites.emplace_back(e, &text);
+    });
+    fns = spawn([&] {
+      for (auto e : *mvfn_infos)
+        model.fns.emplace_back(e, &model, &mvdata, &text, &rodata);
+    });
+
+    vars.get();
+    decoded.get();
+    fns.get();
+    for (auto& cs : callsites) model.pps.push_back(move(cs));
+    for (auto& fn : model.fns) model.pps.emplace_back(&fn);
+    model.link();
+  }
+
+  if (want(LOAD_SYMS)) {
+    symbols.get();
+    try {
+      mvvar.start_ptr = sym_value(syms, "__start___multiverse_var_ptr");
+      mvvar.stop_ptr = sym_value(syms, "__stop___multiverse_var_ptr");
+      mvfn.start_ptr = sym_value(syms, "__start___multiverse_fn_ptr");
+      mvfn.stop_ptr = sym_value(syms, "__stop___multiverse_fn_ptr");
+      mvcs.start_ptr = sym_value(syms, "__start___multiverse_callsite_ptr");
+      mvcs.stop_ptr = sym_value(syms, "__stop___multiverse_callsite_ptr");
+    } catch (...) {
+      throw std::runtime_error("Symbols missing, cannot be tailored");
     }
 
-  /* Keep symbols the same (refs to index) */
-  GElf_Sym sym;
-  Elf_Data* d2 = elf_getdata(symtab_scn, nullptr);
-  gelf_getshdr(symtab_scn, &shdr);
-  for (size_t i = 0; i < d2->d_size / shdr.sh_entsize; i++) {
-    gelf_getsym(d2, i, &sym);
-    struct symbol s;
-    s.sym = sym;
-    s.name = elf_strptr(e_in, shdr.sh_link, sym.st_name);
-    syms.push_back(s);
+    auto records = [&](const char* name, size_t size) {
+      return (sym_value(syms, ("__stop_"s + name).c_str()) -
+              sym_value(syms, ("__start_"s + name).c_str())) /
+             size;
+    };
+    boundary_vars = records("__multiverse_var_", sizeof(mv_info_var));
+    boundary_fns = records("__multiverse_fn_", sizeof(mv_info_fn));
+    boundary_cs = records("__multiverse_callsite_", sizeof(mv_info_callsite));
   }
-  try {
-    mvvar.start_ptr = sym_value(syms, "__start___multiverse_var_ptr");
-    mvvar.stop_ptr = sym_value(syms, "__stop___multiverse_var_ptr");
-    mvfn.start_ptr = sym_value(syms, "__start___multiverse_fn_ptr");
-    mvfn.stop_ptr = sym_value(syms, "__stop___multiverse_fn_ptr");
-    mvcs.start_ptr = sym_value(syms, "__start___multiverse_callsite_ptr");
-    mvcs.stop_ptr = sym_value(syms, "__stop___multiverse_callsite_ptr");
-  } catch (...) {
-    cout << "Symbols missing, cannot be tailored\n";
-    close(infd);
-    exit(0);
-  }
-
-  int boundary_sz;
-  boundary_sz = sym_value(syms, "__stop___multiverse_var_") -
-                sym_value(syms, "__start___multiverse_var_");
-  cout << " var=" << boundary_sz / sizeof(struct mv_info_var) << " ";
-  boundary_sz = sym_value(syms, "__stop___multiverse_fn_") -
-                sym_value(syms, "__start___multiverse_fn_");
-  cout << " fn=" << boundary_sz / sizeof(struct mv_info_fn) << " ";
-  boundary_sz = sym_value(syms, "__stop___multiverse_callsite_") -
-                sym_value(syms, "__start___multiverse_callsite_");
-  cout << " cs=" << boundary_sz / sizeof(struct mv_info_callsite) << " ";
-
-  for (auto& sym : syms)
-    for (auto& fn : fns) fn->probe_sym(sym);
-
-  GElf_Rela rela;
-  gelf_getshdr(reloc_scn_in, &shdr);
-  auto d = elf_getdata(reloc_scn_in, nullptr);
-  for (size_t i = 0; i < d->d_size / shdr.sh_entsize; i++) {
-    gelf_getrela(d, i, &rela);
-    auto claims = 0u;
-    claims += mvvar.probe_rela(&rela);
-    claims += mvfn.probe_rela(&rela);
-    claims += mvcs.probe_rela(&rela);
-    claims += mvdata.probe_rela(&rela);
-    if (claims == 0) rela_other.push_back(rela);
+
+  if (want(LOAD_MODEL)) {
+    /* Each slice of fns only writes its own symbols */
+    vector<future<void>> probed;
+    auto slices = pool != nullptr ? pool->size() : 1;
+    auto step = (model.fns.size() + slices - 1) / slices;
+    for (auto first = 0ul; first < model.fns.size(); first += step)
+      probed.push_back(spawn([&, first, step] {
+        auto last = min(first + step, model.fns.size());
+        for (auto& sym : syms)
+          for (auto i = first; i < last; i++) model.fns[i].probe_sym(sym);
+      }));
+    for (auto& p : probed) p.get();
+  }
+
+  if (want(LOAD_RELOCS)) {
+    relocations.get();
+    relocs_in = relas.size();
+    for (auto& rela : relas) {
+      auto claims = 0u;
+      claims += mvvar.probe_rela(&rela);
+      claims += mvfn.probe_rela(&rela);
+      claims += mvcs.probe_rela(&rela);
+      claims += mvdata.probe_rela(&rela);
+      if (claims == 0) rela_other.push_back(rela);
+    }
   }
+  if (want(LOAD_EXE)) exe_ = exe.get();
+  loaded |= parts;
+  BINTAIL_PROBE4(require_done, parts, model.vars.size(), model.fns.size(),
+                 model.pps.size());
 }
 
 void Bintail::change(string change_str) {
   smatch m;
   regex_search(change_str, m, regex(R"((\w+)=(\d+))"));
   auto var_name = m.str(1);
-  auto value = stoi(m.str(2));
-  for (auto& v : vars)
-    if (var_name == v->name()) v->set_value(value, &data);
+  auto value = stoll(m.str(2));
+  for (auto& v : model.vars)
+    if (var_name == v.name()) v.set_value(value, &data);
+}
+
+/**
+ * Keep var=lower..upper switchable, drop the variants outside
+ */
+size_t Bintail::constrain(string constraint_str, bool guard) {
+  smatch m;
+  if (!regex_match(constraint_str, m, regex(R"((\w+)=(\d+)\.\.(\d+))")))
+    throw std::runtime_error("Expected var=lower..upper, got " +
+                             constraint_str);
+  auto var_name = m.str(1);
+  auto lower = stoul(m.str(2)), upper = stoul(m.str(3));
+  if (upper > UINT32_MAX)
+    throw std::runtime_error("Range of " + var_name + " exceeds 32 bits");
+  size_t dropped = 0;
+  for (auto& v : model.vars)
+    if (var_name == v.name() && !v.frozen)
+      dropped += v.constrain(lower, upper, &text, guard);
+  return dropped;
 }
 
 /**
@@ -220,12 +333,21 @@ void Bintail::apply(string change_str, bool guard) {
   smatch m;
   regex_search(change_str, m, regex(R"((\w+))"));
   auto var_name = m.str(1);
-  for (auto& e : vars)
-    if (var_name == e->name()) e->apply(&text, guard);
+  vector<bintail::PatchSite> sites;
+  BINTAIL_PROBE1(apply_start, 1);
+  for (auto& e : model.vars)
+    if (var_name == e.name()) e.apply(&text, guard, &sites);
+  bintail::write_patches(sites, &text);
+  BINTAIL_PROBE1(apply_done, sites.size());
 }
 
+/* Patches of all functions are collected and written in one pass */
 void Bintail::apply_all(bool guard) {
-  for (auto& v : vars) v->apply(&text, guard);
+  vector<bintail::PatchSite> sites;
+  BINTAIL_PROBE1(apply_start, model.vars.size());
+  for (auto& v : model.vars) v.apply(&text, guard, &sites);
+  bintail::write_patches(sites, &text);
+  BINTAIL_PROBE1(apply_done, sites.size());
 }
 
 /**
@@ -253,6 +375,7 @@ void Bintail::update_relocs_sym() {
     }
 
   assert(sizeof(GElf_Rela) == shdr.sh_entsize);
+  relocs_out = i;
   shdr.sh_size = i * sizeof(GElf_Rela);
   d->d_size = shdr.sh_size;
 
@@ -266,11 +389,15 @@ void Bintail::update_relocs_sym() {
     relacount->d_un.d_val = cnt;
   }
 
-  // SYMS
+  // SYMS, section indices of removed sections become absolute
   i = 0;
   for (auto s : syms) {
+    auto& ndx = s.sym.st_shndx;
+    if (ndx != SHN_UNDEF && ndx < SHN_LORESERVE)
+      ndx = scn_index[ndx] != 0 ? scn_index[ndx] : SHN_ABS;
     if (!gelf_update_sym(d2, i++, &s.sym))
-      cout << "Error: gelf_update_sym() " << elf_errmsg(elf_errno()) << endl;
+      throw std::runtime_error("Error: gelf_update_sym() "s +
+                               elf_errmsg(elf_errno()));
   }
 
   assert(sizeof(GElf_Sym) == sym_shdr.sh_entsize);
@@ -283,15 +410,27 @@ void Bintail::update_relocs_sym() {
   gelf_update_shdr(symtab_scn, &sym_shdr);
   elf_flagshdr(reloc_scn_out, ELF_C_SET, ELF_F_DIRTY);
   elf_flagshdr(symtab_scn, ELF_C_SET, ELF_F_DIRTY);
+  BINTAIL_PROBE3(relocs_done, relocs_out, cnt, i);
 }
 
 /* Create file until MVInfo data */
 void Bintail::init_write(const char* outfile, bool apply_all) {
-  if ((outfd = open(outfile, O_WRONLY | O_CREAT,
-                    S_IRUSR | S_IWUSR | S_IXUSR)) == -1)
-    errx(1, "open %s failed. %s", outfile, strerror(errno));
+  require(LOAD_ALL);
+  BINTAIL_PROBE(init_write_start);
+  if (log != nullptr)
+    *log << " var=" << boundary_vars << "  fn=" << boundary_fns
+         << "  cs=" << boundary_cs << " ";
+  /* Written next to outfile and renamed, a reader never sees it partly */
+  out_path = outfile;
+  tmp_path = out_path + ".XXXXXX";
+  if ((outfd = mkstemp(&tmp_path[0])) == -1) {
+    tmp_path.clear();
+    throw std::runtime_error("open "s + outfile + " failed. " +
+                             strerror(errno));
+  }
+  fchmod(outfd, S_IRUSR | S_IWUSR | S_IXUSR);
   if ((e_out = elf_begin(outfd, ELF_C_WRITE, NULL)) == nullptr)
-    errx(1, "elf_begin outfile failed.");
+    throw std::runtime_error("elf_begin outfile failed.");
 
   // Manual layout: Sections in segments have to be relocated manualy
   elf_flagelf(e_out, ELF_C_SET, ELF_F_LAYOUT);
@@ -301,10 +440,10 @@ void Bintail::init_write(const char* outfile, bool apply_all) {
   bool fpic = (ehdr_in.e_type == ET_DYN);
 
   /* MV Sections */
-  mvdata.set_fns(&fns);
-  mvfn.set_fns(&fns);
-  mvvar.set_vars(&vars);
-  mvcs.set_pps(&pps);
+  mvdata.set_model(&model);
+  mvfn.set_model(&model);
+  mvvar.set_model(&model);
+  mvcs.set_model(&model);
   /* MV Areas */
   mvinfo_area =
       make_unique<InfoArea>(e_out, fpic, &mvdata, &mvvar, &mvfn, &mvcs, &bss);
@@ -330,42 +469,174 @@ void Bintail::init_write(const char* outfile, bool apply_all) {
   Elf_Data *data_in, *data_out;
   GElf_Shdr shdr_in, shdr_out;
   size_t shstrndx;
-  removed_scns = 0;
   elf_getshdrstrndx(e_in, &shstrndx);
-  while ((scn_in = elf_nextscn(e_in, scn_in)) != nullptr) {
+  scn_index.assign(secs.size() + 1, 0);
+  size_t kept = 0;
+  for (auto& s : secs) {
+    scn_in = s.scn;
     gelf_getshdr(scn_in, &shdr_in);
+    if (strip_enabled && is_debug(s)) continue;
     auto it = scn_handler.find(scn_in);
     if (it != scn_handler.end()) {
       auto sec = it->second;
-      if (sec->is_needed(apply_all == false) == false) {
-        removed_scns++;
-        continue;
-      }
+      if (sec->is_needed(apply_all == false) == false) continue;
       if ((scn_out = elf_newscn(e_out)) == nullptr)
-        errx(1, "elf_newscn failed.");
+        throw std::runtime_error("elf_newscn failed.");
       sec->set_out_scn(scn_out);
     } else {
       if ((scn_out = elf_newscn(e_out)) == nullptr)
-        errx(1, "elf_newscn failed.");
+        throw std::runtime_error("elf_newscn failed.");
     }
     if (scn_in == reloc_scn_in) reloc_scn_out = scn_out;
+    s.scn_out = scn_out;
+    scn_index[elf_ndxscn(scn_in)] = ++kept;
 
     /* Copy scn shdr & data */
     gelf_getshdr(scn_out, &shdr_out);
     shdr_out = shdr_in;
-    if (removed_scns != 0 && shdr_in.sh_link > 0)
-      shdr_out.sh_link -= removed_scns;
     gelf_update_shdr(scn_out, &shdr_out);
 
     data_in = elf_getdata(scn_in, nullptr);
     if ((data_out = elf_newdata(scn_out)) == nullptr)
-      errx(1, "elf_newdata failed.");
+      throw std::runtime_error("elf_newdata failed.");
     *data_out = *data_in;  // malloc & memcpy ???
   }
+
+  /* Links to section indices, now that all of them are known */
+  for (auto& s : secs) {
+    if (s.scn_out == nullptr) continue;
+    gelf_getshdr(s.scn_out, &shdr_out);
+    shdr_out.sh_link = scn_index[s.shdr.sh_link];
+    if (s.shdr.sh_flags & SHF_INFO_LINK)
+      shdr_out.sh_info = scn_index[s.shdr.sh_info];
+    gelf_update_shdr(s.scn_out, &shdr_out);
+  }
+  ehdr_out.e_shstrndx = scn_index[shstrndx];
+  ehdr_out.e_shnum = kept + 1;
+
+  if (strip_enabled) {
+    compact_nonalloc();
+    if (!debug_file.empty()) write_debug_file();
+  }
+
+  if (report_enabled) snapshot_input();
+  BINTAIL_PROBE2(init_write_done, kept, secs.size());
+}
+
+/* Sections strip() drops: not loaded, except for the symbol table */
+bool Bintail::is_debug(const struct sec& s) {
+  size_t shstrndx;
+  elf_getshdrstrndx(e_in, &shstrndx);
+  GElf_Shdr symtab;
+  gelf_getshdr(symtab_scn, &symtab);
+  auto ndx = elf_ndxscn(s.scn);
+  return !(s.shdr.sh_flags & SHF_ALLOC) && ndx != shstrndx &&
+         s.scn != symtab_scn && ndx != symtab.sh_link;
+}
+
+void Bintail::strip(const char* debug_file) {
+  strip_enabled = true;
+  this->debug_file = debug_file != nullptr ? debug_file : "";
+}
+
+/* Close the gaps stripped sections left behind the loaded ones */
+void Bintail::compact_nonalloc() {
+  GElf_Shdr shdr;
+  uint64_t end = ehdr_out.e_phoff + ehdr_out.e_phnum * ehdr_out.e_phentsize;
+  vector<pair<uint64_t, Elf_Scn*>> nonalloc;
+  for (auto& s : secs) {
+    if (s.scn_out == nullptr) continue;
+    gelf_getshdr(s.scn_out, &shdr);
+    if (shdr.sh_flags & SHF_ALLOC) {
+      auto size = shdr.sh_type == SHT_NOBITS ? 0 : shdr.sh_size;
+      end = max(end, shdr.sh_offset + size);
+    } else {
+      nonalloc.emplace_back(shdr.sh_offset, s.scn_out);
+    }
+  }
+  sort(nonalloc.begin(), nonalloc.end());
+  for (auto& n : nonalloc) {
+    gelf_getshdr(n.second, &shdr);
+    auto align = max<uint64_t>(shdr.sh_addralign, 1);
+    shdr.sh_offset = (end + align - 1) / align * align;
+    end = shdr.sh_offset + shdr.sh_size;
+    gelf_update_shdr(n.second, &shdr);
+  }
+  ehdr_out.e_shoff = (end + 7) / 8 * 8;
 }
 
+/*
+ * The stripped sections in a file of their own, like objcopy
+ * --only-keep-debug: same section table, loaded sections become NOBITS.
+ * .gnu_debuglink of the output names it with its CRC.
+ */
+void Bintail::write_debug_file() {
+  auto fd = open(debug_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                 S_IRUSR | S_IWUSR);
+  if (fd == -1)
+    throw std::runtime_error("open " + debug_file + " failed. " +
+                             strerror(errno));
+  auto e = elf_begin(fd, ELF_C_WRITE, nullptr);
+  if (e == nullptr) {
+    close(fd);
+    throw std::runtime_error("elf_begin debug file failed.");
+  }
+  elf_flagelf(e, ELF_C_SET, ELF_F_LAYOUT);
+  GElf_Ehdr ehdr;
+  gelf_newehdr(e, ELFCLASS64);
+  gelf_getehdr(e, &ehdr);
+  ehdr = ehdr_in;
+  ehdr.e_phoff = 0;
+  ehdr.e_phnum = 0;
+
+  uint64_t off = ehdr.e_ehsize;
+  GElf_Shdr shdr;
+  for (auto& s : secs) {
+    auto scn = elf_newscn(e);
+    shdr = s.shdr;
+    if ((s.shdr.sh_flags & SHF_ALLOC) || shdr.sh_type == SHT_NOBITS) {
+      shdr.sh_type = SHT_NOBITS;
+      shdr.sh_offset = off;
+    } else {
+      auto d = elf_newdata(scn);
+      *d = *elf_getdata(s.scn, nullptr);
+      auto align = max<uint64_t>(shdr.sh_addralign, 1);
+      shdr.sh_offset = (off + align - 1) / align * align;
+      off = shdr.sh_offset + shdr.sh_size;
+    }
+    gelf_update_shdr(scn, &shdr);
+  }
+  ehdr.e_shoff = (off + 7) / 8 * 8;
+  gelf_update_ehdr(e, &ehdr);
+  try {
+    bintail::update_elf(e, fd, 0);
+  } catch (...) {
+    elf_end(e);
+    close(fd);
+    throw;
+  }
+  elf_end(e);
+  close(fd);
+
+  /* name, 0 padded to 4, crc32 */
+  auto buf = bintail::read_file(debug_file);
+  auto name = debug_file.substr(debug_file.find_last_of('/') + 1);
+  debuglink.assign(name.begin(), name.end());
+  debuglink.resize((name.size() + 4) / 4 * 4, 0);
+  auto crc = bintail::crc32(buf.data(), buf.size());
+  auto p = reinterpret_cast<const uint8_t*>(&crc);
+  debuglink.insert(debuglink.end(), p, p + sizeof(crc));
+}
+
+void Bintail::enable_prelink() { prelink_enabled = true; }
+
+void Bintail::set_fill(uint8_t fill) { fill_byte = fill; }
+
+void Bintail::set_log(std::ostream* os) { log = os; }
+
 void Bintail::write() {
-  mvinfo_area->generate(&data);
+  mvinfo_area->prelink = prelink_enabled;
+  mvinfo_area->generate(&data, &text);
 
   update_relocs_sym();
   dynamic.write();
@@ -381,29 +652,99 @@ void Bintail::write() {
     if (shdr.sh_offset < area_end || scn == bss.scn_out) continue;
     shdr.sh_offset -= shift;
     gelf_update_shdr(scn, &shdr);
+    BINTAIL_PROBE2(section_shifted, shdr.sh_offset, shift);
     // elf_flagshdr(scn, ELF_C_SET, ELF_F_DIRTY);
     // auto d = elf_getdata(scn, nullptr);
     // elf_flagdata(d, ELF_C_SET, ELF_F_DIRTY);
   }
 
-  ehdr_out.e_shstrndx -= removed_scns;
-  ehdr_out.e_shnum -= removed_scns;
   // Section table after sections, adjust for bss (growth in mem, 0 in file)
   ehdr_out.e_shoff -= shift;
-  cout << " shift=" << shift << "\n";
+  bss_shift = shift;
+  if (log != nullptr) *log << " shift=" << shift << "\n";
+  if (!ro_vars.empty()) write_ro_vars();
+  if (!script.empty()) append_section(".multiverse_patch", script);
+  if (!debuglink.empty()) append_section(".gnu_debuglink", debuglink);
   gelf_update_ehdr(e_out, &ehdr_out);
+  for (auto& h : scn_handler) h.second->commit();
+
+  // ToDo(Felix): .dynamic fill
+  bintail::update_elf(e_out, outfd, fill_byte);
+  if (rename(tmp_path.c_str(), out_path.c_str()) == -1)
+    throw std::runtime_error("rename to "s + out_path + " failed. " +
+                             strerror(errno));
+  tmp_path.clear();
+}
+
+/*
+ * Add a section behind the last one or at offset if that is not 0,
+ * without memory image unless addr is set. .shstrtab moves behind the
+ * last section to take the name, the section table goes last.
+ */
+void Bintail::append_section(const char* name, vector<uint8_t>& bytes,
+                             uint64_t addr, uint64_t offset) {
+  uint64_t end = 0;
+  GElf_Shdr shdr;
+  Elf_Scn* scn = nullptr;
+  while ((scn = elf_nextscn(e_out, scn))) {
+    gelf_getshdr(scn, &shdr);
+    auto size = shdr.sh_type == SHT_NOBITS ? 0 : shdr.sh_size;
+    end = max(end, shdr.sh_offset + size);
+  }
 
-  elf_fill(0xcccccccc);  // asm(int 0x3) // ToDo(Felix): .dynamic fill
-  if (elf_update(e_out, ELF_C_WRITE) < 0) {
-    cout << elf_errmsg(elf_errno()) << endl;
-    errx(1, "elf_update(write) failed.");
+  auto strscn = elf_getscn(e_out, ehdr_out.e_shstrndx);
+  auto strdata = elf_getdata(strscn, nullptr);
+  auto strs = static_cast<uint8_t*>(strdata->d_buf);
+  vector<uint8_t> names(strs, strs + strdata->d_size);  // may be shstrtab_out
+  auto name_off = names.size();
+  names.insert(names.end(), name, name + strlen(name) + 1);
+  shstrtab_out.swap(names);
+  strdata->d_buf = shstrtab_out.data();
+  strdata->d_size = shstrtab_out.size();
+  elf_flagdata(strdata, ELF_C_SET, ELF_F_DIRTY);
+  gelf_getshdr(strscn, &shdr);
+  shdr.sh_offset = end;
+  shdr.sh_size = shstrtab_out.size();
+  gelf_update_shdr(strscn, &shdr);
+  end += shdr.sh_size;
+
+  if ((scn = elf_newscn(e_out)) == nullptr)
+    throw std::runtime_error("elf_newscn failed.");
+  auto data = elf_newdata(scn);
+  if (data == nullptr) throw std::runtime_error("elf_newdata failed.");
+  data->d_buf = bytes.data();
+  data->d_size = bytes.size();
+  data->d_type = ELF_T_BYTE;
+  data->d_align = 8;
+  data->d_off = 0;
+  data->d_version = EV_CURRENT;
+  gelf_getshdr(scn, &shdr);
+  shdr = {};
+  shdr.sh_name = name_off;
+  shdr.sh_type = SHT_PROGBITS;
+  shdr.sh_addralign = 8;
+  shdr.sh_offset = (end + 7) / 8 * 8;
+  if (offset != 0) {
+    if (offset < shdr.sh_offset)
+      throw std::runtime_error("No room for "s + name + " at its offset");
+    shdr.sh_offset = offset;
   }
+  shdr.sh_size = bytes.size();
+  if (addr != 0) {
+    shdr.sh_flags = SHF_ALLOC;
+    shdr.sh_addr = addr;
+  }
+  gelf_update_shdr(scn, &shdr);
+
+  ehdr_out.e_shoff = (shdr.sh_offset + shdr.sh_size + 7) / 8 * 8;
+  ehdr_out.e_shnum++;
 }
 
 /*
  * PRINTING
  */
 void Bintail::print_sym() {
+  require(LOAD_SYMS);
   cout << ANSI_COLOR_YELLOW "\nSyms:\n" ANSI_COLOR_RESET;
   for (auto& sym : syms) {
     cout << "\t" << setw(34) << sym.name << hex
@@ -412,7 +753,7 @@ void Bintail::print_sym() {
          << "\t"                     /* Symbol visibility */
          << sym.sym.st_value << "\t" /* Symbol value */
          << sym.sym.st_size << "\t"  /* Symbol size */
-         << endl;
+         << "\n";
   }
   cout << ANSI_COLOR_YELLOW "\nboundry ptr:" ANSI_COLOR_RESET << hex
        << "\n\tmvvar.start_ptr=0x" << mvvar.start_ptr << "\n\tmvvar.stop_ptr=0x"
@@ -422,6 +763,7 @@ void Bintail::print_sym() {
 }
 
 void Bintail::print_reloc() {
+  require(LOAD_RELOCS);
 #define PRINT_RELOC(S, T)                              \
   cout << ANSI_COLOR_YELLOW #S ":\n" ANSI_COLOR_RESET; \
   S.print(sizeof(T));
@@ -432,15 +774,41 @@ void Bintail::print_reloc() {
   PRINT_RELOC(mvdata, mv_info_callsite);
 
   cout << ANSI_COLOR_RED "\nRela other:\n" ANSI_COLOR_RESET;
-  for (auto rela : rela_other) {
-    cout << hex << " offset=0x" << rela.r_offset << " addend=0x"
-         << rela.r_addend;
-    for (auto s : secs)
-      if (rela.r_offset < s.shdr.sh_addr + s.shdr.sh_size &&
-          rela.r_offset >= s.shdr.sh_addr)
-        cout << " - " << s.name;
-    cout << endl;
+  for (auto& r : label_relocs(rela_other)) {
+    cout << hex << " offset=0x" << r.first.r_offset << " addend=0x"
+         << r.first.r_addend;
+    if (!r.second.empty()) cout << " - " << r.second;
+    cout << "\n";
+  }
+}
+
+/* Merge relocations sorted by offset with the sections sorted by address */
+vector<pair<GElf_Rela, string_view>> Bintail::label_relocs(
+    vector<GElf_Rela> relas) {
+  stable_sort(relas.begin(), relas.end(),
+              [](auto& a, auto& b) { return a.r_offset < b.r_offset; });
+  vector<const struct sec*> by_addr;
+  for (auto& s : secs)
+    if ((s.shdr.sh_flags & SHF_ALLOC) &&
+        !(s.shdr.sh_type == SHT_NOBITS && (s.shdr.sh_flags & SHF_TLS)))
+      by_addr.push_back(&s);
+  sort(by_addr.begin(), by_addr.end(),
+       [](auto a, auto b) { return a->shdr.sh_addr < b->shdr.sh_addr; });
+  auto end = [](const struct sec* s) {
+    return s->shdr.sh_addr + s->shdr.sh_size;
+  };
+
+  vector<pair<GElf_Rela, string_view>> labeled;
+  auto i = 0ul;
+  for (auto& r : relas) {
+    while (i < by_addr.size() && end(by_addr[i]) <= r.r_offset) i++;
+    string_view name;
+    for (auto j = i;
+         j < by_addr.size() && by_addr[j]->shdr.sh_addr <= r.r_offset; j++)
+      if (r.r_offset < end(by_addr[j])) name = by_addr[j]->name;
+    labeled.emplace_back(r, name);
   }
+  return labeled;
 }
 
 void Bintail::print_dyn() {
@@ -449,5 +817,6 @@ void Bintail::print_dyn() {
 }
 
 void Bintail::print() {
-  for (auto& var : vars) var->print();
+  require(LOAD_MODEL);
+  for (auto& var : model.vars) var.print();
 }
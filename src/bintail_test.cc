@@ -1,11 +1,88 @@
 #include <catch2/catch.hpp>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <future>
 #include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
 
 #include <bintail/bintail.hpp>
+#include "checksum.h"
+#include "elf.h"
+#include "info.h"
+#include "mvelem.h"
+#include "patch.h"
+#include "x86.h"
 
 const auto sample_simple = "./samples/simple";
+const auto sample_fptr = "./samples/fptr";
+const auto sample_bss = "./samples/bss-nolib";
+const auto sample_discover = "./samples/discover";
+
+static const GElf_Sym& find_sym(Bintail& bintail, std::string_view name) {
+  auto& syms = bintail.syms;
+  auto it = std::find_if(syms.begin(), syms.end(),
+                         [&](auto& s) { return s.name == name; });
+  REQUIRE(it != syms.end());
+  return it->sym;
+}
+
+static uint64_t sym_addr(Bintail& bintail, std::string_view name) {
+  return find_sym(bintail, name).st_value;
+}
+
+static MVFn& find_fn(Bintail& bintail, std::string_view name) {
+  auto& fns = bintail.model.fns;
+  auto it = std::find_if(fns.begin(), fns.end(),
+                         [&](auto& fn) { return fn.name() == name; });
+  REQUIRE(it != fns.end());
+  return *it;
+}
+
+static std::vector<GElf_Phdr> phdrs_of(const char* path) {
+  auto fd = open(path, O_RDONLY);
+  REQUIRE(fd != -1);
+  auto e = elf_begin(fd, ELF_C_READ, nullptr);
+  size_t phnum = 0;
+  elf_getphdrnum(e, &phnum);
+  std::vector<GElf_Phdr> phdrs(phnum);
+  for (auto i = 0ul; i < phnum; i++) gelf_getphdr(e, i, &phdrs[i]);
+  elf_end(e);
+  close(fd);
+  return phdrs;
+}
+
+static std::vector<std::string> section_names(const char* path) {
+  auto fd = open(path, O_RDONLY);
+  REQUIRE(fd != -1);
+  auto e = elf_begin(fd, ELF_C_READ, nullptr);
+  size_t shstrndx;
+  elf_getshdrstrndx(e, &shstrndx);
+  std::vector<std::string> names;
+  GElf_Shdr shdr;
+  for (Elf_Scn* scn = nullptr; (scn = elf_nextscn(e, scn)) != nullptr;) {
+    gelf_getshdr(scn, &shdr);
+    names.push_back(elf_strptr(e, shstrndx, shdr.sh_name));
+  }
+  elf_end(e);
+  close(fd);
+  return names;
+}
+
+/* Output bytes of s at vaddr */
+static uint8_t* out_at(Section& s, uint64_t vaddr) {
+  GElf_Shdr shdr;
+  gelf_getshdr(s.scn_out, &shdr);
+  REQUIRE(vaddr >= shdr.sh_addr);
+  REQUIRE(vaddr < shdr.sh_addr + shdr.sh_size);
+  return s.out_buf() + (vaddr - shdr.sh_addr);
+}
 
 TEST_CASE("Bintail can read and write an executable") {
   const auto outfile = "/tmp/bintail-test-rwsimple";
@@ -19,3 +96,750 @@ TEST_CASE("Bintail can read and write an executable") {
   f.open(outfile);
   REQUIRE(f.good());
 }
+
+TEST_CASE("Explore stores every configuration once") {
+  const auto outdir = "/tmp/bintail-test-explore";
+
+  auto results = explore(sample_simple, outdir, 2);
+  REQUIRE(results.size() == 2);  // config=0, config=1
+  for (auto& r : results) {
+    std::ifstream f{std::string{outdir} + "/" + r.artifact};
+    REQUIRE(f.good());
+  }
+  REQUIRE(results[0].artifact != results[1].artifact);
+}
+
+TEST_CASE("A failing batch job does not stop the others") {
+  BatchJob defaults;
+  defaults.apply_all = true;
+  auto jobs = batch_jobs({sample_simple, "./samples/does-not-exist"},
+                         "/tmp/bintail-test-batch", defaults);
+
+  auto results = tailor_batch(jobs, 2);
+  REQUIRE(results.size() == 2);
+  REQUIRE(results[0].ok);
+  REQUIRE_FALSE(results[1].ok);
+  REQUIRE_FALSE(results[1].error.empty());
+}
+
+TEST_CASE("Batch refuses inputs that write the same output") {
+  BatchJob defaults;
+  REQUIRE_THROWS(batch_jobs({sample_simple, "/tmp/bintail-test-dup/simple"},
+                            "/tmp/bintail-test-batch", defaults));
+
+  /* -G: b.debug is also the debug file of b */
+  std::vector<std::string> paths{"/tmp/bintail-test-dup/b",
+                                 "/tmp/bintail-test-dup/b.debug"};
+  defaults.strip = defaults.split_debug = true;
+  REQUIRE_THROWS(batch_jobs(paths, "/tmp/bintail-test-batch", defaults));
+  defaults.split_debug = false;
+  REQUIRE(batch_jobs(paths, "/tmp/bintail-test-batch", defaults).size() == 2);
+}
+
+TEST_CASE("Tailored code passes verification") {
+  const auto outfile = "/tmp/bintail-test-verify";
+  remove(outfile);
+
+  Bintail bintail{sample_simple};
+  bintail.init_write(outfile, true);
+  bintail.apply_all(true);
+  bintail.write();
+
+  auto report = bintail.verify();
+  REQUIRE(report.ok());
+  REQUIRE(report.patchpoints > 0);
+}
+
+TEST_CASE("Report counts the changes of a tailoring run") {
+  const auto outfile = "/tmp/bintail-test-report";
+  remove(outfile);
+
+  Bintail bintail{sample_simple};
+  bintail.enable_report();
+  bintail.init_write(outfile, true);
+  bintail.apply_all(true);
+  bintail.write();
+
+  auto report = bintail.report();
+  REQUIRE(report.pp_nop + report.pp_constant + report.pp_cli_sti +
+              report.pp_call + report.pp_jump >
+          0);
+  REQUIRE(report.relocs_after < report.relocs_before);
+  REQUIRE(report.text_pages_changed > 0);
+}
+
+TEST_CASE("Report prints growth as a positive delta") {
+  TailorReport report;
+  report.mv_sections.push_back({"__multiverse_callsite_", 32, 96});
+  report.relocs_before = 10;
+  report.relocs_after = 4;
+  std::ostringstream text;
+  report.print_text(text);
+  REQUIRE(text.str().find("__multiverse_callsite_: 32 -> 96 (+64)") !=
+          std::string::npos);
+  REQUIRE(text.str().find("relocations: 10 -> 4 (-6)") != std::string::npos);
+}
+
+TEST_CASE("Profile samples are parsed with period and symbol offset") {
+  const auto perf = "/tmp/bintail-test-profile";
+  std::ofstream{perf} << "    250 401000 main+0x4 (/bin/simple)\n"
+                      << "\n"
+                      << "    250 [unknown] (/bin/simple)\n"
+                      << "    123456789012345678901234 401000 main+0x4\n";
+
+  Bintail bintail{sample_simple};
+  auto report = bintail.profile(perf);
+  REQUIRE(report.total == 250);
+  REQUIRE(report.unparsed == 2);
+  REQUIRE(report.vars.size() == bintail.model.vars.size());
+}
+
+TEST_CASE("Profile ranks the variable of the hot function first") {
+  const auto perf = "/tmp/bintail-test-profile-rank";
+  Bintail bintail{sample_bss};
+  auto& second = find_fn(bintail, "func_second");
+  uint64_t site = 0;
+  for (auto& pp : second.patchpoints())
+    if (pp.pp.type == PP_TYPE_X86_CALL) site = pp.pp.location;
+  REQUIRE(site != 0);
+  auto main = sym_addr(bintail, "main");
+  std::ofstream{perf} << "    1000 " << std::hex << second.location()
+                      << " func_second+0x0\n"
+                      << "    300 " << site << " main+0x" << site - main
+                      << "\n";
+
+  auto report = bintail.profile(perf);
+  REQUIRE(report.total == 1300);
+  REQUIRE(report.multiverse == 1300);
+
+  /* Smaller variant and, if it is inlined, no call */
+  auto smallest = second.size();
+  auto inlined = false;
+  for (auto& v : second.variants()) {
+    smallest = std::min(smallest, v.size());
+    inlined |= v.mvfn.type != MVFN_TYPE_NONE;
+  }
+  auto saved = 1000 - 1000 * smallest / second.size() + (inlined ? 300 : 0);
+  REQUIRE(saved > 0);
+  REQUIRE(report.fns[0].name == "func_second");
+  REQUIRE(report.fns[0].generic == 1000);
+  REQUIRE(report.fns[0].callsites == 300);
+  REQUIRE(report.vars[0].name == "config_second");
+  REQUIRE(report.vars[0].saved == saved);
+  REQUIRE(report.vars[0].fns == std::vector<std::string>{"func_second"});
+  REQUIRE(report.vars[1].saved == 0);
+
+  REQUIRE(report.sites[0].location == site);
+  REQUIRE(report.sites[0].caller == "main");
+  REQUIRE(report.sites[0].callee == "func_second");
+  REQUIRE(report.sites[0].cycles == 300);
+  REQUIRE(report.sites[0].caller_cycles == 300);
+}
+
+TEST_CASE("Discovered callsites are patched consistently") {
+  const auto outfile = "/tmp/bintail-test-discover";
+  remove(outfile);
+
+  Bintail bintail{sample_discover};
+  auto registered = bintail.model.pps.size();
+  auto scan = bintail.discover_callsites();
+  REQUIRE(scan.found() > 0);
+  REQUIRE(scan.calls == 1);     // call_direct
+  REQUIRE(scan.jumps == 1);     // jump_direct
+  REQUIRE(scan.indirect == 1);  // call_got, not the writable hook
+  REQUIRE(bintail.model.pps.size() == registered + scan.found());
+
+  bintail.init_write(outfile, true);
+  bintail.apply_all(true);
+  auto& pick = find_fn(bintail, "pick");
+  auto variant = pick.active_mvfn();
+  REQUIRE(variant != nullptr);
+  REQUIRE(variant->type == MVFN_TYPE_NONE);  // -O0, entered by a call
+
+  auto site_in = [&](const char* name) -> uint64_t {
+    auto& f = find_sym(bintail, name);
+    for (auto& pp : pick.patchpoints())
+      if (pp.discovered && pp.pp.location >= f.st_value &&
+          pp.pp.location < f.st_value + f.st_size)
+        return pp.pp.location;
+    return 0;
+  };
+  REQUIRE(site_in("call_hook") == 0);
+  for (auto name : {"call_direct", "call_got", "jump_direct"}) {
+    auto a = site_in(name);
+    REQUIRE(a != 0);
+    auto op = bintail.text.out_buf(a);
+    REQUIRE(op[0] == (name == std::string_view{"jump_direct"} ? 0xe9 : 0xe8));
+    REQUIRE(a + 5 + bintail::x86::read_signed(op + 1, 4) ==
+            variant->function_body);
+    if (name == std::string_view{"call_got"}) REQUIRE(op[5] == 0x90);
+  }
+  bintail.write();
+  REQUIRE(bintail.verify().ok());
+}
+
+TEST_CASE("Peephole folds the branch on a constant variant") {
+  namespace x86 = bintail::x86;
+  const auto outfile = "/tmp/bintail-test-peephole";
+
+  Bintail bintail{sample_fptr};
+  bintail.init_write(outfile, true);
+  bintail.apply_all(true);
+  auto& fast = find_fn(bintail, "fast");
+  REQUIRE(fast.active_mvfn()->type == MVFN_TYPE_CONSTANT);
+  uint64_t next = 0;  // behind "call fast" in main: test, jcc
+  for (auto& pp : fast.patchpoints())
+    if (pp.pp.type == PP_TYPE_X86_CALL) next = pp.pp.location + pp.size();
+  REQUIRE(next != 0);
+
+  auto stats = bintail.peephole();
+  REQUIRE(stats.branches_folded == 1);
+  x86::Insn insn;
+  auto op = bintail.text.out_buf(next);
+  REQUIRE(x86::decode(op, 15, &insn) > 0);
+  REQUIRE((insn.branch == x86::BR_JMP || x86::is_nop(op, insn)));
+  bintail.write();
+  REQUIRE(bintail.verify().ok());
+}
+
+TEST_CASE("Retargeting moves function pointers to the variant") {
+  const auto outfile = "/tmp/bintail-test-retarget";
+
+  Bintail bintail{sample_fptr};
+  bintail.init_write(outfile, true);
+  bintail.apply_all(true);
+  auto& fast = find_fn(bintail, "fast");
+  REQUIRE(fast.is_fixed());
+  auto generic = fast.location();
+  auto variant = fast.active_mvfn()->function_body;
+  REQUIRE(generic != variant);
+  auto handlers = sym_addr(bintail, "handlers");
+
+  /* An integer that happens to equal the generic body */
+  auto plain = bintail.data.out_buf(sym_addr(bintail, "not_a_pointer"));
+  uint64_t word;
+  memcpy(plain, &generic, sizeof(generic));
+
+  auto r = bintail.retarget_pointers();
+  REQUIRE(r.words.empty());
+  memcpy(&word, plain, sizeof(word));
+  REQUIRE(word == generic);
+
+  if (r.relocs > 0) {  // PIE
+    auto moved = 0u;
+    for (auto relocs : {&bintail.data.relocs, &bintail.rela_other})
+      for (auto& rela : *relocs)
+        if (rela.r_offset == handlers) {
+          REQUIRE(uint64_t(rela.r_addend) == variant);
+          moved++;
+        }
+    REQUIRE(moved == 1);
+  } else {
+    uint64_t value = 42;
+    memcpy(plain, &value, sizeof(value));
+    r = bintail.retarget_pointers(true);
+    REQUIRE(r.words == std::vector<uint64_t>{handlers});
+    memcpy(&word, bintail.data.out_buf(handlers), sizeof(word));
+    REQUIRE(word == variant);
+  }
+  bintail.write();
+  REQUIRE(bintail.verify().ok());
+}
+
+TEST_CASE("Folded loads become a mov of the frozen value") {
+  namespace x86 = bintail::x86;
+  const auto outfile = "/tmp/bintail-test-fold";
+
+  Bintail bintail{sample_fptr};
+  bintail.init_write(outfile, true);
+  bintail.apply_all(true);
+  auto level = sym_addr(bintail, "config_level");
+  auto& main = find_sym(bintail, "main");
+
+  /* mov config_level(%rip),%reg for printf in main */
+  std::vector<uint64_t> loads;
+  x86::Insn insn;
+  for (auto a = main.st_value; a < main.st_value + main.st_size;
+       a += insn.len) {
+    auto op = bintail.text.out_buf(a);
+    REQUIRE(x86::decode(op, 15, &insn) > 0);
+    if (insn.rip_relative && insn.map == x86::MAP_1BYTE &&
+        insn.opcode == 0x8b && x86::rip_target(op, insn, a) == level)
+      loads.push_back(a);
+  }
+  REQUIRE_FALSE(loads.empty());
+
+  auto fold = bintail.fold_frozen_vars();
+  REQUIRE(fold.loads >= loads.size());
+  for (auto a : loads) {
+    auto op = bintail.text.out_buf(a);
+    REQUIRE(x86::decode(op, 15, &insn) > 0);
+    REQUIRE(insn.map == x86::MAP_1BYTE);
+    REQUIRE((insn.opcode & 0xf8) == 0xb8);  // mov $imm32,%reg
+    REQUIRE(x86::read_signed(op + insn.imm_off, 4) == 2);
+  }
+
+  /* main increments config_runs, none of its accesses is folded */
+  auto runs = sym_addr(bintail, "config_runs");
+  auto pinned = 0u;
+  for (auto& u : fold.unfolded) {
+    if (u.var != "config_runs") continue;
+    REQUIRE(u.reason == "written or address taken");
+    auto op = bintail.text.out_buf(u.location);
+    REQUIRE(x86::decode(op, 15, &insn) > 0);
+    REQUIRE(insn.rip_relative);
+    REQUIRE(x86::rip_target(op, insn, u.location) == runs);
+    pinned++;
+  }
+  REQUIRE(pinned > 0);
+  bintail.write();
+  REQUIRE(bintail.verify().ok());
+}
+
+TEST_CASE("Moved variables are read from read-only data") {
+  const auto outfile = "/tmp/bintail-test-move";
+
+  Bintail bintail{sample_fptr};
+  bintail.init_write(outfile, true);
+  bintail.apply_all(true);
+  auto level = sym_addr(bintail, "config_level");
+  auto moved = bintail.move_frozen_vars();
+  auto m = std::find_if(moved.moves.begin(), moved.moves.end(),
+                        [](auto& m) { return m.var == "config_level"; });
+  REQUIRE(m != moved.moves.end());
+  REQUIRE(m->from == level);
+  REQUIRE_FALSE(m->references.empty());  // printf in main
+  for (auto a : m->references) {
+    namespace x86 = bintail::x86;
+    x86::Insn insn;
+    auto op = bintail.text.out_buf(a);
+    REQUIRE(x86::decode(op, 15, &insn) > 0);
+    REQUIRE(x86::rip_target(op, insn, a) == m->to);
+  }
+  bintail.write();
+  REQUIRE(bintail.verify().ok());
+
+  bintail::ElfExe out{outfile};
+  auto ro = out.get_section(".multiverse_rodata");
+  REQUIRE(ro != nullptr);
+  REQUIRE(m->to >= ro->get_vaddr());
+  int32_t value;
+  memcpy(&value, ro->get_data().data() + (m->to - ro->get_vaddr()),
+         sizeof(value));
+  REQUIRE(value == 2);
+
+  /* One PT_LOAD more, the other segments are kept */
+  auto in = phdrs_of(sample_fptr), outs = phdrs_of(outfile);
+  REQUIRE(outs.size() == in.size() + 1);
+  for (uint32_t type : {PT_LOAD, PT_NOTE, PT_PHDR, PT_GNU_RELRO}) {
+    auto count = [type](auto& phdrs) {
+      return std::count_if(phdrs.begin(), phdrs.end(),
+                           [type](auto& p) { return p.p_type == type; });
+    };
+    REQUIRE(count(outs) == count(in) + (type == PT_LOAD));
+  }
+  auto load = std::find_if(outs.begin(), outs.end(), [&](auto& p) {
+    return p.p_type == PT_LOAD && p.p_vaddr <= m->to &&
+           m->to < p.p_vaddr + p.p_memsz;
+  });
+  REQUIRE(load != outs.end());
+  REQUIRE(load->p_flags == PF_R);
+  REQUIRE(out.get_phdr_offset() == load->p_offset);
+}
+
+/* The lists of the written output against the model, discovered
+ * patchpoints are not among them */
+static void require_prelinked(Bintail& bintail) {
+  GElf_Shdr shdr;
+  gelf_getshdr(bintail.mvfn.scn_out, &shdr);
+  std::map<uint64_t, MVFn*> fn_at;  // mv_info_fn record -> function
+  auto rec = shdr.sh_addr;
+  for (auto& fn : bintail.model.fns) {
+    if (fn.is_fixed()) continue;
+    auto info = reinterpret_cast<mv_info_fn*>(out_at(bintail.mvfn, rec));
+    REQUIRE(info->function_body == fn.location());
+    fn_at[rec] = &fn;
+
+    std::set<uint64_t> listed, expected;
+    auto p = reinterpret_cast<uint64_t>(info->patchpoints_head);
+    while (p != 0) {
+      auto pp = reinterpret_cast<mv_patchpoint*>(out_at(bintail.mvcs, p));
+      REQUIRE(reinterpret_cast<uint64_t>(pp->function) == rec);
+      auto len = pp->type == PP_TYPE_X86_CALL_INDIRECT ? 6 : 5;
+      REQUIRE(memcmp(pp->swapspace, bintail.text.in_buf(pp->location), len) ==
+              0);
+      REQUIRE(listed.insert(pp->location).second);
+      p = reinterpret_cast<uint64_t>(pp->next);
+    }
+    for (auto& pp : fn.patchpoints())
+      if (!pp.discovered) expected.insert(pp.pp.location);
+    REQUIRE(listed == expected);
+    REQUIRE(listed.count(fn.location()) == 1);  // jump at the body
+    rec += sizeof(mv_info_fn);
+  }
+  REQUIRE_FALSE(fn_at.empty());
+
+  gelf_getshdr(bintail.mvvar.scn_out, &shdr);
+  rec = shdr.sh_addr;
+  for (auto& var : bintail.model.vars) {
+    if (var.frozen) continue;
+    auto info = reinterpret_cast<mv_info_var*>(out_at(bintail.mvvar, rec));
+    REQUIRE(info->variable_location == var.location());
+    REQUIRE(info->reserved & MV_VAR_PRELINKED);
+
+    std::set<MVFn*> listed, expected;
+    auto p = reinterpret_cast<uint64_t>(info->functions_head);
+    while (p != 0) {
+      auto ref = reinterpret_cast<mv_info_fn_ref*>(out_at(bintail.mvcs, p));
+      REQUIRE(fn_at.count(reinterpret_cast<uint64_t>(ref->fn)) == 1);
+      listed.insert(fn_at[reinterpret_cast<uint64_t>(ref->fn)]);
+      p = reinterpret_cast<uint64_t>(ref->next);
+    }
+    for (auto& fn : var.functions())
+      if (!fn.is_fixed()) expected.insert(&fn);
+    REQUIRE(listed == expected);
+    rec += sizeof(mv_info_var);
+  }
+}
+
+TEST_CASE("Prelinked lists match the model") {
+  const auto outfile = "/tmp/bintail-test-prelink";
+
+  /* The records of two frozen variables make room for the lists */
+  Bintail bintail{sample_bss};
+  bintail.discover_callsites();
+  bintail.init_write(outfile, false);
+  bintail.apply("config_first", true);
+  bintail.apply("config_second", true);
+  bintail.enable_prelink();
+  bintail.write();
+  REQUIRE(bintail.verify().ok());
+  require_prelinked(bintail);
+}
+
+TEST_CASE("Prelinked lists leave out discovered patchpoints") {
+  const auto outfile = "/tmp/bintail-test-prelink-discover";
+
+  Bintail bintail{sample_discover};
+  REQUIRE(bintail.discover_callsites().jumps == 1);  // jump_direct
+  bintail.init_write(outfile, false);
+  bintail.apply("config_other", true);
+  bintail.enable_prelink();
+  bintail.write();
+  REQUIRE(bintail.verify().ok());
+  require_prelinked(bintail);
+}
+
+TEST_CASE("Patch scripts select the variant for each segment") {
+  const auto outfile = "/tmp/bintail-test-script";
+
+  Bintail bintail{sample_simple};
+  bintail.init_write(outfile, false);
+  auto script = bintail.patch_script();
+  bintail.write();
+  REQUIRE(bintail.verify().ok());
+  REQUIRE(script.vars == 1);
+
+  /* config=1 selects the variant of func called from main */
+  auto& var = bintail.model.vars.front();
+  auto& fn = find_fn(bintail, "func");
+  uint64_t call = 0, variant = 0;
+  for (auto& pp : fn.patchpoints())
+    if (pp.pp.type == PP_TYPE_X86_CALL) call = pp.pp.location;
+  for (auto& m : fn.variants())
+    for (auto& a : m.assigns())
+      if (a.var == &var && a.lower() <= 1 && 1 <= a.upper())
+        variant = m.location();
+  REQUIRE(call != 0);
+  REQUIRE(variant != 0);
+  uint8_t expected[5] = {0xe8};
+  int32_t rel = variant - (call + 5);
+  memcpy(expected + 1, &rel, sizeof(rel));
+
+  bintail::ElfExe out{outfile};
+  auto scn = out.get_section(".multiverse_patch");
+  REQUIRE(scn != nullptr);
+  auto blob = scn->get_data();
+  REQUIRE(blob.size() == script.bytes);
+  size_t pos = 0;
+  auto take = [&](auto& v) {
+    REQUIRE(pos + sizeof(v) <= blob.size());
+    memcpy(&v, blob.data() + pos, sizeof(v));
+    pos += sizeof(v);
+  };
+  char magic[4];
+  uint32_t version, n_vars, n_segments;
+  uint64_t location;
+  take(magic);
+  take(version);
+  take(n_vars);
+  REQUIRE(memcmp(magic, bintail::script_magic, 4) == 0);
+  REQUIRE(version == bintail::script_version);
+  REQUIRE(n_vars == 1);
+  take(location);
+  take(n_segments);
+  REQUIRE(location == var.location());
+  REQUIRE(n_segments == var.segments().size());
+  REQUIRE(n_segments == script.segments);
+
+  auto found = 0u;
+  for (auto i = 0u; i < n_segments; i++) {
+    uint32_t lower, upper, n_records;
+    take(lower);
+    take(upper);
+    take(n_records);
+    uint64_t last = 0;
+    for (auto k = 0u; k < n_records; k++) {
+      uint64_t address;
+      uint8_t len;
+      take(address);
+      take(len);
+      REQUIRE(address >= last);
+      last = address;
+      REQUIRE(pos + len <= blob.size());
+      auto bytes = blob.data() + pos;
+      pos += len;
+      if (address != call || lower > 1 || 1 > upper) continue;
+      REQUIRE(len == 5);
+      REQUIRE(memcmp(bytes, expected, 5) == 0);
+      found++;
+    }
+  }
+  REQUIRE(pos == blob.size());
+  REQUIRE(found == 1);
+}
+
+TEST_CASE("Constrained variables keep only reachable variants") {
+  const auto outfile = "/tmp/bintail-test-constrain";
+  remove(outfile);
+
+  Bintail bintail{sample_simple};
+  bintail.init_write(outfile, false);
+  REQUIRE_FALSE(bintail.model.vars.empty());
+  auto& var = bintail.model.vars.front();
+  auto variants = bintail.model.variants.size();
+  bintail.constrain(std::string(var.name()) + "=1..1", true);
+  REQUIRE(var.segments().size() == 1);
+  for (auto& fn : var.functions())
+    for (auto& mvfn : fn.variants())
+      for (auto& a : mvfn.assigns())
+        if (a.var == &var) REQUIRE(a.can_hold(1, 1));
+  REQUIRE(bintail.model.variants.size() == variants);  // arena unchanged
+  bintail.write();
+  REQUIRE(bintail.verify().ok());
+}
+
+TEST_CASE("Parallel loading builds the same output") {
+  /* All frozen, or config_third left dynamic with its links prelinked */
+  auto tailor = [](unsigned jobs, bool freeze) {
+    auto outfile = "/tmp/bintail-test-jobs-" + std::to_string(jobs);
+    Bintail bintail{sample_bss, jobs};
+    bintail.init_write(outfile.c_str(), freeze);
+    if (freeze) {
+      bintail.apply_all(true);
+    } else {
+      bintail.apply("config_first", true);
+      bintail.apply("config_second", true);
+      bintail.enable_prelink();
+    }
+    bintail.write();
+    std::ifstream f{outfile};
+    return std::string{std::istreambuf_iterator<char>(f), {}};
+  };
+  for (auto freeze : {true, false}) {
+    auto serial = tailor(1, freeze);
+    REQUIRE_FALSE(serial.empty());
+    REQUIRE(serial == tailor(4, freeze));
+  }
+}
+
+TEST_CASE("Lazy loading reads the model on first use") {
+  Bintail lazy{sample_simple, 1, true};
+  REQUIRE(lazy.model.vars.empty());
+  REQUIRE(lazy.syms.empty());
+  lazy.print();
+  Bintail eager{sample_simple, 1};
+  REQUIRE(lazy.model.vars.size() == eager.model.vars.size());
+  REQUIRE(lazy.rela_other.empty());  // not needed by print
+}
+
+TEST_CASE("Dump lists every variable and symbol") {
+  Bintail bintail{sample_simple, 1, true};
+  std::ostringstream json, csv;
+  bintail.dump(json, DumpFormat::JSON);
+  bintail.dump(csv, DumpFormat::CSV);
+  REQUIRE(json.str().front() == '{');
+  REQUIRE(json.str().find("\"relocations\": [") != std::string::npos);
+  size_t vars = 0, syms = 0;
+  std::istringstream lines{csv.str()};
+  for (std::string l; getline(lines, l);) {
+    vars += l.rfind("var,", 0) == 0;
+    syms += l.rfind("sym,", 0) == 0;
+  }
+  REQUIRE(vars == bintail.model.vars.size());
+  REQUIRE(syms == bintail.syms.size());
+}
+
+TEST_CASE("Dump names unknown types") {
+  Bintail bintail{sample_simple};
+  auto& pp = bintail.model.pps.front();
+  pp.pp.type = static_cast<mv_info_patchpoint_type>(42);  // newer input
+  std::ostringstream json, csv;
+  bintail.dump(json, DumpFormat::JSON);
+  bintail.dump(csv, DumpFormat::CSV);
+  REQUIRE(json.str().find("\"unknown\"") != std::string::npos);
+  REQUIRE(csv.str().find(",unknown,") != std::string::npos);
+}
+
+TEST_CASE("Stripped output keeps the loaded sections verifiable") {
+  const auto outfile = "/tmp/bintail-test-strip";
+  const auto debug_file = "/tmp/bintail-test-strip.debug";
+  remove(outfile);
+
+  Bintail bintail{sample_simple};
+  bintail.strip(debug_file);
+  bintail.init_write(outfile, true);
+  bintail.apply_all(true);
+  bintail.write();
+  REQUIRE(bintail.verify().ok());
+
+  std::ifstream in{sample_simple, std::ios::ate}, out{outfile, std::ios::ate};
+  REQUIRE(out.tellg() <= in.tellg());
+
+  auto is_debug = [](auto& name) { return name.rfind(".debug_", 0) == 0; };
+  auto in_names = section_names(sample_simple);
+  auto out_names = section_names(outfile);
+  auto debug_names = section_names(debug_file);
+  REQUIRE(std::any_of(in_names.begin(), in_names.end(), is_debug));
+  REQUIRE(std::none_of(out_names.begin(), out_names.end(), is_debug));
+
+  /* The debug file keeps them with their data */
+  bintail::ElfExe elf_in{sample_simple}, elf_debug{debug_file};
+  for (auto& name : in_names) {
+    if (!is_debug(name)) continue;
+    REQUIRE(std::count(debug_names.begin(), debug_names.end(), name) == 1);
+    auto d = elf_debug.get_section(name.c_str());
+    REQUIRE(d->get_data() == elf_in.get_section(name.c_str())->get_data());
+  }
+
+  /* name, 0 padded to 4 bytes, CRC-32 of the debug file */
+  bintail::ElfExe elf_out{outfile};
+  auto link = elf_out.get_section(".gnu_debuglink");
+  REQUIRE(link != nullptr);
+  auto data = link->get_data();
+  std::string name = "bintail-test-strip.debug";
+  REQUIRE(data.size() == (name.size() + 4) / 4 * 4 + 4);
+  REQUIRE(std::string(reinterpret_cast<char*>(data.data())) == name);
+  uint32_t crc;
+  memcpy(&crc, data.data() + data.size() - 4, sizeof(crc));
+  auto debug = bintail::read_file(debug_file);
+  REQUIRE(crc == bintail::crc32(debug.data(), debug.size()));
+}
+
+TEST_CASE("Write replaces a longer stale output") {
+  const auto outfile = "/tmp/bintail-test-stale";
+  {
+    std::ofstream stale{outfile, std::ios::trunc};
+    stale << std::string(1 << 22, 'x');
+  }
+
+  Bintail bintail{sample_simple};
+  bintail.init_write(outfile, true);
+  bintail.apply_all(true);
+  bintail.write();
+  REQUIRE(bintail.verify().ok());
+
+  std::ifstream in{sample_simple, std::ios::ate}, out{outfile, std::ios::ate};
+  REQUIRE(out.tellg() <= in.tellg());
+}
+
+TEST_CASE("Info records relocate every pointer field") {
+  mv_info_callsite cs[2] = {{0x1000, 0x2000}, {0x3000, 0x4000}};
+  std::vector<GElf_Rela> relocs;
+  bintail::CallsiteRecords::relocate(cs, 2, 0x500, &relocs);
+  REQUIRE(relocs.size() == 4);
+  REQUIRE(relocs[1].r_offset == 0x508);
+  REQUIRE(relocs[1].r_addend == 0x2000);
+  REQUIRE(relocs[2].r_offset == 0x510);
+  REQUIRE(relocs[2].r_addend == 0x3000);
+
+  auto read = bintail::CallsiteRecords::read(
+      reinterpret_cast<const uint8_t*>(cs), sizeof(cs));
+  REQUIRE(read->size() == 2);
+  REQUIRE((*read)[1].call_label == 0x4000);
+}
+
+TEST_CASE("Preflight tells tailorable files from the headers") {
+  auto simple = preflight(sample_simple);
+  REQUIRE(simple.ok);
+  REQUIRE(simple.vars > 0);
+  REQUIRE(simple.fns > 0);
+
+  const auto text = "/tmp/bintail-test-preflight";
+  std::ofstream{text} << "not an executable\n";
+  auto other = preflight(text);
+  REQUIRE(!other.ok);
+  REQUIRE(other.reason == "not an ELF file");
+
+  auto results = triage({"./samples", text}, 2);
+  REQUIRE(std::is_sorted(results.begin(), results.end(),
+                         [](auto& a, auto& b) { return a.path < b.path; }));
+  REQUIRE(std::any_of(results.begin(), results.end(), [](auto& r) {
+    return r.ok && r.path == "./samples/simple";
+  }));
+}
+
+TEST_CASE("Triage reports corrupt files and unreadable directories") {
+  const auto dir = "/tmp/bintail-test-triage";
+  const auto corrupt = "/tmp/bintail-test-triage/corrupt";
+  const auto locked = "/tmp/bintail-test-triage/locked";
+  mkdir(dir, 0755);
+  mkdir(locked, 0755);
+  chmod(locked, 0);
+
+  /* The header of simple, 2^40 sections counted in section 0 */
+  Elf64_Ehdr ehdr;
+  std::ifstream{sample_simple}.read(reinterpret_cast<char*>(&ehdr),
+                                    sizeof(ehdr));
+  ehdr.e_shoff = sizeof(ehdr);
+  ehdr.e_shnum = 0;
+  ehdr.e_shstrndx = 0;
+  Elf64_Shdr first{};
+  first.sh_size = 1ul << 40;
+  std::ofstream{corrupt}
+      .write(reinterpret_cast<char*>(&ehdr), sizeof(ehdr))
+      .write(reinterpret_cast<char*>(&first), sizeof(first));
+
+  auto results = triage({dir}, 2);
+  chmod(locked, 0755);
+  auto c = std::find_if(results.begin(), results.end(),
+                        [&](auto& r) { return r.path == corrupt; });
+  REQUIRE(c != results.end());
+  REQUIRE_FALSE(c->ok);
+  REQUIRE(c->reason == "truncated section table");
+  if (geteuid() != 0) {  // root reads it anyway
+    auto l = std::find_if(results.begin(), results.end(),
+                          [&](auto& r) { return r.path == locked; });
+    REQUIRE(l != results.end());
+    REQUIRE_FALSE(l->ok);
+  }
+}
+
+TEST_CASE("Instances tailor concurrently") {
+  auto tailor = [](const char* outfile) {
+    Bintail bintail{sample_simple, 1};
+    bintail.init_write(outfile, true);
+    bintail.apply_all(true);
+    bintail.write();
+    return bintail.verify().ok();
+  };
+  auto a = std::async(std::launch::async, tailor, "/tmp/bintail-test-mt-a");
+  auto b = std::async(std::launch::async, tailor, "/tmp/bintail-test-mt-b");
+  REQUIRE(a.get());
+  REQUIRE(b.get());
+
+  std::ifstream fa{"/tmp/bintail-test-mt-a"}, fb{"/tmp/bintail-test-mt-b"};
+  std::string sa{std::istreambuf_iterator<char>(fa), {}},
+      sb{std::istreambuf_iterator<char>(fb), {}};
+  REQUIRE(sa == sb);
+}
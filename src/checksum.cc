@@ -0,0 +1,40 @@
+#include "checksum.h"
+
+#include <array>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+
+namespace bintail {
+
+uint64_t fnv1a(const uint8_t *buf, size_t len, uint64_t hash) {
+  for (auto i = 0ul; i < len; i++) {
+    hash ^= buf[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+uint32_t crc32(const uint8_t *buf, size_t len, uint32_t crc) {
+  static const auto table = [] {
+    std::array<uint32_t, 256> t{};
+    for (uint32_t i = 0; i < 256; i++) {
+      auto c = i;
+      for (auto k = 0; k < 8; k++) c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      t[i] = c;
+    }
+    return t;
+  }();
+  crc = ~crc;
+  for (auto i = 0ul; i < len; i++)
+    crc = table[(crc ^ buf[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+std::vector<uint8_t> read_file(const std::string &path) {
+  std::ifstream f{path, std::ios::binary};
+  if (!f.good()) throw std::runtime_error("Cannot read " + path);
+  return {std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>()};
+}
+
+}  // namespace bintail
@@ -0,0 +1,29 @@
+#ifndef BINTAIL_CHECKSUM_H_
+#define BINTAIL_CHECKSUM_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace bintail {
+
+/**
+ * 64 bit FNV-1a, used to tell artifacts and sections apart.
+ * Not collision resistant, compare the bytes before trusting equality.
+ **/
+uint64_t fnv1a(const uint8_t *buf, size_t len,
+               uint64_t hash = 0xcbf29ce484222325ull);
+
+/**
+ * CRC-32 (IEEE, reflected) as stored in .gnu_debuglink.
+ **/
+uint32_t crc32(const uint8_t *buf, size_t len, uint32_t crc = 0);
+
+/**
+ * Read a whole file, throws std::runtime_error on failure.
+ **/
+std::vector<uint8_t> read_file(const std::string &path);
+
+}  // namespace bintail
+#endif  // BINTAIL_CHECKSUM_H_
@@ -0,0 +1,242 @@
+#include <bintail/bintail.hpp>
+
+#include <charconv>
+#include <cstdio>
+#include <ostream>
+#include <string>
+
+#include "mvelem.h"
+
+using namespace std;
+
+static const char* const mvfn_types[] = {"none", "nop", "constant", "cli",
+                                         "sti"};
+static const char* const pp_types[] = {"invalid", "call", "indirect_call",
+                                       "jump"};
+
+/* Types come from the input, a corrupt or newer one is past the table */
+template <size_t N>
+static const char* type_name(const char* const (&names)[N], unsigned type) {
+  return type < N ? names[type] : "unknown";
+}
+
+namespace {
+
+/* Appends to a buffer, the stream sees few large writes */
+class Writer {
+ public:
+  Writer(ostream& os, bool color) : os{os}, color{color} {
+    buf.reserve(limit + 256);
+  }
+  ~Writer() { flush(); }
+
+  Writer& operator<<(string_view s) {
+    buf.append(s);
+    if (buf.size() > limit) flush();
+    return *this;
+  }
+  Writer& operator<<(char c) {
+    buf += c;
+    return *this;
+  }
+  Writer& num(int64_t v) {
+    char tmp[24];
+    return *this << string_view(tmp, to_chars(tmp, tmp + 24, v).ptr - tmp);
+  }
+  Writer& hex(uint64_t v) {
+    char tmp[24] = {'0', 'x'};
+    auto end = to_chars(tmp + 2, tmp + 24, v, 16).ptr;
+    return *this << string_view(tmp, end - tmp);
+  }
+  Writer& qhex(uint64_t v) {
+    buf += '"';
+    hex(v);
+    return *this << '"';
+  }
+  /* JSON string, names come from the binary */
+  Writer& quoted(string_view s) {
+    buf += '"';
+    for (auto c : s) {
+      if (c == '"' || c == '\\') {
+        buf += '\\';
+        buf += c;
+      } else if (uint8_t(c) < 0x20) {
+        char tmp[8];
+        snprintf(tmp, sizeof(tmp), "\\u%04x", c);
+        buf += tmp;
+      } else {
+        buf += c;
+      }
+    }
+    return *this << '"';
+  }
+  Writer& key(string_view k) {
+    if (color) *this << ANSI_COLOR_YELLOW;
+    quoted(k);
+    if (color) *this << ANSI_COLOR_RESET;
+    return *this << ": ";
+  }
+  /* CSV record kind */
+  Writer& kind(string_view k) {
+    if (color) *this << ANSI_COLOR_YELLOW;
+    *this << k;
+    if (color) *this << ANSI_COLOR_RESET;
+    return *this << ',';
+  }
+  void flush() {
+    os.write(buf.data(), buf.size());
+    buf.clear();
+  }
+
+ private:
+  static constexpr size_t limit = 64 * 1024;
+  ostream& os;
+  bool color;
+  string buf;
+};
+
+}  // namespace
+
+void Bintail::dump(ostream& os, DumpFormat fmt, bool color) {
+  require(LOAD_MODEL | LOAD_RELOCS);
+  Writer w{os, color};
+  auto json = fmt == DumpFormat::JSON;
+
+  vector<GElf_Rela> relas = rela_other;
+  Section* claimed[] = {&rodata, &text, &data, &mvfn, &mvvar, &mvcs, &mvdata};
+  for (auto s : claimed)
+    relas.insert(relas.end(), s->relocs.begin(), s->relocs.end());
+  auto labeled = label_relocs(move(relas));
+
+  if (!json) {
+    w << "# var,name,location,width,value,frozen\n"
+      << "# fn,name,body,size,frozen\n"
+      << "# variant,fn,body,type,constant\n"
+      << "# assign,fn,variant,var,lower,upper\n"
+      << "# pp,fn,location,type,discovered\n"
+      << "# rela,offset,addend,section\n"
+      << "# sym,name,value,size,type,bind\n";
+    for (auto& v : model.vars) {
+      w.kind("var") << v.name() << ',';
+      w.hex(v.location()) << ',';
+      w.num(v.var.variable_width) << ',';
+      w.num(v.value()) << ',' << (v.frozen ? "1" : "0") << '\n';
+    }
+    for (auto& fn : model.fns) {
+      w.kind("fn") << fn.name() << ',';
+      w.hex(fn.location()) << ',';
+      w.num(fn.size()) << ',' << (fn.is_fixed() ? "1" : "0") << '\n';
+      for (auto& m : fn.variants()) {
+        w.kind("variant") << fn.name() << ',';
+        w.hex(m.location()) << ',' << type_name(mvfn_types, m.mvfn.type) << ',';
+        w.num(m.mvfn.constant) << '\n';
+        for (auto& a : m.assigns()) {
+          w.kind("assign") << fn.name() << ',';
+          w.hex(m.location()) << ',' << a.var->name() << ',';
+          w.num(a.lower()) << ',';
+          w.num(a.upper()) << '\n';
+        }
+      }
+      for (auto& pp : fn.patchpoints()) {
+        w.kind("pp") << fn.name() << ',';
+        w.hex(pp.pp.location) << ',' << type_name(pp_types, pp.pp.type) << ','
+                              << (pp.discovered ? "1" : "0") << '\n';
+      }
+    }
+    for (auto& r : labeled) {
+      w.kind("rela").hex(r.first.r_offset) << ',';
+      w.hex(r.first.r_addend) << ',' << r.second << '\n';
+    }
+    for (auto& s : syms) {
+      w.kind("sym") << s.name << ',';
+      w.hex(s.sym.st_value) << ',';
+      w.num(s.sym.st_size) << ',';
+      w.num(GELF_ST_TYPE(s.sym.st_info)) << ',';
+      w.num(GELF_ST_BIND(s.sym.st_info)) << '\n';
+    }
+    return;
+  }
+
+  auto sep = [&](bool first) -> Writer& {
+    return w << (first ? "\n  " : ",\n  ");
+  };
+  w << "{\n";
+  w.key("vars") << '[';
+  auto first = true;
+  for (auto& v : model.vars) {
+    sep(first) << '{';
+    w.key("name").quoted(v.name()) << ", ";
+    w.key("location").qhex(v.location()) << ", ";
+    w.key("width").num(v.var.variable_width) << ", ";
+    w.key("value").num(v.value()) << ", ";
+    w.key("frozen") << (v.frozen ? "true" : "false") << '}';
+    first = false;
+  }
+  w << "],\n";
+
+  w.key("functions") << '[';
+  first = true;
+  for (auto& fn : model.fns) {
+    sep(first) << '{';
+    w.key("name").quoted(fn.name()) << ", ";
+    w.key("body").qhex(fn.location()) << ", ";
+    w.key("size").num(fn.size()) << ", ";
+    w.key("frozen") << (fn.is_fixed() ? "true" : "false") << ", ";
+    w.key("variants") << '[';
+    auto first_m = true;
+    for (auto& m : fn.variants()) {
+      w << (first_m ? "{" : ", {");
+      w.key("body").qhex(m.location()) << ", ";
+      w.key("type").quoted(type_name(mvfn_types, m.mvfn.type)) << ", ";
+      w.key("constant").num(m.mvfn.constant) << ", ";
+      w.key("assignments") << '[';
+      auto first_a = true;
+      for (auto& a : m.assigns()) {
+        w << (first_a ? "{" : ", {");
+        w.key("var").quoted(a.var->name()) << ", ";
+        w.key("lower").num(a.lower()) << ", ";
+        w.key("upper").num(a.upper()) << '}';
+        first_a = false;
+      }
+      w << "]}";
+      first_m = false;
+    }
+    w << "], ";
+    w.key("patchpoints") << '[';
+    auto first_p = true;
+    for (auto& pp : fn.patchpoints()) {
+      w << (first_p ? "{" : ", {");
+      w.key("location").qhex(pp.pp.location) << ", ";
+      w.key("type").quoted(type_name(pp_types, pp.pp.type)) << ", ";
+      w.key("discovered") << (pp.discovered ? "true" : "false") << '}';
+      first_p = false;
+    }
+    w << "]}";
+    first = false;
+  }
+  w << "],\n";
+
+  w.key("relocations") << '[';
+  first = true;
+  for (auto& r : labeled) {
+    sep(first) << '{';
+    w.key("offset").qhex(r.first.r_offset) << ", ";
+    w.key("addend").qhex(r.first.r_addend) << ", ";
+    w.key("section").quoted(r.second) << '}';
+    first = false;
+  }
+  w << "],\n";
+
+  w.key("symbols") << '[';
+  first = true;
+  for (auto& s : syms) {
+    sep(first) << '{';
+    w.key("name").quoted(s.name) << ", ";
+    w.key("value").qhex(s.sym.st_value) << ", ";
+    w.key("size").num(s.sym.st_size) << ", ";
+    w.key("type").num(GELF_ST_TYPE(s.sym.st_info)) << ", ";
+    w.key("bind").num(GELF_ST_BIND(s.sym.st_info)) << '}';
+    first = false;
+  }
+  w << "]\n}\n";
+}
@@ -1,7 +1,19 @@
 #include "elf.h"
 
+#include <mutex>
+
+#include "writer.h"
+
 namespace bintail {
 
+void init_libelf() {
+  static std::once_flag once;
+  std::call_once(once, [] {
+    if (elf_version(EV_CURRENT) == EV_NONE)
+      throw std::runtime_error("libelf init failed");
+  });
+}
+
 Section::Section(Elf_Scn *scn, Elf *elf, size_t shstrndx) {
   assert(scn != nullptr);
 
@@ -34,7 +46,7 @@ size_t Section::write_new_scn(Elf *elf) const {
   Elf_Data *data_in = nullptr, *data_out = nullptr;
 
   auto scn_out = elf_newscn(elf);
-  if (scn_out == nullptr) errx(1, "elf_newscn failed.");
+  if (scn_out == nullptr) throw std::runtime_error("elf_newscn failed.");
 
   /* SHDR */
   gelf_getshdr(scn_out, &tmp_shdr);
@@ -45,7 +57,7 @@ size_t Section::write_new_scn(Elf *elf) const {
 
   /* Data */
   if ((data_out = elf_newdata(scn_out)) == nullptr)
-    errx(1, "elf_newdata failed.");
+    throw std::runtime_error("elf_newdata failed.");
   data_out->d_align = shdr_.sh_addralign;
   data_out->d_off = 0;
   data_out->d_size = buf_.size();
@@ -65,13 +77,14 @@ uint64_t Section::get_offset() const { return shdr_.sh_offset; }
 const std::vector<uint8_t> Section::get_data() const { return buf_; }
 
 ElfExe::ElfExe(const char *infile) {
-  /* init libelf state */
-  if (elf_version(EV_CURRENT) == EV_NONE)
-    errx(1, "libelf init failed");
+  init_libelf();
   if ((fd_ = open(infile, O_RDONLY)) == -1)
-    errx(1, "open %s failed. %s", infile, strerror(errno));
-  if ((e_ = elf_begin(fd_, ELF_C_READ, NULL)) == nullptr)
-    errx(1, "elf_begin infile failed.");
+    throw std::runtime_error(std::string{"open "} + infile + " failed. " +
+                             strerror(errno));
+  if ((e_ = elf_begin(fd_, ELF_C_READ, NULL)) == nullptr) {
+    close(fd_);
+    throw std::runtime_error("elf_begin infile failed.");
+  }
 
   /* EHDR */
   gelf_getehdr(e_, &ehdr_);
@@ -92,13 +105,17 @@ ElfExe::~ElfExe() {
 }
 
 void ElfExe::write(const char *outfile) {
-  auto outfd = open(outfile, O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR | S_IXUSR);
+  auto outfd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC,
+                    S_IRUSR | S_IWUSR | S_IXUSR);
   if (outfd == -1)
-    errx(1, "open %s failed. %s", outfile, strerror(errno));
+    throw std::runtime_error(std::string{"open "} + outfile + " failed. " +
+                             strerror(errno));
 
   auto e_out = elf_begin(outfd, ELF_C_WRITE, NULL);
-  if (e_out == nullptr)
-    errx(1, "elf_begin outfile failed.");
+  if (e_out == nullptr) {
+    close(outfd);
+    throw std::runtime_error("elf_begin outfile failed.");
+  }
 
   // Manual layout: Sections in segments have to be relocated manualy
   elf_flagelf(e_out, ELF_C_SET, ELF_F_LAYOUT);
@@ -109,17 +126,19 @@ void ElfExe::write(const char *outfile) {
   ehdr_out = ehdr_;
   gelf_update_ehdr(e_out, &ehdr_out);
 
-  /* Write Sections */
-  for (const auto &s : secs_) {
-    s->write_new_scn(e_out);
-  }
-
-  /* Finish elf */
-  elf_fill(0xcccccccc); // asm(int 0x3) - fail fast on failure
-  if (elf_update(e_out, ELF_C_WRITE) < 0) {
-    std::cerr << elf_errmsg(elf_errno()) << "\n";
-    errx(1, "elf_update(write) failed.");
+  /* Write Sections, finish elf */
+  try {
+    for (const auto &s : secs_) {
+      s->write_new_scn(e_out);
+    }
+    update_elf(e_out, outfd, 0xcc);  // asm(int 0x3) - fail fast on failure
+  } catch (...) {
+    elf_end(e_out);
+    close(outfd);
+    throw;
   }
+  elf_end(e_out);
+  close(outfd);
 }
 
 Section *ElfExe::get_section(const char *section_name) {
@@ -1,7 +1,6 @@
 #ifndef BINTAIL_ELF_H_
 #define BINTAIL_ELF_H_
 
-#include <err.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
@@ -9,11 +8,19 @@
 #include <algorithm>
 #include <cassert>
 #include <iostream>
+#include <stdexcept>
+#include <string>
 
 #include <bintail/bintail.hpp>
 
 namespace bintail {
 
+/**
+ * Set up libelf once per process, every thread may call it.
+ * Throws std::runtime_error if libelf does not support this ELF version.
+ **/
+void init_libelf();
+
 class Section {
  public:
   /**
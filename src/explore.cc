@@ -0,0 +1,145 @@
+#include <bintail/bintail.hpp>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <fstream>
+#include <future>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+
+#include "checksum.h"
+#include "mvelem.h"
+#include "pool.h"
+
+using namespace std;
+
+/* Guard against accidentally exploding the configuration space */
+static const size_t max_configs = 1 << 16;
+
+namespace {
+
+/* Removes the outputs not renamed to an artifact on every return */
+struct TmpFiles {
+  ~TmpFiles() {
+    for (auto& f : paths) remove(f.c_str());
+  }
+  vector<string> paths;
+};
+
+}  // namespace
+
+static string hex64(uint64_t v) {
+  stringstream ss;
+  ss << hex;
+  ss.width(16);
+  ss.fill('0');
+  ss << v;
+  return ss.str();
+}
+
+static uint64_t tailor(const char* infile, const string& outfile,
+                       const vector<string>& changes) {
+  {
+    Bintail bintail{infile, 1};  // configurations run in parallel
+    bintail.init_write(outfile.c_str(), true);
+    for (auto& c : changes) bintail.change(c);
+    bintail.apply_all(true);
+    bintail.write();
+  }
+  auto buf = bintail::read_file(outfile);
+  return bintail::fnv1a(buf.data(), buf.size());
+}
+
+vector<ExploreResult> explore(const char* infile, const char* outdir,
+                              unsigned jobs) {
+  /* Enumerate the configuration space on the parsed model */
+  vector<pair<string, vector<int64_t>>> domains;
+  {
+    Bintail bintail{infile, jobs};
+    for (auto& v : bintail.model.vars)
+      domains.emplace_back(v.name(), v.values());
+  }
+  size_t total = 1;
+  for (auto& d : domains) {
+    total *= d.second.size();
+    if (total > max_configs)
+      throw std::runtime_error("Configuration space too large to explore");
+  }
+
+  if (mkdir(outdir, 0755) == -1 && errno != EEXIST)
+    throw std::runtime_error("mkdir "s + outdir + " failed. " +
+                             strerror(errno));
+  string dir = outdir;
+  string base = infile;
+  base = base.substr(base.find_last_of('/') + 1);
+
+  /* Tailor every configuration, index i is a mixed radix number */
+  vector<ExploreResult> results(total);
+  vector<future<uint64_t>> hashes;
+  TmpFiles tmps;
+  {
+    bintail::ThreadPool pool{jobs};
+    for (auto i = 0ul; i < total; i++) {
+      vector<string> changes;
+      auto rest = i;
+      for (auto& d : domains) {
+        auto v = d.second[rest % d.second.size()];
+        rest /= d.second.size();
+        changes.push_back(d.first + "=" + to_string(v));
+        results[i].config += (results[i].config.empty() ? "" : ",");
+        results[i].config += changes.back();
+      }
+      auto tmp = dir + "/.explore-" + to_string(i);
+      tmps.paths.push_back(tmp);
+      hashes.push_back(pool.submit(
+          [infile, tmp, changes] { return tailor(infile, tmp, changes); }));
+    }
+    for (auto& h : hashes) h.wait();
+  }
+
+  vector<uint64_t> sums(total);
+  size_t failed = 0;
+  string first_error;
+  for (auto i = 0ul; i < total; i++) {
+    try {
+      sums[i] = hashes[i].get();
+    } catch (const std::exception& e) {
+      if (failed++ == 0) first_error = results[i].config + ": " + e.what();
+    }
+  }
+  if (failed > 0)
+    throw std::runtime_error(to_string(failed) + " of " + to_string(total) +
+                             " configurations failed, " + first_error);
+
+  /* Merge byte-identical outputs, in config order to stay deterministic */
+  map<uint64_t, vector<string>> artifacts;
+  for (auto i = 0ul; i < total; i++) {
+    auto h = sums[i];
+    auto& tmp = tmps.paths[i];
+    auto buf = bintail::read_file(tmp);
+
+    auto& same_hash = artifacts[h];
+    for (auto& a : same_hash)
+      if (bintail::read_file(dir + "/" + a) == buf) results[i].artifact = a;
+
+    if (results[i].artifact.empty()) {
+      auto name = base + "-" + hex64(h);
+      if (!same_hash.empty()) name += "." + to_string(same_hash.size());
+      if (rename(tmp.c_str(), (dir + "/" + name).c_str()) == -1)
+        throw std::runtime_error("rename " + tmp + " failed. " +
+                                 strerror(errno));
+      same_hash.push_back(name);
+      results[i].artifact = name;
+    }
+  }
+
+  ofstream map_file{dir + "/explore.map"};
+  for (auto& r : results) map_file << r.config << " " << r.artifact << "\n";
+  if (!map_file.good())
+    throw std::runtime_error("Cannot write " + dir + "/explore.map");
+
+  return results;
+}
@@ -0,0 +1,130 @@
+#include "flow.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <bintail/bintail.hpp>
+
+#include "mvelem.h"
+#include "x86.h"
+
+namespace bintail {
+
+static const Range* find(const std::vector<Range>& sorted, uint64_t addr) {
+  auto it = std::upper_bound(sorted.begin(), sorted.end(),
+                             Range{addr, UINT64_MAX});
+  if (it == sorted.begin() || addr >= (it - 1)->second) return nullptr;
+  return &*(it - 1);
+}
+
+bool CodeMap::entered(uint64_t lo, uint64_t hi) const {
+  auto it = std::upper_bound(targets.begin(), targets.end(), lo);
+  return it != targets.end() && *it < hi;
+}
+
+Range CodeMap::function(uint64_t addr) const {
+  auto f = find(funcs, addr);
+  if (f == nullptr || find(opaque, addr) != nullptr) return {0, 0};
+  return *f;
+}
+
+bool CodeMap::is_guarded(uint64_t addr) const {
+  return find(guarded, addr) != nullptr;
+}
+
+CodeMap code_map(::Bintail& b) {
+  CodeMap m;
+  auto& text = b.text;
+  auto start = text.vaddr();
+  auto end = start + text.max_sz();
+  auto buf = text.out_buf();
+
+  for (auto& fn : b.model.fns)
+    for (auto& g : fn.guarded)
+      m.guarded.emplace_back(g.first, g.first + g.second);
+  std::sort(m.guarded.begin(), m.guarded.end());
+
+  std::vector<uint64_t> tables;
+  for (auto& s : b.syms) {
+    auto a = s.sym.st_value;
+    auto fe = a + s.sym.st_size;
+    if (GELF_ST_TYPE(s.sym.st_info) != STT_FUNC || a == fe || a < start ||
+        fe > end)
+      continue;
+    m.funcs.emplace_back(a, fe);
+    m.targets.push_back(a);
+    for (x86::Insn insn; a < fe; a += insn.len) {
+      auto op = buf + (a - start);
+      if (x86::decode(op, fe - a, &insn) == 0) {
+        m.opaque.emplace_back(s.sym.st_value, fe);
+        break;
+      }
+      if (insn.branch != x86::BR_NONE)
+        m.targets.push_back(x86::branch_target(op, insn, a));
+      if (insn.rip_relative && insn.map == x86::MAP_1BYTE &&
+          insn.opcode == 0x8d)
+        tables.push_back(x86::rip_target(op, insn, a));
+    }
+  }
+  std::sort(m.funcs.begin(), m.funcs.end());
+  std::sort(m.opaque.begin(), m.opaque.end());
+
+  auto& rodata = b.rodata;
+  auto ro = rodata.vaddr();
+  auto ro_end = ro + rodata.max_sz();
+  for (auto t : tables) {
+    if (t < ro || t >= ro_end || t % 4 != 0) continue;
+    for (auto e = t; e + 4 <= ro_end && e - t < 4 * 4096; e += 4) {
+      auto dest = t + x86::read_signed(rodata.in_buf(e), 4);
+      if (dest < start || dest >= end) break;
+      m.targets.push_back(dest);
+    }
+  }
+  for (auto relocs : {&b.data.relocs, &b.rela_other})
+    for (auto& rela : *relocs) m.targets.push_back(rela.r_addend);
+  for (auto s : {&b.data, &b.rodata}) {
+    auto base = s->vaddr();
+    for (auto off = (8 - base % 8) % 8; off + 8 <= s->max_sz(); off += 8) {
+      uint64_t word;
+      memcpy(&word, s->in_buf() + off, sizeof(word));
+      if (word >= start && word < end) m.targets.push_back(word);
+    }
+  }
+  std::sort(m.targets.begin(), m.targets.end());
+  return m;
+}
+
+std::vector<const char*> pinned(::Bintail& b, const CodeMap& map,
+                                const std::vector<Range>& ranges) {
+  std::vector<const char*> r(ranges.size(), nullptr);
+  auto pin = [&](uint64_t addr, const char* reason) {
+    auto f = find(ranges, addr);
+    if (f != nullptr && r[f - ranges.data()] == nullptr)
+      r[f - ranges.data()] = reason;
+  };
+
+  auto start = b.text.vaddr();
+  auto buf = b.text.out_buf();
+  for (auto& fn : map.funcs) {
+    x86::Insn insn;
+    for (auto a = fn.first; a < fn.second; a += insn.len) {
+      auto op = buf + (a - start);
+      if (x86::decode(op, fn.second - a, &insn) == 0) break;
+      if (insn.rip_relative && !map.is_guarded(a) && !x86::reads_only(insn))
+        pin(x86::rip_target(op, insn, a), "written or address taken");
+    }
+  }
+  for (auto relocs : {&b.data.relocs, &b.rela_other})
+    for (auto& rela : *relocs) pin(rela.r_addend, "pointer in a relocation");
+  for (auto s : {&b.data, &b.rodata}) {
+    auto base = s->vaddr();
+    for (auto off = (8 - base % 8) % 8; off + 8 <= s->max_sz(); off += 8) {
+      uint64_t word;
+      memcpy(&word, s->in_buf() + off, sizeof(word));
+      pin(word, "pointer in data");
+    }
+  }
+  return r;
+}
+
+}  // namespace bintail
@@ -0,0 +1,50 @@
+#ifndef BINTAIL_FLOW_H_
+#define BINTAIL_FLOW_H_
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+class Bintail;
+
+namespace bintail {
+
+typedef std::pair<uint64_t, uint64_t> Range;  // [first, second)
+
+/**
+ * Control flow facts about .text for passes that rewrite code beyond the
+ * patch windows. targets holds everything that may be jumped to: function
+ * starts, direct branch targets, entries of relative jump tables (lea
+ * table(%rip) into .rodata followed by int32 offsets to the table),
+ * relocation addends and pointer sized words in .data and .rodata.
+ **/
+struct CodeMap {
+  std::vector<Range> funcs;    // FUNC symbols in .text
+  std::vector<Range> opaque;   // funcs the decoder cannot sweep to the end
+  std::vector<Range> guarded;  // int3 filled by apply
+  std::vector<uint64_t> targets;
+
+  /* Whether a target lies in (lo, hi) */
+  bool entered(uint64_t lo, uint64_t hi) const;
+
+  /* Function containing addr, {0, 0} if there is none or it is opaque */
+  Range function(uint64_t addr) const;
+
+  bool is_guarded(uint64_t addr) const;
+};
+
+/* Sweep the current (patched) .text of b */
+CodeMap code_map(::Bintail& b);
+
+/**
+ * For each of the sorted, disjoint ranges, why the program may change it
+ * or reach it other than by rip relative reads: a store or a taken
+ * address in code of map that is not guarded (opaque functions as far as
+ * they decode), a relocation addend or a pointer sized word in .data or
+ * .rodata. nullptr if nothing pins the range.
+ **/
+std::vector<const char*> pinned(::Bintail& b, const CodeMap& map,
+                                const std::vector<Range>& ranges);
+
+}  // namespace bintail
+#endif  // BINTAIL_FLOW_H_
@@ -0,0 +1,218 @@
+#include <bintail/bintail.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+#include "flow.h"
+#include "mvelem.h"
+#include "x86.h"
+
+using namespace std;
+namespace x86 = bintail::x86;
+
+static bool fits_signed(int64_t v, size_t size) {
+  auto bits = size * 8;
+  return v >= -(int64_t{1} << (bits - 1)) && v < (int64_t{1} << (bits - 1));
+}
+
+static int64_t sign_extend(uint64_t v, size_t size) {
+  if (size == 8) return int64_t(v);
+  auto shift = 64 - size * 8;
+  return int64_t(v << shift) >> shift;
+}
+
+static uint64_t truncate(uint64_t v, size_t size) {
+  return size == 8 ? v : v & ((uint64_t{1} << (size * 8)) - 1);
+}
+
+/* Optional 0x66 and REX, reg goes to the opcode or rm field */
+static size_t prefixes(uint8_t* p, size_t size, unsigned reg, bool rex) {
+  size_t n = 0;
+  if (size == 2) p[n++] = 0x66;
+  if ((rex && size == 1) || size == 8 || reg >= 8)
+    p[n++] = 0x40 | (size == 8 ? 0x8 : 0) | (reg >> 3);
+  return n;
+}
+
+static size_t put_imm(uint8_t* p, uint64_t v, size_t size) {
+  memcpy(p, &v, size);  // little endian
+  return size;
+}
+
+/**
+ * mov $v,%reg of size bytes, rex if the original had one (%sil instead of
+ * %dh).
+ *
+ * \return length, 0 without an encoding
+ **/
+static size_t mov_imm(uint8_t* p, unsigned reg, size_t size, uint64_t v,
+                      bool rex) {
+  if (size == 8 && v <= UINT32_MAX) size = 4;  // zero extends
+  if (size == 8 && !fits_signed(int64_t(v), 4)) return 0;
+  auto n = prefixes(p, size, reg, rex);
+  if (size == 8) {
+    p[n++] = 0xc7;
+    p[n++] = 0xc0 | (reg & 7);
+    return n + put_imm(p + n, v, 4);
+  }
+  p[n++] = (size == 1 ? 0xb0 : 0xb8) + (reg & 7);
+  return n + put_imm(p + n, v, size);
+}
+
+/* cmp $v,%reg (ext 7) or test $v,%reg (ext 0, no imm8 form) */
+static size_t alu_imm(uint8_t* p, unsigned ext, unsigned reg, size_t size,
+                      uint64_t v, bool rex) {
+  auto s = sign_extend(v, size);
+  if (size == 8 && !fits_signed(s, 4)) return 0;
+  auto n = prefixes(p, size, reg, rex);
+  auto modrm = uint8_t(0xc0 | ext << 3 | (reg & 7));
+  if (size == 1) {
+    p[n++] = ext == 7 ? 0x80 : 0xf6;
+    p[n++] = modrm;
+    return n + put_imm(p + n, v, 1);
+  }
+  if (ext == 7 && fits_signed(s, 1)) {
+    p[n++] = 0x83;
+    p[n++] = modrm;
+    return n + put_imm(p + n, v, 1);
+  }
+  p[n++] = ext == 7 ? 0x81 : 0xf7;
+  p[n++] = modrm;
+  return n + put_imm(p + n, v, size == 2 ? 2 : 4);
+}
+
+VarFold Bintail::fold_frozen_vars() {
+  VarFold r;
+  struct Frozen {
+    uint64_t start, end;
+    MVVar* var;
+    const char* pinned;
+  };
+  vector<Frozen> vars;
+  for (auto& v : model.vars)
+    if (v.frozen && v.in_data)
+      vars.push_back(
+          {v.location(), v.location() + v.var.variable_width, &v, nullptr});
+  if (vars.empty()) return r;
+  sort(vars.begin(), vars.end(),
+       [](auto& a, auto& b) { return a.start < b.start; });
+  auto frozen_at = [&](uint64_t a) -> const Frozen* {
+    auto it = upper_bound(vars.begin(), vars.end(), a,
+                          [](uint64_t a, auto& v) { return a < v.start; });
+    return it != vars.begin() && a < (it - 1)->end ? &*(it - 1) : nullptr;
+  };
+
+  auto map = bintail::code_map(*this);
+  auto start = text.vaddr();
+  auto buf = text.out_buf();
+
+  /* Reads of a variable the program may change keep reading it */
+  vector<bintail::Range> ranges;
+  for (auto& v : vars) ranges.emplace_back(v.start, v.end);
+  auto why = bintail::pinned(*this, map, ranges);
+  for (auto i = 0ul; i < vars.size(); i++) vars[i].pinned = why[i];
+
+  for (auto& fn : map.funcs) {
+    if (map.function(fn.first).second == 0 || map.is_guarded(fn.first))
+      continue;
+    x86::Insn insn;
+    for (auto a = fn.first; a < fn.second; a += insn.len) {
+      auto op = buf + (a - start);
+      if (x86::decode(op, fn.second - a, &insn) == 0) break;
+      if (!insn.rip_relative || map.is_guarded(a)) continue;
+      auto var = frozen_at(x86::rip_target(op, insn, a));
+      if (var == nullptr) continue;
+      auto unfolded = [&](const char* reason) {
+        r.unfolded.push_back({a, string(var->var->name()), reason});
+      };
+      if (var->pinned != nullptr) {
+        unfolded(var->pinned);
+        continue;
+      }
+
+      auto o = insn.opcode;
+      auto one = insn.map == x86::MAP_1BYTE;
+      auto size = insn.rex_w() ? 8ul : insn.opsize ? 2ul : 4ul;
+      auto byte_op = one && (o == 0x8a || o == 0x3a || o == 0x84 ||
+                             o == 0x80 || o == 0xf6);
+      auto width = byte_op ? 1ul : size;
+      if (insn.map == x86::MAP_0F && (o == 0xb6 || o == 0xbe)) width = 1;
+      if (insn.map == x86::MAP_0F && (o == 0xb7 || o == 0xbf)) width = 2;
+      if (x86::rip_target(op, insn, a) != var->start ||
+          width != var->end - var->start) {
+        unfolded("partial access");
+        continue;
+      }
+      auto value = truncate(var->var->value(), width);
+      auto reg = unsigned(insn.reg() | (insn.rex & 0x4) << 1);
+      auto rex = insn.rex != 0;
+
+      uint8_t code[16];
+      size_t len = 0;
+      if ((one && (o == 0x8b || o == 0x8a)) ||
+          (insn.map == x86::MAP_0F && o >= 0xb6 && o <= 0xbf &&
+           (o & 0x6) == 0x6)) {
+        /* mov, movzx, movsx: mov $value,%reg */
+        if (insn.map == x86::MAP_0F && o >= 0xbe)
+          value = truncate(sign_extend(value, width), size);
+        len = mov_imm(code, reg, byte_op ? 1 : size, value, rex);
+        if (len == 0 || len > insn.len) {
+          unfolded("no immediate encoding");
+          continue;
+        }
+        r.loads++;
+      } else if (one && (o == 0x3b || o == 0x3a || o == 0x85 || o == 0x84)) {
+        /* cmp var,%reg or test: cmp/test $value,%reg */
+        auto ext = o == 0x3b || o == 0x3a ? 7u : 0u;
+        len = alu_imm(code, ext, reg, width, value, rex);
+        if (len == 0 || len > insn.len) {
+          unfolded("no immediate encoding");
+          continue;
+        }
+        r.compares++;
+      } else if (one && ((o >= 0x80 && o <= 0x83 && insn.reg() == 7) ||
+                         ((o == 0xf6 || o == 0xf7) && insn.reg() == 0))) {
+        /* cmp/test $imm,var; jcc: the branch is decided */
+        auto imm = x86::read_signed(op + insn.imm_off, insn.imm_size);
+        auto flags = o >= 0xf6 ? x86::and_flags(value, imm, width)
+                               : x86::sub_flags(value, imm, width);
+        auto j = a + insn.len;
+        x86::Insn jcc;
+        auto jop = buf + (j - start);
+        if (x86::decode(jop, fn.second - j, &jcc) == 0 ||
+            jcc.branch != x86::BR_JCC ||
+            (jcc.map == x86::MAP_1BYTE && jcc.opcode >= 0xe0)) {
+          unfolded("compare without jcc");
+          continue;
+        }
+        auto after = j + jcc.len;
+        auto target = x86::branch_target(jop, jcc, j);
+        auto taken = x86::condition(jcc.opcode & 0xf, flags);
+        auto cont = taken ? target : after;
+        if (map.entered(a, after)) {
+          unfolded("jcc is a branch target");
+          continue;
+        }
+        if (cont < fn.first || cont >= fn.second ||
+            !x86::flags_dead(buf + (cont - start), fn.second - cont)) {
+          unfolded("flags used after jcc");
+          continue;
+        }
+        if (taken && !x86::write_jmp(op, a, target, after - a)) {
+          unfolded("jmp does not fit");
+          continue;
+        }
+        if (!taken) x86::write_nops(op, after - a);
+        r.branches++;
+        insn.len = after - a;
+        continue;
+      } else {
+        unfolded("unsupported instruction");
+        continue;
+      }
+      memcpy(op, code, len);
+      x86::write_nops(op + len, insn.len - len);
+    }
+  }
+  return r;
+}
@@ -3,10 +3,12 @@
 
 #include <gelf.h>
 #include <cstddef>
+#include <iosfwd>
 #include <map>
 #include <memory>
 #include <set>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #define ANSI_COLOR_RED     "\x1b[31m"
@@ -22,6 +24,28 @@ class MVVar;
 class MVFn;
 class MVPP;
 class MVData;
+class MVmvfn;
+class MVassign;
+
+/*
+ * Arena of the multiverse model. Every element lives in one contiguous
+ * array and refers to others by ID ranges (IdRange, mvelem.h), the
+ * grouped ID arrays map variables to functions and functions to their
+ * patchpoints.
+ */
+struct Model {
+  std::vector<MVVar> vars;
+  std::vector<MVFn> fns;
+  std::vector<MVmvfn> variants;   // grouped by fn
+  std::vector<MVassign> assigns;  // grouped by variant
+  std::vector<MVPP> pps;
+  std::vector<uint32_t> var_fns;  // fn IDs grouped by var
+  std::vector<uint32_t> fn_pps;   // pp IDs grouped by fn
+
+  /* Link assignments to variables and patchpoints to functions */
+  void link();
+  void link_pps();
+};
 
 /* bintail elf data */
 namespace bintail {
@@ -35,16 +59,16 @@ public:
     Section() :sz{0} {}
 
     void load(Elf_Scn * s);
-    std::string get_string(uint64_t addr);
+    std::string_view get_string(uint64_t addr);
     void fill(uint64_t addr, uint8_t value, size_t len);
     void print(size_t elem_sz); // scn_in
     bool inside(uint64_t addr); // scn_in
+    uint64_t vaddr(); // scn_in
     GElf_Rela *get_rela(uint64_t vaddr);
     virtual bool probe_rela(GElf_Rela *rela);
     void add_rela(uint64_t source, uint64_t target);
     bool in_segment(const GElf_Phdr &phdr);
     bool is_nobits();
-    void set_scn_out(Elf_Scn *_scn_out) { scn_out = _scn_out;}
 
     constexpr size_t size()  { return sz; }
     constexpr size_t max_sz()  { return max_size; }
@@ -58,13 +82,26 @@ public:
     virtual bool is_needed(bool overr);      // (in outfile)
     
     void set_out_scn(Elf_Scn *scn_out);
+    /* Flag the output data for libelf if out_buf() handed it out */
+    void commit();
 
     std::vector<GElf_Rela> relocs;
     Elf_Scn * scn_in = nullptr;
     Elf_Scn * scn_out = nullptr;
 protected:
-    size_t sz;
-    uint64_t max_size;
+    /* Output data and address, looked up on first use */
+    Elf_Data *out();
+
+    size_t sz = 0;
+    uint64_t max_size = 0;
+
+    /* Cached by load(), the input does not change */
+    GElf_Shdr shdr_in{};
+    const uint8_t *buf_in = nullptr;
+    /* Reset by set_out_scn(), generate() updates them */
+    Elf_Data *data_out = nullptr;
+    uint64_t addr_out = 0;
+    bool dirty = false;
 };
 
 class MVSection : public Section {
@@ -75,6 +112,11 @@ public:
     uint64_t stop_ptr;
 protected:
     void add_data(MVData* );
+    /* Output buffer generate() builds the records in, nullptr if dropped */
+    uint8_t *begin_records();
+    /* Header for size bytes at vaddr, start/stop_ptr in data if given */
+    uint64_t end_records(bool fpic, uint64_t offset, uint64_t vaddr,
+                         size_t size, Section *data);
 };
 
 class BssSection : public Section {
@@ -89,9 +131,9 @@ public:
     std::unique_ptr<std::vector<struct mv_info_fn>> read();
     uint64_t generate(bool fpic, uint64_t offset, uint64_t vaddr, Section *data);
     bool is_needed(bool overr);
-    void set_fns(std::vector<std::unique_ptr<MVFn>> *fns);
+    void set_model(Model *model);
 private:
-    std::vector<std::unique_ptr<MVFn>> *fns;
+    Model *model = nullptr;
 };
 
 class MVVarSection : public MVSection {
@@ -99,28 +141,32 @@ public:
     std::unique_ptr<std::vector<struct mv_info_var>> read();
     uint64_t generate(bool fpic, uint64_t offset, uint64_t vaddr, Section *data);
     bool is_needed(bool overr);
-    void set_vars(std::vector<std::shared_ptr<MVVar>> *vars);
+    void set_model(Model *model);
 private:
-    std::vector<std::shared_ptr<MVVar>> *vars;
+    Model *model = nullptr;
 };
 
 class MVCsSection : public MVSection {
 public:
     std::unique_ptr<std::vector<struct mv_info_callsite>> read();
     uint64_t generate(bool fpic, uint64_t offset, uint64_t vaddr, Section *data);
+    /* Append the runtime lists after generate, see Bintail::enable_prelink */
+    uint64_t prelink(bool fpic, uint64_t room, MVFnSection *mvfn,
+                     MVVarSection *mvvar, Section *text);
     bool is_needed(bool overr);
-    void set_pps(std::vector<std::unique_ptr<MVPP>> *pps);
+    void set_model(Model *model);
 private:
-    std::vector<std::unique_ptr<MVPP>> *pps;
+    Model *model = nullptr;
+    std::vector<uint8_t> linked;  // callsites and lists, owns the out data
 };
 
 class MVDataSection : public MVSection {
 public:
     uint64_t generate(bool fpic, uint64_t offset, uint64_t vaddr);
     bool is_needed(bool overr);
-    void set_fns(std::vector<std::unique_ptr<MVFn>> *fns);
+    void set_model(Model *model);
 private:
-    std::vector<std::unique_ptr<MVFn>> *fns;
+    Model *model = nullptr;
 };
 
 class Dynamic : public Section {
@@ -138,11 +184,12 @@ struct sec {
     Elf_Scn *scn;
     GElf_Shdr shdr;
     std::string name;
+    Elf_Scn *scn_out = nullptr;  // nullptr if removed or not written
 };
 
 struct symbol {
     GElf_Sym sym;
-    std::string name;
+    std::string_view name;  // into .strtab
 };
 
 class Area {
@@ -175,11 +222,13 @@ class InfoArea : public Area {
 public:
     InfoArea(Elf *e_out, bool fpic, MVDataSection *mvdata, MVVarSection *mvvar, 
             MVFnSection *mvfn, MVCsSection *mvcs, BssSection *bss);
-    uint64_t generate(Section *data);
+    uint64_t generate(Section *data, Section *text);
     void find_start_of_area();
     bool test_phdr(GElf_Phdr &phdr);
     uint64_t size_in_file();
     uint64_t shrink();
+
+    bool prelink = false;
 private:
     MVDataSection *mvdata;
     MVVarSection *mvvar;
@@ -188,9 +237,174 @@ private:
     BssSection *bss;
 };
 
+/* Result of Bintail::verify */
+struct VerifyReport {
+  size_t patchpoints = 0;    // patch windows decoded
+  size_t guarded_bytes = 0;  // bytes checked for int3
+  size_t branches = 0;       // direct branches checked in surviving code
+  size_t undecodable = 0;    // functions the sweep could not decode to the end
+  std::vector<std::string> errors;
+
+  bool ok() const { return errors.empty(); }
+};
+
+/* Footprint of a tailoring run, see Bintail::report */
+struct TailorReport {
+  /* Patched callsites by resulting instruction */
+  size_t pp_nop = 0;
+  size_t pp_constant = 0;
+  size_t pp_cli_sti = 0;
+  size_t pp_call = 0;
+  size_t pp_jump = 0;
+  size_t calls_eliminated = 0;  // calls that became inline instructions
+  size_t bytes_guarded = 0;
+
+  struct Size {
+    std::string name;
+    uint64_t before;
+    uint64_t after;
+  };
+  std::vector<Size> mv_sections;  // __multiverse_* sizes
+
+  size_t relocs_before = 0;
+  size_t relocs_after = 0;
+  uint64_t bss_shift = 0;
+
+  /* 4 KiB pages (by vaddr) with different content */
+  size_t text_pages = 0;
+  size_t text_pages_changed = 0;
+  size_t data_pages = 0;
+  size_t data_pages_changed = 0;
+
+  struct Checksum {
+    std::string name;
+    uint64_t in;
+    uint64_t out;
+    bool removed;
+  };
+  std::vector<Checksum> checksums;  // FNV-1a of every section with data
+
+  void print_text(std::ostream &os) const;
+  void print_json(std::ostream &os) const;
+};
+
+/* Sample profile attributed to multiverse code, see Bintail::profile */
+struct ProfileReport {
+  uint64_t total = 0;       // cycles (sum of sample periods)
+  uint64_t multiverse = 0;  // cycles in generic, variant or callsite code
+  size_t unparsed = 0;      // lines without a sample
+
+  struct Fn {
+    std::string name;
+    uint64_t generic;    // cycles in the generic body
+    uint64_t variants;   // cycles in variant bodies
+    uint64_t callsites;  // cycles at patchpoints and their return address
+    uint64_t saved;      // estimated cycles saved when frozen
+  };
+  struct Site {
+    uint64_t location;
+    std::string caller;  // function containing the callsite
+    std::string callee;
+    uint64_t cycles;         // at the callsite
+    uint64_t caller_cycles;  // in the whole caller
+  };
+  struct Var {
+    std::string name;
+    uint64_t saved;  // sum over the functions the variable selects
+    std::vector<std::string> fns;
+  };
+  std::vector<Fn> fns;      // by saved, descending
+  std::vector<Site> sites;  // by cycles, descending
+  std::vector<Var> vars;    // by saved, descending
+
+  void print_text(std::ostream &os, size_t top = 10) const;
+};
+
+/* Result of Bintail::discover_callsites */
+struct CallsiteScan {
+  size_t calls = 0;     // e8 rel32
+  size_t jumps = 0;     // e9 rel32 (tail calls)
+  size_t indirect = 0;  // ff 15, call *slot(%rip)
+  size_t rejected = 0;  // byte matches that are not instruction starts
+
+  size_t found() const { return calls + jumps + indirect; }
+};
+
+/* Result of Bintail::retarget_pointers */
+struct Retargeted {
+  size_t relocs = 0;            // R_X86_64_RELATIVE addends
+  std::vector<uint64_t> words;  // addresses of rewritten words (ET_EXEC)
+};
+
+/* Result of Bintail::fold_frozen_vars */
+struct VarFold {
+  size_t loads = 0;     // mov, movzx, movsx became mov $value,%reg
+  size_t compares = 0;  // cmp/test with a register became cmp/test $value
+  size_t branches = 0;  // cmp/test $imm,var; jcc became jmp or nops
+
+  struct Access {
+    uint64_t location;
+    std::string var;
+    std::string reason;
+  };
+  std::vector<Access> unfolded;  // accesses left as they are
+};
+
+/* Result of Bintail::move_frozen_vars */
+struct MovedVars {
+  size_t moved = 0;
+  size_t bytes = 0;
+  size_t references = 0;   // rip relative operands rewritten
+  size_t pages_saved = 0;  // .data pages left without used objects
+
+  struct Move {
+    std::string var;
+    uint64_t from, to;
+    std::vector<uint64_t> references;  // instructions pointing to the copy
+  };
+  std::vector<Move> moves;
+
+  struct Kept {
+    std::string var;
+    std::string reason;
+  };
+  std::vector<Kept> kept;
+};
+
+/* Result of Bintail::peephole */
+struct PeepholeStats {
+  size_t branches_folded = 0;  // jcc on a patched constant
+  size_t tail_calls = 0;       // call; ret turned into jmp
+  size_t nops_merged = 0;      // nop instructions saved
+  size_t refused = 0;          // rewrites that code might jump into
+
+  size_t total() const { return branches_folded + tail_calls + nops_merged; }
+};
+
+/* Result of Bintail::patch_script */
+struct PatchScript {
+  size_t vars = 0;      // variables with a script
+  size_t segments = 0;  // value ranges over all of them
+  size_t records = 0;   // (address, bytes) copies over all segments
+  size_t bytes = 0;     // size of .multiverse_patch
+
+  struct Skipped {
+    std::string var;
+    std::string reason;
+  };
+  std::vector<Skipped> skipped;
+};
+
+/* Bintail::dump output */
+enum class DumpFormat { JSON, CSV };
+
 class Bintail {
 public:
-    Bintail(const char *infile);
+    /* jobs threads load the input (0: one per core, 1: this thread). Lazy
+     * only looks up the sections, the model, symbols and relocations are
+     * read by the first method that needs them. Public members are only
+     * filled after such a call (any of print*, init_write, ...). */
+    Bintail(const char *infile, unsigned jobs = 0, bool lazy = false);
     ~Bintail();
 
     void print(); // Display mv_info_* structs in __multiverse_* section
@@ -199,6 +413,10 @@ public:
     void print_dyn();
     void print_vars();
 
+    /* Variables, functions, variants, assignments, patchpoints, relocations
+     * and symbols for machines, colored keys if color */
+    void dump(std::ostream &os, DumpFormat fmt, bool color = false);
+
     void init_write(const char *outfile, bool del_scns);
     void write();
     void update_relocs_sym();
@@ -207,6 +425,70 @@ public:
     void apply(std::string apply_str, bool guard);
     void apply_all(bool guard);
 
+    /* var=lower..upper: drop the variants the variable never selects in
+     * that range, the others stay switchable. Call before apply.
+     * \return number of variants dropped */
+    size_t constrain(std::string constraint_str, bool guard);
+
+    /* Point function pointers to frozen functions at the chosen variant,
+     * call after apply and before write. Pointers computed in code stay
+     * generic, comparisons of both no longer hold. Only relative
+     * relocations are followed unless words is set, then words equal to a
+     * generic body inside objects of 8 byte slots in .data and .rodata of
+     * non-PIE executables are rewritten too. */
+    Retargeted retarget_pointers(bool words = false);
+
+    /* Replace rip relative reads of frozen variables in .data with
+     * immediates, call after apply. Variables the program may change (see
+     * move_frozen_vars) keep all their reads. */
+    VarFold fold_frozen_vars();
+
+    /* Copy frozen variables only read by code into a read-only segment
+     * behind the others (.multiverse_rodata, with a new program header
+     * table) and point the code there, call after apply. The .data slots
+     * keep their value for references the sweep cannot see. */
+    MovedVars move_frozen_vars();
+
+    /* Simplify the code behind patched callsites, call after apply */
+    PeepholeStats peephole();
+
+    /* For each variable left dynamic and each value range its assignments
+     * tell apart, the patchpoint bytes to copy on a commit into that range.
+     * write() stores them in .multiverse_patch, see patch.h for the layout.
+     * Call after apply. */
+    PatchScript patch_script();
+
+    /* Add patchpoints for calls missing in __multiverse_callsite_, indirect
+     * ones only through slots the program cannot reassign */
+    CallsiteScan discover_callsites();
+
+    /* Check the tailored .text: patch windows, guards and branch targets */
+    VerifyReport verify();
+
+    /* Write the info sections with the variable -> function and function
+     * -> patchpoint lists already linked, each mv_info_var is marked with
+     * MV_VAR_PRELINKED. The records use space freed in the info area. */
+    void enable_prelink();
+
+    /* Drop the sections that are not loaded (.debug_*, .comment, ...)
+     * except for the symbol table, call before init_write. With a
+     * debug_file they are written there and .gnu_debuglink points to it. */
+    void strip(const char *debug_file = nullptr);
+
+    /* Byte between sections in the output, int3 by default */
+    void set_fill(uint8_t fill);
+
+    /* Progress of init_write and write, none unless set. Instances share
+     * no state, each may tailor in its own thread. */
+    void set_log(std::ostream *os);
+
+    /* Snapshot the input for report(), call before init_write */
+    void enable_report();
+    TailorReport report();
+
+    /* Rank variables by the cycles a perf script profile spends on them */
+    ProfileReport profile(const char *perf_script);
+
     std::unique_ptr<InfoArea> mvinfo_area;
 
     Section rodata;
@@ -225,17 +507,37 @@ public:
     MVCsSection mvcs;
     MVDataSection mvdata;
 
-    std::vector<std::shared_ptr<MVVar>> vars;
-    std::vector<std::unique_ptr<MVFn>> fns;
-    std::vector<std::unique_ptr<MVPP>> pps;
+    Model model;
 
     std::vector<GElf_Rela> rela_other;
     std::vector<symbol>  syms;
 private:
+ void load();
+
+ /* Parts of the input read on demand */
+ enum : unsigned {
+   LOAD_SYMS = 1,
+   LOAD_MODEL = 2,   // info sections, needs symbols
+   LOAD_RELOCS = 4,  // claimed by the sections, needs symbols
+   LOAD_EXE = 8,
+   LOAD_ALL = 15,
+ };
+ void require(unsigned parts);
+ std::vector<std::pair<GElf_Rela, std::string_view>> label_relocs(
+     std::vector<GElf_Rela> relas);
+ std::string path;
+ unsigned jobs;
+ unsigned loaded = 0;
+ void snapshot_input();
+
  std::unique_ptr<bintail::ElfExe> exe_;
  /* Elf file */
- int infd, outfd;
- Elf *e_in, *e_out;
+ int infd = -1, outfd = -1;
+ std::string out_path, tmp_path;  // write() renames tmp_path
+ uint8_t fill_byte = 0xcc;
+ std::ostream *log = nullptr;
+ size_t boundary_vars = 0, boundary_fns = 0, boundary_cs = 0;
+ Elf *e_in = nullptr, *e_out = nullptr;
  GElf_Ehdr ehdr_in, ehdr_out;
 
  Elf_Scn *reloc_scn_in;
@@ -243,9 +545,131 @@ private:
 
  Elf_Scn *symtab_scn;
 
- uint removed_scns;
+ /* Input section index -> output index, 0 if removed */
+ std::vector<size_t> scn_index;
+
+ /* strip() */
+ bool strip_enabled = false;
+ std::string debug_file;
+ std::vector<uint8_t> debuglink;
+ bool is_debug(const struct sec &s);
+ void compact_nonalloc();
+ void write_debug_file();
+
+ bool prelink_enabled = false;
+
+ /* Collected for report() */
+ bool report_enabled = false;
+ std::vector<uint64_t> text_pages_in, data_pages_in;
+ std::vector<uint64_t> sums_in;  // per secs entry, 0 for nobits
+ size_t relocs_in = 0, relocs_out = 0;
+ uint64_t bss_shift = 0;
+
+ /* Copies of the variables moved by move_frozen_vars, write() appends
+  * them at ro_vaddr behind a new program header table at ro_segment. The
+  * file offsets are the addresses minus ro_base. */
+ std::vector<uint8_t> ro_vars;
+ bool ro_mapped = false;
+ uint64_t ro_base = 0, ro_segment = 0, ro_vaddr = 0;
+ bool map_ro_vars();
+ void write_ro_vars();
+
+ /* .multiverse_patch from patch_script, appended by write() */
+ std::vector<uint8_t> script;
+ std::vector<uint8_t> shstrtab_out;
+ /* Loaded at addr if not 0 */
+ void append_section(const char *name, std::vector<uint8_t> &bytes,
+                     uint64_t addr = 0, uint64_t offset = 0);
 
  std::vector<struct sec> secs;
  std::map<Elf_Scn *, Section *> scn_handler;
 };
+
+/* Configuration space exploration */
+struct ExploreResult {
+  std::string config;    // var=value,... in variable order
+  std::string artifact;  // file in outdir, shared by byte-identical outputs
+};
+
+/**
+ * Tailor infile for every combination of variable values told apart by the
+ * mv_info_assignment bounds, jobs in parallel (0: one per core). Identical
+ * outputs are stored once, outdir/explore.map lists config -> artifact.
+ **/
+std::vector<ExploreResult> explore(const char *infile, const char *outdir,
+                                   unsigned jobs = 0);
+
+/* Triage */
+struct Preflight {
+  std::string path;
+  bool ok = false;     // worth constructing a Bintail for
+  std::string reason;  // why not
+  bool pic = false;
+  size_t vars = 0, fns = 0, callsites = 0;  // from the section sizes
+};
+
+/**
+ * Tell from the ELF header and the section headers alone whether path can
+ * be tailored: a 64 bit x86 executable with the sections Bintail needs.
+ * Nothing else is read, a file passing may still lack the boundary symbols.
+ **/
+Preflight preflight(const std::string &path);
+
+/**
+ * preflight() for the files in paths, directories are walked recursively
+ * (symbolic links are not followed). Results are sorted by path.
+ **/
+std::vector<Preflight> triage(const std::vector<std::string> &paths,
+                              unsigned threads = 0);
+
+/* Batch tailoring */
+struct BatchJob {
+  std::string infile;
+  std::string outfile;
+  std::vector<std::string> changes;  // var=value, see Bintail::change
+  std::vector<std::string> apply;    // var, see Bintail::apply
+  std::vector<std::string> constraints;  // var=lower..upper, see constrain
+  bool apply_all = false;
+  bool guard = true;
+  bool discover = false;   // see Bintail::discover_callsites
+  bool retarget = false;   // see Bintail::retarget_pointers
+  bool retarget_words = false;
+  bool fold_vars = false;  // see Bintail::fold_frozen_vars
+  bool move_vars = false;  // see Bintail::move_frozen_vars
+  bool prelink = false;    // see Bintail::enable_prelink
+  bool peephole = false;   // see Bintail::peephole
+  bool script = false;     // see Bintail::patch_script
+  bool verify = false;     // fail the job if Bintail::verify does
+  bool strip = false;        // see Bintail::strip
+  bool split_debug = false;  // strip into outfile.debug
+};
+
+struct BatchResult {
+  std::string infile;
+  bool ok = false;
+  std::string error;
+  double seconds = 0;
+};
+
+/**
+ * One job per file, directories are expanded (not recursive). Each job is
+ * a copy of defaults writing to outdir/<name>. A config file with lines
+ *   name [-A] [-D] [-f] [-F] [-g] [-G] [-L] [-M] [-O] [-P] [-S] [-V] [-W]
+ *        [-a var]... [-C var=lower..upper]... [-s var=value]...
+ * replaces the options for the file called name, they mean the same as on
+ * the command line (-G writes outdir/<name>.debug). Throws if two files
+ * would write the same output, e.g. files of the same name in different
+ * directories.
+ **/
+std::vector<BatchJob> batch_jobs(const std::vector<std::string> &paths,
+                                 const std::string &outdir,
+                                 const BatchJob &defaults,
+                                 const char *config = nullptr);
+
+/**
+ * Tailor all jobs on a work-stealing pool (0: one worker per core). A failing
+ * job is reported in its result and does not stop the others.
+ **/
+std::vector<BatchResult> tailor_batch(const std::vector<BatchJob> &jobs,
+                                      unsigned threads = 0);
 #endif
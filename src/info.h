@@ -0,0 +1,68 @@
+#ifndef BINTAIL_INFO_H_
+#define BINTAIL_INFO_H_
+
+#include <gelf.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+#include "mvelem.h"
+
+namespace bintail {
+
+/**
+ * Records of a __multiverse_* section, T as laid out in the file.
+ * Pointers are the offsets of the fields holding an address, in a PIE
+ * each of them needs a relative relocation.
+ *
+ * Records are built in place in the output buffer, relocate() then adds
+ * the relocations of a whole array at once.
+ **/
+template <class T, size_t... Pointers>
+struct InfoRecords {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "records are copied as bytes");
+  static constexpr size_t pointers[] = {Pointers...};
+
+  static std::unique_ptr<std::vector<T>> read(const uint8_t* buf,
+                                              size_t size) {
+    auto v = std::make_unique<std::vector<T>>(size / sizeof(T));
+    if (buf != nullptr) memcpy(v->data(), buf, v->size() * sizeof(T));
+    return v;
+  }
+
+  /* Relocations for records[0, n), stored at vaddr */
+  static void relocate(const T* records, size_t n, uint64_t vaddr,
+                       std::vector<GElf_Rela>* relocs) {
+    relocs->reserve(relocs->size() + n * sizeof...(Pointers));
+    auto bytes = reinterpret_cast<const uint8_t*>(records);
+    for (auto i = 0ul; i < n * sizeof(T); i += sizeof(T))
+      for (auto off : pointers) {
+        GElf_Rela r;
+        r.r_offset = vaddr + i + off;
+        r.r_info = R_X86_64_RELATIVE;
+        memcpy(&r.r_addend, bytes + i + off, sizeof(uint64_t));
+        relocs->push_back(r);
+      }
+  }
+};
+
+using FnRecords = InfoRecords<mv_info_fn, offsetof(mv_info_fn, name),
+                              offsetof(mv_info_fn, function_body),
+                              offsetof(mv_info_fn, mv_functions)>;
+using VarRecords = InfoRecords<mv_info_var, offsetof(mv_info_var, name),
+                               offsetof(mv_info_var, variable_location)>;
+using CallsiteRecords =
+    InfoRecords<mv_info_callsite, offsetof(mv_info_callsite, function_body),
+                offsetof(mv_info_callsite, call_label)>;
+using MvfnRecords =
+    InfoRecords<mv_info_mvfn, offsetof(mv_info_mvfn, function_body),
+                offsetof(mv_info_mvfn, assignments)>;
+using AssignRecords =
+    InfoRecords<mv_info_assignment, offsetof(mv_info_assignment, location)>;
+
+}  // namespace bintail
+#endif  // BINTAIL_INFO_H_
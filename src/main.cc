@@ -1,4 +1,5 @@
 #include <getopt.h>
+#include <unistd.h>
 #include <iostream>
 #include <string>
 #include <vector>
@@ -15,12 +16,33 @@ int main(int argc, char* argv[]) {
   auto dyn = false;
   auto sym = false;
   auto mvreloc = false;
+  auto verify = false;
+  auto discover = false;
+  auto retarget = false;
+  auto retarget_words = false;
+  auto fold_vars = false;
+  auto move_vars = false;
+  auto prelink = false;
+  auto peephole = false;
+  auto script = false;
+  auto jobs = 0u;
+  const char* explore_dir = nullptr;
+  const char* batch_dir = nullptr;
+  const char* batch_config = nullptr;
+  auto check = false;
+  string report_fmt;
+  string dump_fmt;
+  const char* perf_profile = nullptr;
+  auto strip = false;
+  const char* debug_file = nullptr;
   vector<string> changes;
   vector<string> apply;
+  vector<string> constraints;
 
   int opt;
   int rt = 1;
-  while ((opt = getopt(argc, argv, "a:Adhglrs:twy")) != -1) {
+  const char* opts = "a:Ab:c:C:dDe:fFgG:hj:lLMOPp:rR:s:StTVwWX:y";
+  while ((opt = getopt(argc, argv, opts)) != -1) {
     switch (opt) {
       case 'a':
         apply.push_back(optarg);
@@ -28,21 +50,90 @@ int main(int argc, char* argv[]) {
       case 'A':
         apply_all = true;
         break;
+      case 'b':
+        batch_dir = optarg;
+        break;
+      case 'c':
+        batch_config = optarg;
+        break;
+      case 'C':
+        constraints.push_back(optarg);
+        break;
       case 'd':
         display = true;
         break;
+      case 'D':
+        discover = true;
+        break;
+      case 'e':
+        explore_dir = optarg;
+        break;
+      case 'f':
+        retarget = true;
+        break;
+      case 'F':
+        fold_vars = true;
+        break;
       case 'g':
         guard = false;
         break;
+      case 'G':
+        strip = true;
+        debug_file = optarg;
+        break;
+      case 'j':
+        jobs = stoul(optarg);
+        break;
       case 'l':
         dyn = true;
         break;
+      case 'L':
+        prelink = true;
+        break;
+      case 'M':
+        move_vars = true;
+        break;
+      case 'O':
+        peephole = true;
+        break;
+      case 'P':
+        script = true;
+        break;
+      case 'p':
+        perf_profile = optarg;
+        break;
       case 'r':
         mvreloc = true;
         break;
+      case 'R':
+        report_fmt = optarg;
+        if (report_fmt != "text" && report_fmt != "json") {
+          cerr << "Unknown report format " << report_fmt << "\n";
+          return 1;
+        }
+        break;
       case 's':
         changes.push_back(optarg);
         break;
+      case 'S':
+        strip = true;
+        break;
+      case 'T':
+        check = true;
+        break;
+      case 'V':
+        verify = true;
+        break;
+      case 'W':
+        retarget = retarget_words = true;
+        break;
+      case 'X':
+        dump_fmt = optarg;
+        if (dump_fmt != "json" && dump_fmt != "csv") {
+          cerr << "Unknown dump format " << dump_fmt << "\n";
+          return 1;
+        }
+        break;
       case 'y':
         sym = true;
         break;
@@ -50,21 +141,102 @@ int main(int argc, char* argv[]) {
         rt = 0;
       default:
         cerr << "Usage: bintail [-d] [-w] infile outfile\n"
+             << "       bintail -b outdir [-c config] file|dir...\n"
+             << "       bintail -T file|dir...\n"
              << "Tailor multiverse executable\n"
              << "\n"
              << "-a var         Apply variable.\n"
              << "-A             Apply all variables.\n"
+             << "-b outdir      Tailor all files in parallel into outdir.\n"
+             << "-c config      Per file options for -b: name [opts].\n"
+             << "-C var=lo..hi  Keep only the variants var selects in range.\n"
              << "-d             Display multiverse configuration.\n"
+             << "-D             Also patch calls missing in callsite info.\n"
+             << "-e dir         Explore all configurations into dir.\n"
+             << "-f             Point function pointers at frozen variants.\n"
+             << "-F             Fold reads of frozen variables.\n"
+             << "-G file        Move unloaded sections into file (-S).\n"
              << "-h             Print help.\n"
              << "-g             Do not guard unused code.\n"
+             << "-j n           Number of parallel jobs (default: cores).\n"
              << "-l             Show dynamic info.\n"
+             << "-L             Write the runtime lists prelinked.\n"
+             << "-M             Move frozen variables to read-only pages.\n"
+             << "-O             Simplify code behind patched callsites.\n"
+             << "-P             Store patch scripts for dynamic variables.\n"
+             << "-p profile     Rank variables by cycles in a perf script.\n"
              << "-r             Dump mvrelocs.\n"
+             << "-R text|json   Report the footprint of tailoring.\n"
              << "-s var=value   Set variable to value.\n"
+             << "-S             Strip debug and other unloaded sections.\n"
+             << "-T             Check which files can be tailored.\n"
+             << "-V             Verify patched code after tailoring.\n"
+             << "-W             -f, also words in non-PIE .data/.rodata.\n"
+             << "-X json|csv    Dump the model, relocations and symbols.\n"
              << "-y             Dump Symbols.\n"
              << "\n";
         return rt;
     }
   }
+  if (check) {
+    try {
+      auto results = triage({argv + optind, argv + argc}, jobs);
+      auto ok = 0u;
+      for (auto& r : results) {
+        if (r.ok)
+          cout << r.path << " ok" << (r.pic ? " pic" : "")
+               << " vars=" << r.vars << " fns=" << r.fns
+               << " callsites=" << r.callsites << "\n";
+        else
+          cout << r.path << " - " << r.reason << "\n";
+        ok += r.ok;
+      }
+      cout << ok << "/" << results.size() << " can be tailored\n";
+    } catch (const std::exception& e) {
+      cerr << "bintail: " << e.what() << "\n";
+      return 1;
+    }
+    return 0;
+  }
+
+  if (batch_dir != nullptr) {
+    BatchJob defaults;
+    defaults.changes = changes;
+    defaults.apply = apply;
+    defaults.constraints = constraints;
+    defaults.apply_all = apply_all;
+    defaults.guard = guard;
+    defaults.discover = discover;
+    defaults.retarget = retarget;
+    defaults.retarget_words = retarget_words;
+    defaults.fold_vars = fold_vars;
+    defaults.move_vars = move_vars;
+    defaults.prelink = prelink;
+    defaults.peephole = peephole;
+    defaults.script = script;
+    defaults.verify = verify;
+    defaults.strip = strip;
+    defaults.split_debug = debug_file != nullptr;
+    vector<string> paths{argv + optind, argv + argc};
+
+    auto failed = 0u;
+    try {
+      auto results = tailor_batch(
+          batch_jobs(paths, batch_dir, defaults, batch_config), jobs);
+      for (auto& r : results) {
+        cout << r.infile << (r.ok ? " ok " : " FAILED ") << r.seconds << "s"
+             << (r.ok ? "" : ": " + r.error) << "\n";
+        failed += !r.ok;
+      }
+      cout << results.size() - failed << "/" << results.size()
+           << " tailored\n";
+    } catch (const std::exception& e) {
+      cerr << "bintail: " << e.what() << "\n";
+      return 1;
+    }
+    return failed == 0 ? 0 : 1;
+  }
+
   if (optind + 2 != argc) {
     if (optind + 1 == argc) {
       write = false;
@@ -76,22 +248,105 @@ int main(int argc, char* argv[]) {
 
   auto infile = argv[optind];
   auto outfile = argv[optind + 1];
-  Bintail bintail{infile};
 
-  if (sym) bintail.print_sym();
-  if (dyn) bintail.print_dyn();
-  if (mvreloc) bintail.print_reloc();
-  if (display) bintail.print();
+  try {
+    if (explore_dir != nullptr) {
+      for (auto& r : explore(infile, explore_dir, jobs))
+        cout << r.config << " " << r.artifact << "\n";
+      return 0;
+    }
+
+    Bintail bintail{infile, jobs, !write};  // inspection reads on demand
 
-  if (!write) return 0;
+    if (sym) bintail.print_sym();
+    if (dyn) bintail.print_dyn();
+    if (mvreloc) bintail.print_reloc();
+    if (discover) {
+      auto scan = bintail.discover_callsites();
+      cout << " discovered=" << dec << scan.found() << " (call=" << scan.calls
+           << " jmp=" << scan.jumps << " indirect=" << scan.indirect
+           << ") rejected=" << scan.rejected << "\n";
+    }
+    if (display) bintail.print();
+    if (!dump_fmt.empty()) {
+      auto fmt = dump_fmt == "json" ? DumpFormat::JSON : DumpFormat::CSV;
+      bintail.dump(cout, fmt, isatty(STDOUT_FILENO));
+    }
+    if (perf_profile != nullptr) bintail.profile(perf_profile).print_text(cout);
 
-  bintail.init_write(outfile, apply_all);
+    if (!write) return 0;
 
-  for (auto& e : changes) bintail.change(e);
-  for (auto& e : apply) bintail.apply(e, guard);
-  if (apply_all) bintail.apply_all(guard);
+    if (!report_fmt.empty()) bintail.enable_report();
+    /* Only the report goes to stdout if it is JSON */
+    auto& progress = report_fmt == "json" ? cerr : cout;
+    bintail.set_log(&progress);
+    if (strip) bintail.strip(debug_file);
+    bintail.init_write(outfile, apply_all);
 
-  bintail.write();
+    for (auto& e : constraints)
+      progress << " " << e << " dropped=" << dec << bintail.constrain(e, guard)
+               << "\n";
+    for (auto& e : changes) bintail.change(e);
+    for (auto& e : apply) bintail.apply(e, guard);
+    if (apply_all) bintail.apply_all(guard);
+    if (fold_vars) {
+      auto fold = bintail.fold_frozen_vars();
+      progress << " folded loads=" << dec << fold.loads
+               << " compares=" << fold.compares << " branches=" << fold.branches
+               << " unfolded=" << fold.unfolded.size() << "\n";
+      for (auto& u : fold.unfolded)
+        progress << "\t0x" << hex << u.location << dec << " " << u.var << ": "
+                 << u.reason << "\n";
+    }
+    if (move_vars) {
+      auto moved = bintail.move_frozen_vars();
+      progress << " moved=" << dec << moved.moved << " bytes=" << moved.bytes
+               << " references=" << moved.references
+               << " pages_saved=" << moved.pages_saved << "\n";
+      for (auto& m : moved.moves)
+        progress << "\t" << m.var << " 0x" << hex << m.from << " -> 0x" << m.to
+                 << dec << "\n";
+      for (auto& k : moved.kept)
+        progress << "\tkept " << k.var << ": " << k.reason << "\n";
+    }
+    if (retarget) {
+      auto r = bintail.retarget_pointers(retarget_words);
+      progress << " retargeted relocs=" << dec << r.relocs
+               << " words=" << r.words.size() << "\n";
+      for (auto a : r.words) progress << "\t0x" << hex << a << dec << "\n";
+    }
+    if (peephole) {
+      auto p = bintail.peephole();
+      progress << " peephole folded=" << dec << p.branches_folded
+               << " tail_calls=" << p.tail_calls << " nops=" << p.nops_merged
+               << " refused=" << p.refused << "\n";
+    }
+    if (script) {
+      auto s = bintail.patch_script();
+      progress << " script vars=" << dec << s.vars << " segments=" << s.segments
+               << " records=" << s.records << " bytes=" << s.bytes << "\n";
+      for (auto& k : s.skipped)
+        progress << "\tskipped " << k.var << ": " << k.reason << "\n";
+    }
+
+    if (prelink) bintail.enable_prelink();
+    bintail.write();
+
+    if (verify) {
+      auto report = bintail.verify();
+      for (auto& e : report.errors) cerr << "verify: " << e << "\n";
+      progress << " verified pp=" << dec << report.patchpoints
+               << " guarded=" << report.guarded_bytes
+               << " branches=" << report.branches << "\n";
+      if (!report.ok()) return 1;
+    }
+
+    if (report_fmt == "text") bintail.report().print_text(cout);
+    if (report_fmt == "json") bintail.report().print_json(cout);
+  } catch (const std::exception& e) {
+    cerr << "bintail: " << e.what() << "\n";
+    return 1;
+  }
 
   return 0;
 }
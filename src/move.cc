@@ -0,0 +1,231 @@
+#include <bintail/bintail.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+#include "flow.h"
+#include "mvelem.h"
+#include "x86.h"
+
+using namespace std;
+namespace x86 = bintail::x86;
+using bintail::Range;
+
+static const uint64_t page_size = 4096;
+
+/* disp32 at d moved by delta, nullopt if out of range */
+static optional<int32_t> moved_disp(const uint8_t* d, int64_t delta) {
+  auto disp = x86::read_signed(d, 4) + delta;
+  if (disp < INT32_MIN || disp > INT32_MAX) return nullopt;
+  return int32_t(disp);
+}
+
+/*
+ * Read-only segment for the copies behind the highest PT_LOAD. The input
+ * table has no room for its PT_LOAD, so the segment starts with a new one,
+ * one entry longer. Its address and offset differ by as much as those of
+ * the first PT_LOAD, kernels before 5.18 derive AT_PHDR from that and
+ * e_phoff. The offset leaves room for .shstrtab, append_section moves it
+ * behind the sections.
+ */
+bool Bintail::map_ro_vars() {
+  if (ro_mapped) return true;
+  size_t phnum;
+  if (elf_getphdrnum(e_out, &phnum) != 0) return false;
+  uint64_t end = 0;
+  for (auto i = 0ul; i < phnum; i++) {
+    GElf_Phdr phdr;
+    gelf_getphdr(e_out, i, &phdr);
+    if (phdr.p_type != PT_LOAD) continue;
+    if (end == 0) ro_base = phdr.p_vaddr - phdr.p_offset;
+    end = max(end, phdr.p_vaddr + phdr.p_memsz);
+  }
+  if (end == 0 || ro_base % page_size != 0) return false;
+
+  uint64_t file_end = 0, names = sizeof(".multiverse_rodata");
+  GElf_Shdr shdr;
+  Elf_Scn* scn = nullptr;
+  while ((scn = elf_nextscn(e_out, scn))) {
+    gelf_getshdr(scn, &shdr);
+    auto size = shdr.sh_type == SHT_NOBITS ? 0 : shdr.sh_size;
+    file_end = max(file_end, shdr.sh_offset + size);
+    if (elf_ndxscn(scn) == ehdr_out.e_shstrndx) names += size;
+  }
+  file_end += names;
+  auto page = [](uint64_t a) {
+    return (a + page_size - 1) / page_size * page_size;
+  };
+  ro_mapped = true;
+  ro_segment = max(page(end), page(ro_base + file_end));
+  ro_vaddr = ro_segment + ((phnum + 1) * sizeof(Elf64_Phdr) + 15) / 16 * 16;
+  return true;
+}
+
+/* The new program header table with the segment for the copies */
+void Bintail::write_ro_vars() {
+  size_t phnum;
+  elf_getphdrnum(e_out, &phnum);
+  vector<GElf_Phdr> phdrs(phnum);
+  for (auto i = 0ul; i < phnum; i++) gelf_getphdr(e_out, i, &phdrs[i]);
+
+  GElf_Phdr load{};
+  load.p_type = PT_LOAD;
+  load.p_flags = PF_R;
+  load.p_offset = ro_segment - ro_base;
+  load.p_vaddr = load.p_paddr = ro_segment;
+  load.p_filesz = load.p_memsz = ro_vaddr + ro_vars.size() - ro_segment;
+  load.p_align = page_size;
+  /* Behind the last PT_LOAD, loadable entries are sorted by address */
+  auto last = find_if(phdrs.rbegin(), phdrs.rend(),
+                      [](auto& p) { return p.p_type == PT_LOAD; });
+  phdrs.insert(last.base(), load);
+  for (auto& p : phdrs)
+    if (p.p_type == PT_PHDR) {
+      p.p_offset = load.p_offset;
+      p.p_vaddr = p.p_paddr = ro_segment;
+      p.p_filesz = p.p_memsz = phdrs.size() * sizeof(Elf64_Phdr);
+    }
+
+  append_section(".multiverse_rodata", ro_vars, ro_vaddr,
+                 load.p_offset + (ro_vaddr - ro_segment));
+  if (gelf_newphdr(e_out, phdrs.size()) == nullptr)
+    throw std::runtime_error("gelf_newphdr failed.");
+  for (auto i = 0ul; i < phdrs.size(); i++)
+    gelf_update_phdr(e_out, i, &phdrs[i]);
+  ehdr_out.e_phoff = load.p_offset;
+  ehdr_out.e_phnum = phdrs.size();
+}
+
+MovedVars Bintail::move_frozen_vars() {
+  MovedVars r;
+  struct Candidate {
+    MVVar* var;
+    uint64_t start, end;
+    vector<pair<uint64_t, uint8_t>> refs;  // address, offset of the disp32
+    const char* kept = nullptr;
+  };
+  vector<Candidate> vars;
+  for (auto& v : model.vars)
+    if (v.frozen && v.in_data)
+      vars.push_back(
+          {&v, v.location(), v.location() + v.var.variable_width, {}});
+  if (vars.empty()) return r;
+  sort(vars.begin(), vars.end(),
+       [](auto& a, auto& b) { return a.start < b.start; });
+  auto var_at = [&](uint64_t a) -> Candidate* {
+    auto it = upper_bound(vars.begin(), vars.end(), a,
+                          [](uint64_t a, auto& v) { return a < v.start; });
+    return it != vars.begin() && a < (it - 1)->end ? &*(it - 1) : nullptr;
+  };
+
+  if (!map_ro_vars()) {
+    for (auto& v : vars)
+      r.kept.push_back(
+          {string(v.var->name()), "no segment to map read-only data"});
+    return r;
+  }
+
+  auto map = bintail::code_map(*this);
+  auto start = text.vaddr();
+  auto buf = text.out_buf();
+
+  vector<Range> ranges;
+  for (auto& v : vars) ranges.emplace_back(v.start, v.end);
+  auto why = bintail::pinned(*this, map, ranges);
+  for (auto i = 0ul; i < vars.size(); i++) vars[i].kept = why[i];
+
+  /* References from live code */
+  for (auto& fn : map.funcs) {
+    if (map.function(fn.first).second == 0) continue;
+    x86::Insn insn;
+    for (auto a = fn.first; a < fn.second; a += insn.len) {
+      auto op = buf + (a - start);
+      if (x86::decode(op, fn.second - a, &insn) == 0) break;
+      if (!insn.rip_relative || map.is_guarded(a)) continue;
+      auto v = var_at(x86::rip_target(op, insn, a));
+      if (v != nullptr) v->refs.emplace_back(a, insn.disp_off);
+    }
+  }
+
+  /* Widest first so that the alignment wastes little */
+  vector<Candidate*> order;
+  for (auto& v : vars) order.push_back(&v);
+  stable_sort(order.begin(), order.end(), [](auto a, auto b) {
+    return a->end - a->start > b->end - b->start;
+  });
+
+  vector<Range> moved;
+  for (auto v : order) {
+    if (v->kept != nullptr) {
+      r.kept.push_back({string(v->var->name()), v->kept});
+      continue;
+    }
+    auto width = v->end - v->start;
+    auto off = (ro_vars.size() + width - 1) / width * width;
+    auto to = ro_vaddr + off;
+    vector<int32_t> disps;
+    for (auto& ref : v->refs) {
+      auto disp = moved_disp(buf + (ref.first - start) + ref.second,
+                             int64_t(to) - int64_t(v->start));
+      if (!disp) break;
+      disps.push_back(*disp);
+    }
+    if (disps.size() != v->refs.size()) {
+      r.kept.push_back({string(v->var->name()), "copy out of rip range"});
+      continue;
+    }
+
+    ro_vars.resize(off + width, 0);
+    memcpy(ro_vars.data() + off, data.out_buf(v->start), width);
+    MovedVars::Move m{string(v->var->name()), v->start, to, {}};
+    for (auto i = 0ul; i < disps.size(); i++) {
+      auto& ref = v->refs[i];
+      memcpy(buf + (ref.first - start) + ref.second, &disps[i],
+             sizeof(int32_t));
+      m.references.push_back(ref.first);
+    }
+    r.moves.push_back(move(m));
+    moved.emplace_back(v->start, v->end);
+    r.moved++;
+    r.bytes += width;
+    r.references += v->refs.size();
+  }
+  if (r.moved == 0) return r;
+  if (syms.empty()) return r;  // no objects to tell used pages
+
+  /*
+   * A .data page stays clean and shared if no object left on it is
+   * written. Count pages that held moved variables and now hold no other
+   * object and no relocation target.
+   */
+  vector<uint64_t> pages;
+  for (auto& m : moved)
+    for (auto p = m.first / page_size; p <= (m.second - 1) / page_size; p++)
+      pages.push_back(p);
+  sort(pages.begin(), pages.end());
+  pages.erase(unique(pages.begin(), pages.end()), pages.end());
+  auto is_moved = [&](uint64_t a, uint64_t e) {
+    return any_of(moved.begin(), moved.end(), [&](auto& m) {
+      return m.first <= a && e <= m.second;
+    });
+  };
+  for (auto p : pages) {
+    auto lo = p * page_size, hi = lo + page_size;
+    auto used = false;
+    for (auto& s : syms) {
+      auto a = s.sym.st_value, e = a + max<uint64_t>(s.sym.st_size, 1);
+      if (GELF_ST_TYPE(s.sym.st_info) == STT_OBJECT && a < hi && e > lo &&
+          data.inside(a) && !is_moved(a, e))
+        used = true;
+    }
+    for (auto relocs : {&data.relocs, &rela_other})
+      for (auto& rela : *relocs)
+        used |= rela.r_offset >= lo && rela.r_offset < hi;
+    r.pages_saved += !used;
+  }
+  return r;
+}
@@ -4,11 +4,15 @@
 #include <iostream>
 #include <regex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 using namespace std;
 
 #include <bintail/bintail.hpp>
 #include "mvelem.h"
+#include "info.h"
+#include "patch.h"
+#include "probe.h"
 #include "string.h"
 
 //------------------MVText-----------------------------------
@@ -38,23 +42,17 @@ size_t MVText::make_info(bool fpic, uint8_t* buf, Section* scn,
 //------------------MVassign-----------------------------------
 MVassign::MVassign(struct mv_info_assignment& _assign) : assign{_assign} {}
 
-size_t MVassign::make_info(bool fpic, uint8_t* buf, Section* sec,
-                           uint64_t vaddr) {
-  auto ass = reinterpret_cast<mv_info_assignment*>(buf);
-  ass->location = assign.location;
-  ass->lower_bound = assign.lower_bound;
-  ass->upper_bound = assign.upper_bound;
-  if (fpic) {
-    sec->add_rela(vaddr, ass->location);
-  }
-  return sizeof(mv_info_assignment);
+mv_info_assignment MVassign::info() { return assign; }
+
+void MVassign::link_var(MVVar* _var) {
+  var = _var;
+  var->add_range(assign.lower_bound, assign.upper_bound);
 }
-void MVassign::link_var(MVVar* _var) { var = _var; }
 
 bool MVassign::check_sym(const string& sym_match) {
   smatch m;
-  regex pat{var->name() + "_" + (var->value() ? "(1|true)" : "(0|false)") +
-            "(\\.|$)"};
+  regex pat{string(var->name()) + "_" +
+            (var->value() ? "(1|true)" : "(0|false)") + "(\\.|$)"};
   return regex_search(sym_match, m, pat);
 }
 
@@ -65,6 +63,10 @@ bool MVassign::is_active() {
   return val >= low && val <= high;
 }
 
+bool MVassign::can_hold(uint32_t lower, uint32_t upper) {
+  return assign.lower_bound <= upper && assign.upper_bound >= lower;
+}
+
 void MVassign::print() {
   cout << (is_active() ? ANSI_COLOR_GREEN : "") << "\t\t" << dec
        << assign.lower_bound << " <= " << var->name() << "(" << var->value()
@@ -79,8 +81,9 @@ static bool is_ret(const uint8_t* addr) {
   return addr[0] == 0xc3 || (addr[0] == 0xf3 && addr[1] == 0xc3);
 }
 
-MVmvfn::MVmvfn(struct mv_info_mvfn& _mvfn, MVDataSection* mvdata,
-               Section* text) {
+MVmvfn::MVmvfn(struct mv_info_mvfn& _mvfn, Model* model, MVDataSection* mvdata,
+               Section* text)
+    : model{model} {
   mvfn = _mvfn;
   auto op = reinterpret_cast<const uint8_t*>(text->in_buf(mvfn.function_body));
   // 31 c0: xor    %eax,%eax
@@ -101,49 +104,32 @@ MVmvfn::MVmvfn(struct mv_info_mvfn& _mvfn, MVDataSection* mvdata,
   }
   auto assign_infos = reinterpret_cast<const struct mv_info_assignment*>(
       mvdata->in_buf(mvfn.assignments));
-  for_each(assign_infos, assign_infos + mvfn.n_assignments, [&](auto ainfo) {
-    assigns.push_back(make_unique<MVassign>(ainfo));
-  });
+  assign_ids = {uint32_t(model->assigns.size()), mvfn.n_assignments};
+  for_each(assign_infos, assign_infos + mvfn.n_assignments,
+           [&](auto ainfo) { model->assigns.emplace_back(ainfo); });
 }
 
-/* make mvfn & mvassings */
-size_t MVmvfn::make_info(bool fpic, uint8_t* buf, Section* sec,
-                         uint64_t vaddr) {
-  auto mfn = reinterpret_cast<mv_info_mvfn*>(buf);
-
-  mfn->function_body = mvfn.function_body;
-  mfn->assignments = mvfn.assignments;  // set by set_info_assigns
-  mfn->n_assignments = assigns.size();
-  mfn->type = mvfn.type;
-  mfn->constant = mvfn.constant;
+Span<MVassign> MVmvfn::assigns() {
+  return {model->assigns.data() + assign_ids.first, assign_ids.count};
+}
 
-  if (fpic) {
-    sec->add_rela(vaddr + offsetof(struct mv_info_mvfn, function_body),
-                  mvfn.function_body);
-    sec->add_rela(vaddr + offsetof(struct mv_info_mvfn, assignments),
-                  mvfn.assignments);
-  }
-  return sizeof(mv_info_mvfn);
+/* make mvfn & mvassings */
+mv_info_mvfn MVmvfn::info() {
+  auto r = mvfn;  // assignments set by set_info_assigns
+  r.n_assignments = assign_ids.count;
+  return r;
 }
 
 void MVmvfn::set_info_assigns(uint64_t vaddr) { mvfn.assignments = vaddr; }
 
-size_t MVmvfn::make_info_ass(bool fpic, uint8_t* buf, Section* scn,
-                             uint64_t vaddr) {
-  auto esz = 0ul;
-  for (auto& a : assigns)
-    esz += a->make_info(fpic, buf + esz, scn, vaddr + esz);
-  return esz;
-}
-
 bool MVmvfn::active() {
-  return all_of(assigns.cbegin(), assigns.cend(),
-                [](auto& a) { return a->is_active(); });
+  auto a = assigns();
+  return all_of(a.begin(), a.end(), [](auto& a) { return a.is_active(); });
 }
 
 bool MVmvfn::assign_vars_frozen() {
-  return all_of(assigns.cbegin(), assigns.cend(),
-                [](auto& a) { return a->var->frozen; });
+  auto a = assigns();
+  return all_of(a.begin(), a.end(), [](auto& a) { return a.var->frozen; });
 }
 
 void MVmvfn::print(bool cur) {
@@ -161,58 +147,64 @@ void MVmvfn::print(bool cur) {
        << "mvfn@0x" << hex << mvfn.function_body << ":0x" << symbol.sym.st_size
        << " type=" << type << "  -  assignments[] @0x" << hex
        << mvfn.assignments << "\n" ANSI_COLOR_RESET;
-  for (auto& assign : assigns) assign->print();
-}
-
-void MVmvfn::check_var(MVVar* var, MVFn* fn) {
-  for (auto& assign : assigns) {
-    if (var->location() == assign->location()) {
-      assign->link_var(var);
-      var->link_fn(fn);
-    }
-  }
+  for (auto& assign : assigns()) assign.print();
 }
 
 void MVmvfn::probe_sym(struct symbol& sym, const string& sym_match) {
-  if (all_of(assigns.begin(), assigns.end(),
-             [&](auto& ass) { return ass->check_sym(sym_match); }))
+  auto a = assigns();
+  if (all_of(a.begin(), a.end(),
+             [&](auto& ass) { return ass.check_sym(sym_match); }))
     symbol = sym;
 }
 
 //---------------------MVFn----------------------------------------------------
-void MVFn::apply(Section* text, bool guard) {
+void MVFn::apply(Section* text, bool guard, vector<bintail::PatchSite>* sites) {
+  auto mvfns = variants();
   auto pfn = find_if(mvfns.begin(), mvfns.end(), [](auto& mfn) {
-    return mfn->assign_vars_frozen() && mfn->active();
+    return mfn.assign_vars_frozen() && mfn.active();
   });
   if (pfn == mvfns.end()) return;
+  chosen = pfn;
+  active = chosen->location();
+  guarded = dropped;
   if (guard) {
     for (auto& e : mvfns)
-      if (e.get() != pfn.base()->get())
-        text->fill(e->location(), 0xcc, e->size());
-    text->fill(location(), 0xcc, symbol.sym.st_size);  // overriden by pp
+      if (&e != chosen) guarded.emplace_back(e.location(), e.size());
+    guarded.emplace_back(location(), symbol.sym.st_size);  // overriden by pp
+    for (auto& g : guarded) text->fill(g.first, 0xcc, g.second);
   }
-  for (auto& p : pps) p->patchpoint_apply(&(pfn->get()->mvfn), text);
+  for (auto& p : patchpoints()) sites->push_back(p.patch(&chosen->mvfn));
   frozen = true;
+  BINTAIL_PROBE3(fn_applied, location(), active, patchpoints().size());
 }
 
-void MVFn::set_mvfn_vaddr(uint64_t vaddr) { mvfn_vaddr = vaddr; }
+size_t MVFn::constrain(MVVar* var, uint32_t lower, uint32_t upper,
+                       Section* text, bool guard) {
+  auto mvfns = variants();
+  auto kept = stable_partition(mvfns.begin(), mvfns.end(), [&](auto& m) {
+    auto as = m.assigns();
+    return all_of(as.begin(), as.end(), [&](auto& a) {
+      return a.var != var || a.can_hold(lower, upper);
+    });
+  });
+  size_t n = mvfns.end() - kept;
+  for (auto m = kept; guard && m != mvfns.end(); m++) {
+    dropped.emplace_back(m->location(), m->size());
+    guarded.emplace_back(m->location(), m->size());
+    text->fill(m->location(), 0xcc, m->size());
+  }
+  variant_ids.count -= n;
+  return n;
+}
 
-size_t MVFn::make_info(bool fpic, uint8_t* buf, Section* sec, uint64_t vaddr) {
-  auto f = reinterpret_cast<mv_info_fn*>(buf);
-  f->name = fn.name;
-  f->function_body = fn.function_body;
-  f->n_mv_functions = mvfns.size();
-  f->mv_functions = mvfn_vaddr;
-  f->patchpoints_head = nullptr;
+void MVFn::set_mvfn_vaddr(uint64_t vaddr) { mvfn_vaddr = vaddr; }
 
-  if (fpic) {
-    sec->add_rela(vaddr + offsetof(struct mv_info_fn, name), fn.name);
-    sec->add_rela(vaddr + offsetof(struct mv_info_fn, function_body),
-                  fn.function_body);
-    sec->add_rela(vaddr + offsetof(struct mv_info_fn, mv_functions),
-                  mvfn_vaddr);
-  }
-  return sizeof(mv_info_fn);
+mv_info_fn MVFn::info() {
+  auto r = fn;
+  r.n_mv_functions = variant_ids.count;
+  r.mv_functions = mvfn_vaddr;
+  r.patchpoints_head = nullptr;
+  return r;
 }
 
 size_t MVFn::make_mvdata(bool fpic, uint8_t* buf, MVDataSection* mvdata,
@@ -220,66 +212,80 @@ size_t MVFn::make_mvdata(bool fpic, uint8_t* buf, MVDataSection* mvdata,
   /*        v-esz                                           v-asz
    * mvfn[3] assigns_mvfn0[] assigns_mvfn1[] assigns_mvfn2[]
    */
-  auto esz = 0ul;
-  auto asz = sizeof(mv_info_mvfn) * mvfns.size();
-  for (auto& m : mvfns) {
-    m->set_info_assigns(vaddr + asz);
-    esz += m->make_info(fpic, buf + esz, mvdata, vaddr + esz);
-    asz += m->make_info_ass(fpic, buf + asz, mvdata, vaddr + asz);
+  auto mvfns = reinterpret_cast<mv_info_mvfn*>(buf);
+  auto asz = sizeof(mv_info_mvfn) * variant_ids.count;
+  auto n = 0ul;
+  for (auto& m : variants()) {
+    m.set_info_assigns(vaddr + asz);
+    mvfns[n++] = m.info();
+    auto assigns = reinterpret_cast<mv_info_assignment*>(buf + asz);
+    auto k = 0ul;
+    for (auto& a : m.assigns()) assigns[k++] = a.info();
+    if (fpic)
+      bintail::AssignRecords::relocate(assigns, k, vaddr + asz,
+                                       &mvdata->relocs);
+    asz += k * sizeof(mv_info_assignment);
   }
+  if (fpic) bintail::MvfnRecords::relocate(mvfns, n, vaddr, &mvdata->relocs);
   return asz;
 }
 
-void MVFn::add_pp(MVPP* pp) { pps.push_back(pp); }
-
-MVFn::MVFn(struct mv_info_fn& _fn, MVDataSection* mvdata, Section* text,
-           Section* rodata)
-    : frozen{false} {
+MVFn::MVFn(struct mv_info_fn& _fn, Model* model, MVDataSection* mvdata,
+           Section* text, Section* rodata)
+    : frozen{false}, active{0}, model{model} {
   fn = _fn;
-  name = rodata->get_string(fn.name);
+  _name = rodata->get_string(fn.name);
 
   if (fn.n_mv_functions == 0) return;
 
   auto mvfn_array = reinterpret_cast<const struct mv_info_mvfn*>(
       mvdata->in_buf(fn.mv_functions));
+  variant_ids = {uint32_t(model->variants.size()), fn.n_mv_functions};
   for_each(mvfn_array, mvfn_array + fn.n_mv_functions, [&](auto minfo) {
-    mvfns.push_back(make_unique<MVmvfn>(minfo, mvdata, text));
+    model->variants.emplace_back(minfo, model, mvdata, text);
   });
 }
 
-void MVFn::probe_var(MVVar* var) {
-  for (auto& mvfn : mvfns) mvfn->check_var(var, this);
+Span<MVmvfn> MVFn::variants() {
+  return {model->variants.data() + variant_ids.first, variant_ids.count};
+}
+
+IdList<MVPP> MVFn::patchpoints() {
+  return {model->pps.data(), model->fn_pps, pp_ids};
 }
 
 void MVFn::probe_sym(struct symbol& sym) {
-  smatch m;
-  regex pat{"^" + name + "(\\.multiverse\\.(.+))?$"};
-  if (regex_search(sym.name, m, pat)) {
+  /* Cheap prefix test before building the regex */
+  if (sym.name.substr(0, _name.size()) != _name) return;
+  match_results<string_view::const_iterator> m;
+  regex pat{"^" + string(_name) + "(\\.multiverse\\.(.+))?$"};
+  if (regex_search(sym.name.begin(), sym.name.end(), m, pat)) {
     if (m[2].matched)  // probe mvfn with part after multiverse
-      for (auto& mvfn : mvfns) mvfn->probe_sym(sym, m[2].str());
+      for (auto& mvfn : variants()) mvfn.probe_sym(sym, m[2].str());
     else
       symbol = sym;
   }
 }
 
 void MVFn::print() {
-  cout << (active == fn.function_body ? " -> " : "    ") << name << "@0x" << hex
-       << fn.function_body << ":0x" << symbol.sym.st_size << "  -  mvfn[] @0x"
-       << fn.mv_functions << "\n";
+  cout << (active == fn.function_body ? " -> " : "    ") << _name << "@0x"
+       << hex << fn.function_body << ":0x" << symbol.sym.st_size
+       << "  -  mvfn[] @0x" << fn.mv_functions << "\n";
 
-  for (auto& mvfn : mvfns) {
-    auto mact = active == mvfn->location();
-    mvfn->print(mact);
+  for (auto& mvfn : variants()) {
+    auto mact = active == mvfn.location();
+    mvfn.print(mact);
   }
 
   cout << "\tpatchpoints:\n";
-  for (auto& pp : pps) pp->print();
+  for (auto& pp : patchpoints()) pp.print();
   cout << "\n";
 }
 
 //---------------------MVVar---------------------------------------------------
-MVVar::MVVar(struct mv_info_var _var, Section* rodata, Section* data)
-    : frozen{false}, var{_var} {
+MVVar::MVVar(struct mv_info_var _var, Model* model, Section* rodata,
+             Section* data)
+    : frozen{false}, var{_var}, model{model} {
   _name = rodata->get_string(var.name);
   in_data = (data->inside(var.variable_location));
 
@@ -317,40 +323,108 @@ void MVVar::print() {
        << (var.flag_tracked ? "tracked " : "")
        << (var.flag_signed ? "signed " : "") << (var.flag_bound ? "bound " : "")
        << "]\n";
-  for (auto& fn : fns) fn->print();
+  for (auto& fn : functions()) fn.print();
 }
 
-size_t MVVar::make_info(bool fpic, uint8_t* buf, Section* sec, uint64_t vaddr) {
-  auto v = reinterpret_cast<struct mv_info_var*>(buf);
-  v->name = var.name;
-  v->variable_location = var.variable_location;
-  v->info = var.info;
-  v->functions_head = nullptr;
+mv_info_var MVVar::info() {
+  auto r = var;
+  r.functions_head = nullptr;
+  return r;
+}
 
-  if (fpic) {
-    sec->add_rela(vaddr + offsetof(struct mv_info_var, name), var.name);
-    sec->add_rela(vaddr + offsetof(struct mv_info_var, variable_location),
-                  var.variable_location);
-  }
-  return sizeof(struct mv_info_var);
+IdList<MVFn> MVVar::functions() {
+  return {model->fns.data(), model->var_fns, fn_ids};
 }
 
-void MVVar::link_fn(MVFn* fn) { fns.insert(fn); }
+void MVVar::add_range(uint32_t lower, uint32_t upper) {
+  ranges.emplace_back(lower, upper);
+}
 
-void MVVar::set_value(int v, Section* data) {
+vector<int64_t> MVVar::values() {
+  if (ranges.empty()) return {_value};
+
+  vector<int64_t> cuts;
+  for (auto& r : ranges) {
+    cuts.push_back(r.first);
+    cuts.push_back(int64_t{r.second} + 1);
+  }
+  sort(cuts.begin(), cuts.end());
+  cuts.erase(unique(cuts.begin(), cuts.end()), cuts.end());
+
+  vector<int64_t> v;
+  for (auto c : cuts)
+    if (any_of(ranges.cbegin(), ranges.cend(),
+               [c](auto& r) { return c >= r.first && c <= r.second; }))
+      v.push_back(c);
+  return v;
+}
+
+vector<pair<uint32_t, uint32_t>> MVVar::segments() {
+  vector<uint64_t> cuts{lower};
+  for (auto& r : ranges) {
+    cuts.push_back(r.first);
+    cuts.push_back(uint64_t{r.second} + 1);
+  }
+  sort(cuts.begin(), cuts.end());
+  cuts.erase(unique(cuts.begin(), cuts.end()), cuts.end());
+  cuts.erase(remove_if(cuts.begin(), cuts.end(),
+                       [&](auto c) { return c < lower || c > upper; }),
+             cuts.end());
+
+  vector<pair<uint32_t, uint32_t>> s;
+  for (auto i = 0ul; i < cuts.size(); i++)
+    s.emplace_back(cuts[i], i + 1 < cuts.size() ? cuts[i + 1] - 1 : upper);
+  return s;
+}
+
+size_t MVVar::constrain(uint32_t lo, uint32_t hi, Section* text, bool guard) {
+  lower = max(lower, lo);
+  upper = min(upper, hi);
+  if (lower > upper)
+    throw std::runtime_error("Empty range for " + string(_name));
+
+  /* Values outside the range select no variant any more */
+  vector<pair<uint32_t, uint32_t>> clipped;
+  for (auto& r : ranges)
+    if (r.first <= upper && r.second >= lower)
+      clipped.emplace_back(max(r.first, lower), min(r.second, upper));
+  ranges = clipped;
+
+  size_t n = 0;
+  for (auto& f : functions())
+    if (!f.is_fixed()) n += f.constrain(this, lower, upper, text, guard);
+  return n;
+}
+
+void MVVar::set_value(int64_t v, Section* data) {
   _value = v;
   if (in_data) {
-    assert(var.variable_width == 4);
-    auto b = reinterpret_cast<int32_t*>(data->out_buf(var.variable_location));
-    b[0] = v;
+    auto b = data->out_buf(var.variable_location);
+    switch (var.variable_width) {
+      case 1:
+        *reinterpret_cast<uint8_t*>(b) = v;
+        break;
+      case 2:
+        *reinterpret_cast<uint16_t*>(b) = v;
+        break;
+      case 4:
+        *reinterpret_cast<uint32_t*>(b) = v;
+        break;
+      case 8:
+        *reinterpret_cast<uint64_t*>(b) = v;
+        break;
+      default:
+        throw std::runtime_error("Unexpected variable_width.\n");
+    }
   }
 }
 
 uint64_t MVVar::location() { return var.variable_location; }
 
-void MVVar::apply(Section* text, bool guard) {
+void MVVar::apply(Section* text, bool guard,
+                  vector<bintail::PatchSite>* sites) {
   frozen = true;
-  for (auto& f : fns) f->apply(text, guard);
+  for (auto& f : functions()) f.apply(text, guard, sites);
 }
 
 //---------------------MVPP---------------------------------------------------
@@ -368,23 +442,18 @@ MVPP::MVPP(MVFn* fn) : _fn{fn} {
   function_body = 0;
 }
 
+MVPP::MVPP(MVFn* fn, uint64_t location, mv_info_patchpoint_type type)
+    : function_body{fn->location()}, _fn{fn}, discovered{true}, fptr{false} {
+  pp.location = location;
+  pp.type = type;
+}
+
 MVPP::MVPP(struct mv_info_callsite& cs, Section* text) {
   function_body = cs.function_body;
   decode_callsite(cs, text);
 }
 
-size_t MVPP::make_info(bool fpic, uint8_t* buf, Section* sec, uint64_t vaddr) {
-  auto cs = reinterpret_cast<mv_info_callsite*>(buf);
-  cs->function_body = function_body;
-  cs->call_label = pp.location;
-  if (fpic) {
-    sec->add_rela(vaddr + offsetof(struct mv_info_callsite, function_body),
-                  function_body);
-    sec->add_rela(vaddr + offsetof(struct mv_info_callsite, call_label),
-                  pp.location);
-  }
-  return sizeof(mv_info_callsite);
-}
+mv_info_callsite MVPP::info() { return {function_body, pp.location}; }
 
 void MVPP::set_fn(MVFn* fn) { _fn = fn; }
 
@@ -398,7 +467,8 @@ void MVPP::print() {
                       ? "indirect call(x86)"
                       : pp.type == PP_TYPE_X86_JUMP ? "jump(x86)" : "nope";
   cout << "\t\t@0x" << hex << pp.location << " Type:" << type
-       << (fptr ? " <- fptr" : "") << "\n";
+       << (fptr ? " <- fptr" : "") << (discovered ? " (discovered)" : "")
+       << "\n";
 }
 
 uint64_t MVPP::decode_callsite(struct mv_info_callsite& cs, Section* text) {
@@ -416,57 +486,72 @@ uint64_t MVPP::decode_callsite(struct mv_info_callsite& cs, Section* text) {
   return callee;
 }
 
-void MVPP::patchpoint_apply(struct mv_info_mvfn* mvfn, Section* text) {
-  auto op = reinterpret_cast<unsigned char*>(text->out_buf(pp.location));
-  uint32_t offset;
-  switch (pp.type) {
-    case PP_TYPE_X86_JUMP:
-      op[0] = 0xe9;  // jmp
-      offset = (uintptr_t)mvfn->function_body - ((uintptr_t)pp.location + 5);
-      *((uint32_t*)&op[1]) = offset;
-      break;
-    case PP_TYPE_X86_CALL:
-    case PP_TYPE_X86_CALL_INDIRECT:
-      // Oh, look. It has a very simple body!
-      if (mvfn->type == MVFN_TYPE_NOP) {
-        if (pp.type == PP_TYPE_X86_CALL_INDIRECT) {
-          memcpy(op, "\x66\x0F\x1F\x44\x00\x00", 6);  // 6 byte NOP
-        } else {
-          memcpy(op, "\x0F\x1F\x44\x00\x00", 5);  // 5 byte NOP
-        }
-      } else if (mvfn->type == MVFN_TYPE_CONSTANT) {
-        op[0] = 0xb8;  // mov $..., eax
-        *(uint32_t*)(op + 1) = mvfn->constant;
-        if (pp.type == PP_TYPE_X86_CALL_INDIRECT)
-          op[5] = '\x90';  // insert trailing NOP
-      } else if (mvfn->type == MVFN_TYPE_CLI || mvfn->type == MVFN_TYPE_STI) {
-        if (mvfn->type == MVFN_TYPE_CLI) {
-          op[0] = '\xfa';  // CLI
-        } else {
-          op[0] = '\xfb';  // STI
-        }
-        if (pp.type == PP_TYPE_X86_CALL_INDIRECT) {
-          memcpy(&op[1], "\x0F\x1F\x44\x00\x00", 5);  // 5 byte NOP
-        } else {
-          memcpy(&op[1], "\x0F\x1F\x40\x00", 4);  // 4 byte NOP
-        }
-      } else {
-        offset = (uintptr_t)mvfn->function_body - ((uintptr_t)pp.location + 5);
-        op[0] = 0xe8;  // call
-        *((uint32_t*)&op[1]) = offset;
-        if (pp.type == PP_TYPE_X86_CALL_INDIRECT)
-          op[5] = '\x90';  // insert trailing NOP
-      }
-      break;
-    default:
-      throw std::runtime_error("Could not apply patchpoint.");
-  }
-  auto d = elf_getdata(text->scn_out, nullptr);  // Implizit diry_buf ?
-  elf_flagdata(d, ELF_C_SET, ELF_F_DIRTY);
+bintail::PatchSite MVPP::patch(const struct mv_info_mvfn* mvfn) {
+  auto t = bintail::patch_template(pp.type, mvfn->type);
+  if (t == nullptr) throw std::runtime_error("Could not apply patchpoint.");
+  return {pp.location, t, mvfn->function_body, mvfn->constant};
 }
 
+size_t MVPP::size() { return location_len(pp.type); }
+
 void MVPP::patchpoint_size(void** from, void** to) {
   char* loc = (char*)(pp.location);
   *from = loc;
   *to = loc + location_len(pp.type);
 }
+
+//---------------------Model---------------------------------------------------
+/* Group the second IDs of (owner, id) pairs by owner into ids */
+static vector<IdRange> group(vector<pair<uint32_t, uint32_t>>& edges,
+                             size_t owners, vector<uint32_t>* ids) {
+  sort(edges.begin(), edges.end());
+  edges.erase(unique(edges.begin(), edges.end()), edges.end());
+
+  vector<IdRange> ranges(owners);
+  ids->clear();
+  ids->reserve(edges.size());
+  for (auto& e : edges) {
+    auto& r = ranges[e.first];
+    if (r.count++ == 0) r.first = ids->size();
+    ids->push_back(e.second);
+  }
+  return ranges;
+}
+
+void Model::link() {
+  unordered_map<uint64_t, uint32_t> var_at;
+  for (auto i = 0u; i < vars.size(); i++) var_at.emplace(vars[i].location(), i);
+
+  /* multiverse_init equivalent: assignment -> var, var -> fns */
+  vector<pair<uint32_t, uint32_t>> edges;
+  for (auto i = 0u; i < fns.size(); i++)
+    for (auto& mvfn : fns[i].variants())
+      for (auto& assign : mvfn.assigns()) {
+        auto it = var_at.find(assign.location());
+        if (it == var_at.end()) continue;
+        assign.link_var(&vars[it->second]);
+        edges.emplace_back(it->second, i);
+      }
+  auto fn_ranges = group(edges, vars.size(), &var_fns);
+  for (auto i = 0u; i < vars.size(); i++) vars[i].fn_ids = fn_ranges[i];
+
+  link_pps();
+}
+
+/* Patchpoints of a fn: its own jump and the callsites calling it */
+void Model::link_pps() {
+  unordered_map<uint64_t, uint32_t> fn_at;
+  for (auto i = 0u; i < fns.size(); i++) fn_at.emplace(fns[i].location(), i);
+
+  vector<pair<uint32_t, uint32_t>> edges;
+  for (auto i = 0u; i < pps.size(); i++) {
+    if (pps[i]._fn == nullptr) {
+      auto it = fn_at.find(pps[i].function_body);
+      if (it == fn_at.end()) continue;
+      pps[i].set_fn(&fns[it->second]);
+    }
+    edges.emplace_back(pps[i]._fn - fns.data(), i);
+  }
+  auto pp_ranges = group(edges, fns.size(), &fn_pps);
+  for (auto i = 0u; i < fns.size(); i++) fns[i].pp_ids = pp_ranges[i];
+}
@@ -2,8 +2,9 @@
 #define __MVELEM_H
 
 #include <cstddef>
-#include <memory>
-#include <set>
+#include <cstdint>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 #include <bintail/bintail.hpp>
@@ -12,6 +13,64 @@ class MVFn;
 class MVVar;
 class MVPP;
 
+namespace bintail {
+struct PatchSite;
+}  // namespace bintail
+
+/* IDs [first, first + count) into one array of the Model */
+struct IdRange {
+  uint32_t first = 0;
+  uint32_t count = 0;
+};
+
+/* Contiguous elements of a Model array */
+template <class T>
+class Span {
+ public:
+  Span(T* begin, size_t size) : b{begin}, e{begin + size} {}
+  T* begin() const { return b; }
+  T* end() const { return e; }
+  size_t size() const { return e - b; }
+  T& operator[](size_t i) const { return b[i]; }
+
+ private:
+  T* b;
+  T* e;
+};
+
+/* Elements of a Model array selected by a range of a grouped ID array */
+template <class T>
+class IdList {
+ public:
+  class iterator {
+   public:
+    iterator(T* base, const uint32_t* id) : base{base}, id{id} {}
+    T& operator*() const { return base[*id]; }
+    iterator& operator++() {
+      ++id;
+      return *this;
+    }
+    bool operator!=(const iterator& o) const { return id != o.id; }
+
+   private:
+    T* base;
+    const uint32_t* id;
+  };
+
+  IdList(T* base, const std::vector<uint32_t>& ids, IdRange r)
+      : base{base},
+        b{ids.data() + r.first},
+        e{ids.data() + r.first + r.count} {}
+  iterator begin() const { return {base, b}; }
+  iterator end() const { return {base, e}; }
+  size_t size() const { return e - b; }
+
+ private:
+  T* base;
+  const uint32_t* b;
+  const uint32_t* e;
+};
+
 class MVData {
  public:
   virtual size_t make_info(bool fpic, uint8_t* buf, Section* scn,
@@ -37,16 +96,19 @@ struct mv_info_assignment {
   uint32_t upper_bound;
 };
 
-class MVassign : public MVData {
+class MVassign {
  public:
   MVassign(struct mv_info_assignment& _assign);
-  size_t make_info(bool fpic, uint8_t* buf, Section* scn, uint64_t vaddr);
+  struct mv_info_assignment info();
   bool is_active();
+  bool can_hold(uint32_t lower, uint32_t upper);  // some value in both
   bool check_sym(const std::string& sym_match);
   void link_var(MVVar* _var);
   void print();
 
   constexpr uint64_t location() { return assign.location; }
+  constexpr uint32_t lower() { return assign.lower_bound; }
+  constexpr uint32_t upper() { return assign.upper_bound; }
   MVVar* var;
 
  private:
@@ -72,13 +134,12 @@ struct mv_info_mvfn {
   uint32_t constant;
 };
 
-class MVmvfn : public MVData {
+class MVmvfn {
  public:
-  MVmvfn(struct mv_info_mvfn& _mvfn, MVDataSection* data, Section* text);
-  size_t make_info(bool fpic, uint8_t* buf, Section* scn, uint64_t vaddr);
-  size_t make_info_ass(bool fpic, uint8_t* buf, Section* scn, uint64_t vaddr);
+  MVmvfn(struct mv_info_mvfn& _mvfn, Model* model, MVDataSection* data,
+         Section* text);
+  struct mv_info_mvfn info();
   void set_info_assigns(uint64_t vaddr);
-  void check_var(MVVar* var, MVFn* fn);
   void probe_sym(struct symbol& sym, const std::string& sym_match);
   void print(bool active);
   bool active();
@@ -92,11 +153,13 @@ class MVmvfn : public MVData {
 
   constexpr uint64_t location() { return mvfn.function_body; }
   constexpr size_t size() { return symbol.sym.st_size; }
+  Span<MVassign> assigns();
   struct mv_info_mvfn mvfn;
+  IdRange assign_ids;
 
  private:
-  std::vector<std::unique_ptr<MVassign>> assigns;
-  struct symbol symbol;
+  Model* model;
+  struct symbol symbol = {};
 };
 
 //-----------------------------------------------------------------------------
@@ -112,33 +175,48 @@ struct mv_info_fn {
   struct mv_info_mvfn* active_mvfn;        // The currently active mvfn
 };
 
-class MVFn : public MVData {
+class MVFn {
  public:
-  MVFn(struct mv_info_fn& _fn, MVDataSection* data, Section* text,
-       Section* rodata);
-  size_t make_info(bool fpic, uint8_t* buf, Section* scn, uint64_t vaddr);
+  MVFn(struct mv_info_fn& _fn, Model* model, MVDataSection* data,
+       Section* text, Section* rodata);
+  struct mv_info_fn info();
   void print();
-  void probe_var(MVVar* var);
   void probe_sym(struct symbol& sym);
-  void add_pp(MVPP* pp);
-  void apply(Section* text, bool guard);
+  void apply(Section* text, bool guard,
+             std::vector<bintail::PatchSite>* sites);
+  /* Remove the variants that var in [lower, upper] never selects */
+  size_t constrain(MVVar* var, uint32_t lower, uint32_t upper, Section* text,
+                   bool guard);
   size_t make_mvdata(bool fpic, uint8_t* buf, MVDataSection* mvdata,
                      uint64_t vaddr);
   void set_mvfn_vaddr(uint64_t vaddr);
 
   constexpr bool is_fixed() { return frozen; }
   constexpr uint64_t location() { return fn.function_body; }
+  constexpr size_t size() { return symbol.sym.st_size; }
+  std::string_view name() { return _name; }
+  Span<MVmvfn> variants();
+  IdList<MVPP> patchpoints();
+  const struct mv_info_mvfn* active_mvfn() {
+    return chosen != nullptr ? &chosen->mvfn : nullptr;
+  }
 
   struct mv_info_fn fn;
   bool frozen;
   uint64_t active;
   uint64_t mvfn_vaddr;
+  IdRange variant_ids;  // Model::variants
+  IdRange pp_ids;       // Model::fn_pps
+
+  /* [addr, addr + len) filled with int3 by apply and constrain */
+  std::vector<std::pair<uint64_t, size_t>> guarded;
 
  private:
-  std::vector<std::unique_ptr<MVmvfn>> mvfns;
-  std::vector<MVPP*> pps;
-  std::string name;
-  struct symbol symbol;
+  Model* model;
+  MVmvfn* chosen = nullptr;
+  std::vector<std::pair<uint64_t, size_t>> dropped;  // guarded by constrain
+  std::string_view _name;  // into .rodata
+  struct symbol symbol = {};
 };
 
 //-----------------------------------------------------------------------------
@@ -166,27 +244,46 @@ struct mv_info_var {
   struct mv_info_fn_ref* functions_head;  // Functions referening this variable
 };
 
-class MVVar : public MVData {
+/* Bit in mv_info_var.reserved: functions_head and the patchpoints_head of
+ * these functions are linked in the file */
+constexpr unsigned int MV_VAR_PRELINKED = 0x1;
+
+class MVVar {
  public:
-  MVVar(struct mv_info_var _var, Section* rodata, Section* data);
-  size_t make_info(bool fpic, uint8_t* buf, Section* scn, uint64_t vaddr);
+  MVVar(struct mv_info_var _var, Model* model, Section* rodata, Section* data);
+  struct mv_info_var info();
   void print();
-  void link_fn(MVFn* fn);
-  void set_value(int v, Section* data);
-  void apply(Section* text, bool guard);
+  void add_range(uint32_t lower, uint32_t upper);
+  /* Restrict the variable to [lower, upper], see Bintail::constrain */
+  size_t constrain(uint32_t lower, uint32_t upper, Section* text, bool guard);
+  void set_value(int64_t v, Section* data);
+  void apply(Section* text, bool guard,
+             std::vector<bintail::PatchSite>* sites);
   uint64_t location();
 
-  std::string& name() { return _name; }
+  /* One representative value per interval that the assignments of the
+   * linked mvfns tell apart. Without assignments the current value. */
+  std::vector<int64_t> values();
+
+  /* [lower, upper] ranges partitioning the u32 values at the assignment
+   * bounds, one range if there are none. Within the constraint. */
+  std::vector<std::pair<uint32_t, uint32_t>> segments();
+
+  std::string_view name() { return _name; }
   int64_t value() { return _value; }
+  IdList<MVFn> functions();
 
   bool frozen;
   struct mv_info_var var;
   bool in_data;
   int64_t _value;
+  IdRange fn_ids;  // Model::var_fns
 
  private:
-  std::set<MVFn*> fns;
-  std::string _name;
+  Model* model;
+  std::vector<std::pair<uint32_t, uint32_t>> ranges;
+  uint32_t lower = 0, upper = UINT32_MAX;  // constrain
+  std::string_view _name;  // into .rodata
 };
 
 //-----------------------------------------------------------------------------
@@ -210,23 +307,26 @@ struct mv_patchpoint {
   unsigned char swapspace[6];  // Here we swap in the code, we overwrite
 };
 
-class MVPP : public MVData {
+class MVPP {
  public:
   MVPP(MVFn* fn);
   MVPP(struct mv_info_callsite& cs, Section* text);
+  MVPP(MVFn* fn, uint64_t location, mv_info_patchpoint_type type);
   void print();
   void set_fn(MVFn* fn);
-  size_t make_info(bool fpic, uint8_t* buf, Section* scn, uint64_t vaddr);
+  struct mv_info_callsite info();
   uint64_t decode_callsite(struct mv_info_callsite& cs,
                            Section* text);  // ret callee
-  void patchpoint_apply(struct mv_info_mvfn* mvfn, Section* text);
+  bintail::PatchSite patch(const struct mv_info_mvfn* mvfn);
   void patchpoint_size(void** from, void** to);
+  size_t size();  // bytes patched at pp.location
 
   struct mv_patchpoint pp;
   uint64_t function_body;
-  MVFn* _fn;
+  MVFn* _fn = nullptr;
+  bool discovered = false;  // found by scanning .text, not in the input info
 
  private:
-  bool fptr;
+  bool fptr = false;
 };
 #endif
@@ -5,12 +5,15 @@
 #include <exception>
 #include <iomanip>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <set>
 #include <string>
 
 #include <bintail/bintail.hpp>
+#include "info.h"
 #include "mvelem.h"
+#include "probe.h"
 
 using namespace std;
 
@@ -70,7 +73,8 @@ void InfoArea::find_start_of_area() {
  * InfoAREA:
  * [ ... | mvdata | mvfn | mvvar | mvcs | .bss ]
  */
-uint64_t InfoArea::generate(Section *data) {
+uint64_t InfoArea::generate(Section *data, Section *text) {
+  BINTAIL_PROBE(generate_start);
   auto area_pos = 0ul;
 
   area_pos += mvdata->generate(fpic, area_offset_start + area_pos,
@@ -82,6 +86,10 @@ uint64_t InfoArea::generate(Section *data) {
   area_pos += mvcs->generate(fpic, area_offset_start + area_pos,
                              area_vaddr_start + area_pos, data);
 
+  if (prelink)
+    area_pos +=
+        mvcs->prelink(fpic, size_in_file() - area_pos, mvfn, mvvar, text);
+
   /* Shift and expand .bss in mem, move to end in file */
   auto shift = bss->generate(area_offset_start + area_pos,
                              area_vaddr_start + area_pos, area_vaddr_end);
@@ -90,6 +98,7 @@ uint64_t InfoArea::generate(Section *data) {
   phdr.p_filesz -= shift;
   gelf_update_phdr(e_out, ndx, &phdr);
 
+  BINTAIL_PROBE2(generate_done, area_pos, shift);
   return shift;
 }
 
@@ -99,233 +108,249 @@ bool MVSection::probe_rela(GElf_Rela *rela) {
   return Section::probe_rela(rela);
 }
 
-//-----------------MVFnSection-------------------------------
-std::unique_ptr<std::vector<struct mv_info_fn>> MVFnSection::read() {
-  auto v = std::make_unique<std::vector<struct mv_info_fn>>();
-  if (scn_in == nullptr)  // Section does not exist
-    return v;
-  auto d = elf_getdata(scn_in, nullptr);
-  if (d == nullptr)  // Section has no data
-    return v;
-
-  GElf_Shdr shdr;
-  gelf_getshdr(scn_in, &shdr);
-
-  auto buf = static_cast<const uint8_t *>(d->d_buf);
-  for (auto i = 0; i * sizeof(struct mv_info_fn) < shdr.sh_size; i++) {
-    auto e = *((struct mv_info_fn *)buf + i);
-    v->push_back(e);
-  }
-  return v;
+uint8_t *MVSection::begin_records() {
+  relocs.clear();
+  return scn_out == nullptr ? nullptr : static_cast<uint8_t *>(out()->d_buf);
 }
 
-uint64_t MVFnSection::generate(bool fpic, uint64_t offset, uint64_t vaddr,
-                               Section *data) {
-  relocs.clear();
-  auto ndx = 0;
-  /* no data -> section not needed */
-  if (scn_out != nullptr) {
-    /* data */
-    auto data = elf_getdata(scn_out, nullptr);
-    auto buf = static_cast<uint8_t *>(data->d_buf);
-
-    for (auto &e : *fns) {
-      if (e->is_fixed()) continue;
-      ndx += e->make_info(fpic, buf + ndx, this, vaddr + ndx);
-    }
-    data->d_size = ndx;
-    elf_flagdata(data, ELF_C_SET, ELF_F_DIRTY);
+uint64_t MVSection::end_records(bool fpic, uint64_t offset, uint64_t vaddr,
+                                size_t size, Section *data) {
+  if (scn_out != nullptr) {  // no data -> section not needed
+    out()->d_size = size;
+    dirty = true;
 
     /* shdr */
-    GElf_Shdr shdr;
-    gelf_getshdr(scn_in, &shdr);
+    auto shdr = shdr_in;
 
     shdr.sh_offset = offset;
     shdr.sh_addr = vaddr;
-    shdr.sh_size = ndx;
+    shdr.sh_size = size;
 
     gelf_update_shdr(scn_out, &shdr);
     elf_flagshdr(scn_out, ELF_C_SET, ELF_F_DIRTY);
+    addr_out = vaddr;
   }
 
   /* start/stop_ptr for libmultiverse */
-  data->write_ptr(fpic, start_ptr, vaddr);
-  data->write_ptr(fpic, stop_ptr, vaddr + ndx);
-  return ndx;
+  if (data != nullptr) {
+    data->write_ptr(fpic, start_ptr, vaddr);
+    data->write_ptr(fpic, stop_ptr, vaddr + size);
+  }
+  sz = size;
+  return size;
 }
 
-bool MVFnSection::is_needed(bool overr) { return overr; }
+//-----------------MVFnSection-------------------------------
+std::unique_ptr<std::vector<struct mv_info_fn>> MVFnSection::read() {
+  return bintail::FnRecords::read(in_buf(), max_sz());
+}
 
-void MVFnSection::set_fns(std::vector<std::unique_ptr<MVFn>> *_fns) {
-  fns = _fns;
+uint64_t MVFnSection::generate(bool fpic, uint64_t offset, uint64_t vaddr,
+                               Section *data) {
+  auto out = reinterpret_cast<mv_info_fn *>(begin_records());
+  auto n = 0ul;
+  if (out != nullptr) {
+    for (auto &e : model->fns)
+      if (!e.is_fixed()) out[n++] = e.info();
+    if (fpic) bintail::FnRecords::relocate(out, n, vaddr, &relocs);
+  }
+  return end_records(fpic, offset, vaddr, n * sizeof(*out), data);
 }
 
-//-----------------MVVarSection-------------------------------
-std::unique_ptr<std::vector<struct mv_info_var>> MVVarSection::read() {
-  auto v = std::make_unique<std::vector<struct mv_info_var>>();
-  if (scn_in == nullptr)  // Section does not exist
-    return v;
-  auto d = elf_getdata(scn_in, nullptr);
-  if (d == nullptr)  // Section has no data
-    return v;
+bool MVFnSection::is_needed(bool overr) { return overr; }
 
-  GElf_Shdr shdr;
-  gelf_getshdr(scn_in, &shdr);
+void MVFnSection::set_model(Model *_model) { model = _model; }
 
-  // ToDo(Felix): stupid casting???
-  auto buf = static_cast<const uint8_t *>(d->d_buf);
-  for (auto i = 0; i * sizeof(struct mv_info_var) < shdr.sh_size; i++) {
-    auto e = *((struct mv_info_var *)buf + i);
-    v->push_back(e);
-  }
-  return v;
+//-----------------MVVarSection-------------------------------
+std::unique_ptr<std::vector<struct mv_info_var>> MVVarSection::read() {
+  return bintail::VarRecords::read(in_buf(), max_sz());
 }
 
 uint64_t MVVarSection::generate(bool fpic, uint64_t offset, uint64_t vaddr,
                                 Section *data) {
-  relocs.clear();
-  auto ndx = 0;
-
-  if (scn_out != nullptr) {  // no data -> section not needed
-    /* data */
-    auto data = elf_getdata(scn_out, nullptr);
-    auto buf = static_cast<uint8_t *>(data->d_buf);
-
-    for (auto &e : *vars) {
-      if (e->frozen) continue;
-      ndx += e->make_info(fpic, buf + ndx, this, vaddr + ndx);
-    }
-    data->d_size = ndx;
-    elf_flagdata(data, ELF_C_SET, ELF_F_DIRTY);
-
-    /* shdr */
-    GElf_Shdr shdr;
-    gelf_getshdr(scn_in, &shdr);
-
-    shdr.sh_offset = offset;
-    shdr.sh_addr = vaddr;
-    shdr.sh_size = ndx;
-
-    gelf_update_shdr(scn_out, &shdr);
-    elf_flagshdr(scn_out, ELF_C_SET, ELF_F_DIRTY);
+  auto out = reinterpret_cast<mv_info_var *>(begin_records());
+  auto n = 0ul;
+  if (out != nullptr) {
+    for (auto &e : model->vars)
+      if (!e.frozen) out[n++] = e.info();
+    if (fpic) bintail::VarRecords::relocate(out, n, vaddr, &relocs);
   }
-
-  /* start/stop_ptr for libmultiverse */
-  data->write_ptr(fpic, start_ptr, vaddr);
-  data->write_ptr(fpic, stop_ptr, vaddr + ndx);
-  return ndx;
+  return end_records(fpic, offset, vaddr, n * sizeof(*out), data);
 }
 
 bool MVVarSection::is_needed(bool overr) { return overr; }
 
-void MVVarSection::set_vars(std::vector<std::shared_ptr<MVVar>> *_vars) {
-  vars = _vars;
-}
+void MVVarSection::set_model(Model *_model) { model = _model; }
 //-----------------MVCsSection-------------------------------
 std::unique_ptr<std::vector<struct mv_info_callsite>> MVCsSection::read() {
-  auto v = std::make_unique<std::vector<struct mv_info_callsite>>();
-  if (scn_in == nullptr)  // Section does not exist
-    return v;
-  auto d = elf_getdata(scn_in, nullptr);
-  if (d == nullptr)  // Section has no data
-    return v;
+  return bintail::CallsiteRecords::read(in_buf(), max_sz());
+}
 
-  GElf_Shdr shdr;
-  gelf_getshdr(scn_in, &shdr);
+/* Callsites that libmultiverse turns into patchpoints */
+static bool in_callsite_table(MVPP &pp) {
+  return !pp._fn->is_fixed() && pp.pp.type != PP_TYPE_X86_JUMP &&
+         !pp.discovered;
+}
 
-  auto buf = static_cast<const uint8_t *>(d->d_buf);
-  for (auto i = 0; i * sizeof(struct mv_info_callsite) < shdr.sh_size; i++) {
-    auto e = *((struct mv_info_callsite *)buf + i);
-    v->push_back(e);
-  }
-  return v;
+/* Patchpoints multiverse_init creates: the callsites and the jump at each
+ * generic body that catches calls through function pointers. Discovered
+ * tail jumps are not among them. */
+static bool in_runtime_list(MVPP &pp) {
+  return in_callsite_table(pp) ||
+         (!pp._fn->is_fixed() && pp.pp.type == PP_TYPE_X86_JUMP &&
+          pp.pp.location == pp._fn->location());
 }
 
 uint64_t MVCsSection::generate(bool fpic, uint64_t offset, uint64_t vaddr,
                                Section *data) {
-  relocs.clear();
-  auto ndx = 0;
-  if (scn_out != nullptr) {  // no data -> section not needed
-    /* data */
-    auto data = elf_getdata(scn_out, nullptr);
-    auto buf = static_cast<uint8_t *>(data->d_buf);
-
-    for (auto &e : *pps) {
-      if (e->_fn->is_fixed() || e->pp.type == PP_TYPE_X86_JUMP) continue;
-      ndx += e->make_info(fpic, buf + ndx, this, vaddr + ndx);
-    }
-    data->d_size = ndx;
-    elf_flagdata(data, ELF_C_SET, ELF_F_DIRTY);
-
-    /* shdr */
-    GElf_Shdr shdr;
-    gelf_getshdr(scn_in, &shdr);
-
-    shdr.sh_offset = offset;
-    shdr.sh_addr = vaddr;
-    shdr.sh_size = ndx;
-
-    gelf_update_shdr(scn_out, &shdr);
-    elf_flagshdr(scn_out, ELF_C_SET, ELF_F_DIRTY);
+  auto out = reinterpret_cast<mv_info_callsite *>(begin_records());
+  auto n = 0ul;
+  if (out != nullptr) {
+    for (auto &e : model->pps)
+      if (in_callsite_table(e)) out[n++] = e.info();
+    if (fpic) bintail::CallsiteRecords::relocate(out, n, vaddr, &relocs);
   }
-
-  /* start/stop_ptr for libmultiverse */
-  data->write_ptr(fpic, start_ptr, vaddr);
-  data->write_ptr(fpic, stop_ptr, vaddr + ndx);
-  return ndx;
+  return end_records(fpic, offset, vaddr, n * sizeof(*out), data);
 }
 
-bool MVCsSection::is_needed(bool overr) { return overr; }
+static uint64_t out_vaddr(Section *s) {
+  GElf_Shdr shdr;
+  gelf_getshdr(s->scn_out, &shdr);
+  return shdr.sh_addr;
+}
 
-void MVCsSection::set_pps(std::vector<std::unique_ptr<MVPP>> *_pps) {
-  pps = _pps;
+/* Pointer at vaddr inside buf (starting at base), relocated if fpic */
+static void put_ptr(bool fpic, Section *s, uint8_t *buf, uint64_t base,
+                    uint64_t vaddr, uint64_t target) {
+  memcpy(buf + (vaddr - base), &target, sizeof(target));
+  if (fpic && target != 0) s->add_rela(vaddr, target);
 }
-//------------------MVDataSection--------------------------------
-uint64_t MVDataSection::generate(bool fpic, uint64_t offset, uint64_t vaddr) {
-  relocs.clear();
-  if (scn_out == nullptr) {  // no data -> section not needed
+
+/*
+ * The lists multiverse_init builds from the info records:
+ *   mv_info_var.functions_head  -> mv_info_fn_ref -> mv_info_fn
+ *   mv_info_fn.patchpoints_head -> mv_patchpoint (per callsite and body)
+ * Records follow the callsites in this section, the heads are written into
+ * the already generated fn and var records. Each swapspace holds the code
+ * the patchpoint overwrites, multiverse_revert copies it back.
+ */
+uint64_t MVCsSection::prelink(bool fpic, uint64_t room, MVFnSection *mvfn,
+                              MVVarSection *mvvar, Section *text) {
+  if (scn_out == nullptr || mvfn->scn_out == nullptr ||
+      mvvar->scn_out == nullptr)
     return 0;
-  }
 
-  /* data */
-  auto data = elf_getdata(scn_out, nullptr);
-  auto buf = static_cast<uint8_t *>(data->d_buf);
-
-  auto ndx = 0;
-  for (auto &e : *fns) {
-    if (e->is_fixed()) continue;
-    e->set_mvfn_vaddr(vaddr + ndx);
-    ndx += e->make_mvdata(fpic, buf + ndx, this, vaddr + ndx);
+  auto vaddr = out_vaddr(this);
+  auto pad = (8 - (vaddr + sz) % 8) % 8;
+  auto refs = 0ul, pps = 0ul;
+  for (auto &var : model->vars)
+    if (!var.frozen)
+      for (auto &fn : var.functions()) refs += !fn.is_fixed();
+  for (auto &pp : model->pps) pps += in_runtime_list(pp);
+  auto size = sz + pad + refs * sizeof(mv_info_fn_ref) +
+              pps * sizeof(mv_patchpoint);
+  if (size - sz > room)
+    throw std::runtime_error("Prelinking needs " + to_string(size - sz) +
+                             " bytes, the info area has " + to_string(room));
+
+  auto data = out();
+  linked.assign(size, 0);
+  memcpy(linked.data(), data->d_buf, sz);
+  auto buf = linked.data();
+  auto pos = vaddr + sz + pad;
+
+  /* fn records in generate order */
+  map<MVFn *, uint64_t> fn_at;
+  auto fn_vaddr = out_vaddr(mvfn);
+  auto fn_pos = fn_vaddr;
+  for (auto &fn : model->fns) {
+    if (fn.is_fixed()) continue;
+    fn_at[&fn] = fn_pos;
+    fn_pos += sizeof(mv_info_fn);
   }
-  data->d_size = ndx;
-  elf_flagdata(data, ELF_C_SET, ELF_F_DIRTY);
 
-  /* shdr */
-  GElf_Shdr shdr;
-  gelf_getshdr(scn_in, &shdr);
+  for (auto &fn : model->fns) {
+    if (fn.is_fixed()) continue;
+    auto head = 0ul;
+    for (auto &pp : fn.patchpoints()) {
+      if (!in_runtime_list(pp)) continue;
+      put_ptr(fpic, this, buf, vaddr, pos + offsetof(mv_patchpoint, next),
+              head);
+      put_ptr(fpic, this, buf, vaddr, pos + offsetof(mv_patchpoint, function),
+              fn_at[&fn]);
+      auto p = reinterpret_cast<mv_patchpoint *>(buf + (pos - vaddr));
+      p->location = pp.pp.location;
+      p->type = pp.pp.type;
+      memcpy(p->swapspace, text->in_buf(pp.pp.location), pp.size());
+      head = pos;
+      pos += sizeof(mv_patchpoint);
+    }
+    put_ptr(fpic, mvfn, mvfn->out_buf(), fn_vaddr,
+            fn_at[&fn] + offsetof(mv_info_fn, patchpoints_head), head);
+  }
 
-  shdr.sh_offset = offset;
-  shdr.sh_addr = vaddr;
-  shdr.sh_size = ndx;
-  // shdr.sh_addralign = 1; // ToDo(Felix): why 16?
+  auto var_vaddr = out_vaddr(mvvar);
+  auto var_pos = var_vaddr;
+  for (auto &var : model->vars) {
+    if (var.frozen) continue;
+    auto head = 0ul;
+    for (auto &fn : var.functions()) {
+      if (fn.is_fixed()) continue;
+      put_ptr(fpic, this, buf, vaddr, pos + offsetof(mv_info_fn_ref, next),
+              head);
+      put_ptr(fpic, this, buf, vaddr, pos + offsetof(mv_info_fn_ref, fn),
+              fn_at[&fn]);
+      head = pos;
+      pos += sizeof(mv_info_fn_ref);
+    }
+    auto v = reinterpret_cast<mv_info_var *>(mvvar->out_buf() +
+                                             (var_pos - var_vaddr));
+    v->reserved |= MV_VAR_PRELINKED;
+    put_ptr(fpic, mvvar, mvvar->out_buf(), var_vaddr,
+            var_pos + offsetof(mv_info_var, functions_head), head);
+    var_pos += sizeof(mv_info_var);
+  }
 
+  data->d_buf = buf;
+  data->d_size = size;
+  dirty = true;
+  GElf_Shdr shdr;
+  gelf_getshdr(scn_out, &shdr);
+  shdr.sh_size = size;
   gelf_update_shdr(scn_out, &shdr);
   elf_flagshdr(scn_out, ELF_C_SET, ELF_F_DIRTY);
 
-  return ndx;
+  auto added = size - sz;
+  sz = size;
+  return added;
 }
 
-bool MVDataSection::is_needed(bool overr) { return overr; }
+bool MVCsSection::is_needed(bool overr) { return overr; }
 
-void MVDataSection::set_fns(std::vector<std::unique_ptr<MVFn>> *_fns) {
-  fns = _fns;
+void MVCsSection::set_model(Model *_model) { model = _model; }
+//------------------MVDataSection--------------------------------
+uint64_t MVDataSection::generate(bool fpic, uint64_t offset, uint64_t vaddr) {
+  auto buf = begin_records();
+  if (buf == nullptr) return 0;  // no data -> section not needed
+
+  auto ndx = 0ul;
+  for (auto &e : model->fns) {
+    if (e.is_fixed()) continue;
+    e.set_mvfn_vaddr(vaddr + ndx);
+    ndx += e.make_mvdata(fpic, buf + ndx, this, vaddr + ndx);
+  }
+  // shdr.sh_addralign = 1; // ToDo(Felix): why 16?
+  return end_records(fpic, offset, vaddr, ndx, nullptr);
 }
+
+bool MVDataSection::is_needed(bool overr) { return overr; }
+
+void MVDataSection::set_model(Model *_model) { model = _model; }
 //------------------BssSection---------------------------------
 uint64_t BssSection::generate(uint64_t offset, uint64_t vaddr_start,
                               uint64_t vaddr_end) {
   /* shdr */
-  GElf_Shdr shdr;
-  gelf_getshdr(scn_in, &shdr);
+  auto shdr = shdr_in;
 
   auto old_offset = shdr.sh_offset;
   shdr.sh_offset = offset;
@@ -335,15 +360,12 @@ uint64_t BssSection::generate(uint64_t offset, uint64_t vaddr_start,
 
   gelf_update_shdr(scn_out, &shdr);
   elf_flagshdr(scn_out, ELF_C_SET, ELF_F_DIRTY);
+  addr_out = vaddr_start;
 
   return shift;
 }
 
-uint64_t BssSection::old_sz() {
-  GElf_Shdr shdr;
-  gelf_getshdr(scn_in, &shdr);
-  return shdr.sh_size;
-}
+uint64_t BssSection::old_sz() { return shdr_in.sh_size; }
 
 uint64_t BssSection::new_sz() {
   GElf_Shdr shdr;
@@ -355,10 +377,8 @@ uint64_t BssSection::new_sz() {
 void Dynamic::load(Elf_Scn *scn_in) {
   Section::load(scn_in);
   auto d = elf_getdata(scn_in, nullptr);
-  GElf_Shdr shdr;
-  gelf_getshdr(scn_in, &shdr);
 
-  for (auto i = 0; i * shdr.sh_entsize < d->d_size; i++) {
+  for (auto i = 0; i * shdr_in.sh_entsize < d->d_size; i++) {
     auto dyn = make_unique<GElf_Dyn>();
     gelf_getdyn(d, i, dyn.get());
     dyns.push_back(std::move(dyn));
@@ -384,15 +404,15 @@ GElf_Dyn *Dynamic::get_dyn(int64_t tag) {
 void Dynamic::write() {
   /* data */
   int i = 0;
-  auto d = elf_getdata(scn_out, nullptr);
+  auto d = out();
   for (auto &dyn : dyns)
     if (!gelf_update_dyn(d, i++, dyn.get()))
-      cout << "Error: gelf_update_dyn() " << elf_errmsg(elf_errno()) << endl;
-  elf_flagdata(d, ELF_C_SET, ELF_F_DIRTY);
+      throw std::runtime_error("Error: gelf_update_dyn() "s +
+                               elf_errmsg(elf_errno()));
+  dirty = true;
 
   /* shdr */
-  GElf_Shdr shdr;
-  gelf_getshdr(scn_in, &shdr);
+  auto shdr = shdr_in;
 
   shdr.sh_size = i * sizeof(GElf_Dyn);
 
@@ -409,28 +429,35 @@ void Section::add_rela(uint64_t source, uint64_t target) {
   relocs.push_back(rela);
 }
 
-const uint8_t *Section::in_buf() {
-  auto d = elf_getdata(scn_in, nullptr);
-  return static_cast<uint8_t *>(d->d_buf);
-}
+const uint8_t *Section::in_buf() { return buf_in; }
 
 const uint8_t *Section::in_buf(uint64_t addr) {
+  return buf_in + (addr - shdr_in.sh_addr);
+}
+
+Elf_Data *Section::out() {
+  if (data_out != nullptr) return data_out;
+  if (scn_out == nullptr) throw std::runtime_error("Section does not exsist");
   GElf_Shdr shdr;
-  gelf_getshdr(scn_in, &shdr);
-  return in_buf() + (addr - shdr.sh_addr);
+  gelf_getshdr(scn_out, &shdr);
+  addr_out = shdr.sh_addr;
+  return data_out = elf_getdata(scn_out, nullptr);
 }
 
 uint8_t *Section::out_buf() {
-  if (scn_out == nullptr) throw std::runtime_error("Section does not exsist");
-  auto d = elf_getdata(scn_out, nullptr);
-  elf_flagdata(d, ELF_C_SET, ELF_F_DIRTY);
-  return static_cast<uint8_t *>(d->d_buf);
+  dirty = true;
+  return static_cast<uint8_t *>(out()->d_buf);
 }
 
 uint8_t *Section::out_buf(uint64_t addr) {
-  GElf_Shdr shdr;
-  gelf_getshdr(scn_out, &shdr);
-  return out_buf() + (addr - shdr.sh_addr);
+  auto buf = out_buf();
+  return buf + (addr - addr_out);
+}
+
+void Section::commit() {
+  if (dirty && data_out != nullptr)
+    elf_flagdata(data_out, ELF_C_SET, ELF_F_DIRTY);
+  dirty = false;
 }
 
 bool Section::probe_rela(GElf_Rela *rela) {
@@ -440,12 +467,10 @@ bool Section::probe_rela(GElf_Rela *rela) {
 }
 
 uint64_t Section::read_ptr(uint64_t address) {
-  GElf_Shdr shdr;
-  gelf_getshdr(scn_out, &shdr);
-  auto d = elf_getdata(scn_out, nullptr);
+  auto d = out();
 
-  auto off = address - shdr.sh_addr;
-  if (address < shdr.sh_addr)
+  auto off = address - addr_out;
+  if (address < addr_out)
     throw std::runtime_error("Section read error, addr to low");
   if (off > d->d_size)
     throw std::runtime_error("Section read error, addr to high");
@@ -457,12 +482,10 @@ uint64_t Section::read_ptr(uint64_t address) {
 }
 
 void Section::write_ptr(bool fpic, uint64_t address, uint64_t destination) {
-  GElf_Shdr shdr;
-  gelf_getshdr(scn_out, &shdr);
-  auto d = elf_getdata(scn_out, nullptr);
+  auto d = out();
 
-  auto off = address - shdr.sh_addr;
-  if (address < shdr.sh_addr)
+  auto off = address - addr_out;
+  if (address < addr_out)
     throw std::runtime_error("Section write error, addr to low");
   if (off > d->d_size)
     throw std::runtime_error("Section write error, addr to high");
@@ -471,6 +494,7 @@ void Section::write_ptr(bool fpic, uint64_t address, uint64_t destination) {
   auto dest = reinterpret_cast<uint64_t *>(buf + off);
 
   *dest = destination;
+  dirty = true;
   if (fpic) {
     add_rela(address, destination);
   }
@@ -481,7 +505,11 @@ bool Section::is_needed(bool overr) {
   return true;
 }
 
-void Section::set_out_scn(Elf_Scn *_scn_out) { scn_out = _scn_out; }
+void Section::set_out_scn(Elf_Scn *_scn_out) {
+  scn_out = _scn_out;
+  data_out = nullptr;
+  dirty = false;
+}
 
 void Section::print(size_t row) {
   Elf_Data *d = elf_getdata(scn_in, nullptr);
@@ -490,22 +518,45 @@ void Section::print(size_t row) {
     return;
   }
   auto p = (uint8_t *)d->d_buf;
-  GElf_Shdr shdr;
-  gelf_getshdr(scn_in, &shdr);
+  auto &shdr = shdr_in;
+
+  /* One pass over the relocations by offset, the text is written once */
+  vector<const GElf_Rela *> sorted;
+  for (auto &r : relocs) sorted.push_back(&r);
+  stable_sort(sorted.begin(), sorted.end(),
+              [](auto a, auto b) { return a->r_offset < b->r_offset; });
+  auto next = sorted.cbegin();
 
+  static const char digits[] = "0123456789abcdef";
   auto v = shdr.sh_addr;
-  cout << " 0x" << hex << v << ": ";
-  for (auto n = 0u; n < d->d_size; n++) {
-    auto r = get_rela(v + n);
-    if (r != nullptr)
-      cout << ANSI_COLOR_BLUE << "[0x" << r->r_addend << "]";
-    else
-      cout << ANSI_COLOR_RESET;
-    printf("%02x ", *(p + n));
-    if (n % 4 == 3) printf(" ");
-    if (n % row == row - 1) cout << "\n 0x" << hex << v + n + 1 << ": ";
+  char tmp[32];
+  string out;
+  out.reserve(d->d_size * 4);
+  snprintf(tmp, sizeof(tmp), " 0x%lx: ", v);
+  out += tmp;
+  auto blue = true;  // reset once in front
+  for (auto n = 0ul; n < d->d_size; n++) {
+    while (next != sorted.cend() && (*next)->r_offset < v + n) next++;
+    if (next != sorted.cend() && (*next)->r_offset == v + n) {
+      snprintf(tmp, sizeof(tmp), "[0x%lx]", (*next)->r_addend);
+      out += ANSI_COLOR_BLUE;
+      out += tmp;
+      blue = true;
+    } else if (blue) {
+      out += ANSI_COLOR_RESET;
+      blue = false;
+    }
+    out += digits[p[n] >> 4];
+    out += digits[p[n] & 0xf];
+    out += ' ';
+    if (n % 4 == 3) out += ' ';
+    if (n % row == row - 1) {
+      snprintf(tmp, sizeof(tmp), "\n 0x%lx: ", v + n + 1);
+      out += tmp;
+    }
   }
-  cout << "\n";
+  out += '\n';
+  cout << out;
 }
 
 GElf_Rela *Section::get_rela(uint64_t vaddr) {
@@ -517,27 +568,22 @@ GElf_Rela *Section::get_rela(uint64_t vaddr) {
     return r.base();
 }
 
-string Section::get_string(uint64_t addr) {
+string_view Section::get_string(uint64_t addr) {
   return {reinterpret_cast<const char *>(in_buf(addr))};
 }
 
-bool Section::is_nobits() {
-  GElf_Shdr shdr;
-  gelf_getshdr(scn_in, &shdr);
-  return shdr.sh_type == SHT_NOBITS;
-}
+bool Section::is_nobits() { return shdr_in.sh_type == SHT_NOBITS; }
 
 bool Section::inside(uint64_t addr) {
-  GElf_Shdr shdr;
-  gelf_getshdr(scn_in, &shdr);
-  bool not_above = addr < shdr.sh_addr + shdr.sh_size;
-  bool not_below = addr >= shdr.sh_addr;
+  bool not_above = addr < shdr_in.sh_addr + shdr_in.sh_size;
+  bool not_below = addr >= shdr_in.sh_addr;
   return not_above && not_below;
 }
 
+uint64_t Section::vaddr() { return shdr_in.sh_addr; }
+
 bool Section::in_segment(const GElf_Phdr &phdr) {
-  GElf_Shdr shdr;
-  gelf_getshdr(scn_in, &shdr);
+  auto &shdr = shdr_in;
   // last section in mvinfo_area bss
   bool last_nobits = shdr.sh_offset == phdr.p_offset + phdr.p_filesz &&
                      shdr.sh_type == SHT_NOBITS && shdr.sh_size > 0;
@@ -553,14 +599,17 @@ void Section::fill(uint64_t addr, uint8_t value, size_t len) {
 
 void Section::load(Elf_Scn *s) {
   scn_in = s;
+  shdr_in = {};
+  buf_in = nullptr;
   if (scn_in == nullptr) {
-    max_size = 0;
+    max_size = sz = 0;
     return;
   }
 
-  GElf_Shdr shdr;
-  gelf_getshdr(s, &shdr);
-  max_size = shdr.sh_size;
+  gelf_getshdr(s, &shdr_in);
+  max_size = sz = shdr_in.sh_size;
 
-  assert(elf_getdata(s, nullptr)->d_size == shdr.sh_size);
+  auto d = elf_getdata(s, nullptr);
+  assert(d->d_size == shdr_in.sh_size);
+  buf_in = static_cast<const uint8_t *>(d->d_buf);
 }
@@ -0,0 +1,35 @@
+#include "patch.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "probe.h"
+
+namespace bintail {
+
+void encode_patch(const PatchSite& s, uint8_t* out) {
+  memcpy(out, s.t->bytes, s.t->len);
+  if (s.t->rel32 != 0) {
+    uint32_t rel = s.target - (s.location + s.t->rel32 + 4);
+    memcpy(out + s.t->rel32, &rel, sizeof(rel));
+  }
+  if (s.t->imm32 != 0)
+    memcpy(out + s.t->imm32, &s.constant, sizeof(s.constant));
+}
+
+void write_patches(std::vector<PatchSite>& sites, ::Section* text) {
+  if (sites.empty()) return;
+  std::stable_sort(sites.begin(), sites.end(), [](auto& a, auto& b) {
+    return a.location < b.location;
+  });
+
+  auto base = text->vaddr();
+  auto buf = text->out_buf();
+  for (auto& s : sites) {
+    encode_patch(s, buf + (s.location - base));
+    auto t = s.t - &patch_templates[0][0];  // row pp type, column fn type
+    BINTAIL_PROBE4(patch_written, s.location, t / 5, t % 5, s.t->len);
+  }
+}
+
+}  // namespace bintail
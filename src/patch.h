@@ -0,0 +1,109 @@
+#ifndef BINTAIL_PATCH_H_
+#define BINTAIL_PATCH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "mvelem.h"
+
+namespace bintail {
+
+/**
+ * Bytes written at a patchpoint. rel32 is the offset of a slot for the
+ * displacement to the variant body, imm32 of a slot for its constant, 0
+ * if the template has none (offset 0 is always the opcode).
+ **/
+struct PatchTemplate {
+  uint8_t len;
+  uint8_t bytes[6];
+  uint8_t rel32;
+  uint8_t imm32;
+};
+
+/* Rows: mv_info_patchpoint_type, columns: mvfn_type_t */
+constexpr PatchTemplate patch_templates[4][5] = {
+    /* PP_TYPE_INVALID */
+    {},
+    /* PP_TYPE_X86_CALL */
+    {
+        {5, {0xe8, 0, 0, 0, 0}, 1, 0},              // call rel32
+        {5, {0x0f, 0x1f, 0x44, 0x00, 0x00}, 0, 0},  // nopl 0(%rax,%rax)
+        {5, {0xb8, 0, 0, 0, 0}, 0, 1},              // mov $imm32,%eax
+        {5, {0xfa, 0x0f, 0x1f, 0x40, 0x00}, 0, 0},  // cli; nopl 0(%rax)
+        {5, {0xfb, 0x0f, 0x1f, 0x40, 0x00}, 0, 0},  // sti; nopl 0(%rax)
+    },
+    /* PP_TYPE_X86_CALL_INDIRECT */
+    {
+        {6, {0xe8, 0, 0, 0, 0, 0x90}, 1, 0},
+        {6, {0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00}, 0, 0},
+        {6, {0xb8, 0, 0, 0, 0, 0x90}, 0, 1},
+        {6, {0xfa, 0x0f, 0x1f, 0x44, 0x00, 0x00}, 0, 0},
+        {6, {0xfb, 0x0f, 0x1f, 0x44, 0x00, 0x00}, 0, 0},
+    },
+    /* PP_TYPE_X86_JUMP, the variant body is entered the same way for all */
+    {
+        {5, {0xe9, 0, 0, 0, 0}, 1, 0},
+        {5, {0xe9, 0, 0, 0, 0}, 1, 0},
+        {5, {0xe9, 0, 0, 0, 0}, 1, 0},
+        {5, {0xe9, 0, 0, 0, 0}, 1, 0},
+        {5, {0xe9, 0, 0, 0, 0}, 1, 0},
+    },
+};
+
+constexpr const PatchTemplate* patch_template(mv_info_patchpoint_type pp,
+                                              mvfn_type_t fn) {
+  return pp > PP_TYPE_INVALID && pp <= PP_TYPE_X86_JUMP &&
+                 fn >= MVFN_TYPE_NONE && fn <= MVFN_TYPE_STI
+             ? &patch_templates[pp][fn]
+             : nullptr;
+}
+
+static_assert(patch_template(PP_TYPE_X86_CALL, MVFN_TYPE_CONSTANT)->imm32 == 1,
+              "mov $imm32 has its immediate behind the opcode");
+static_assert(patch_template(PP_TYPE_X86_CALL_INDIRECT, MVFN_TYPE_NOP)->len ==
+                  6,
+              "indirect calls are 6 bytes long");
+static_assert(patch_template(PP_TYPE_INVALID, MVFN_TYPE_NONE) == nullptr,
+              "invalid patchpoints have no encoding");
+
+/* One patchpoint to be written by write_patches */
+struct PatchSite {
+  uint64_t location;
+  const PatchTemplate* t;
+  uint64_t target;    // variant body for rel32
+  uint32_t constant;  // for imm32
+};
+
+/**
+ * Bytes of one site, t->len of them.
+ **/
+void encode_patch(const PatchSite& site, uint8_t* out);
+
+/**
+ * Sort the sites by address and write them in one pass over .text. Sites
+ * at the same address are written in the order they were added.
+ **/
+void write_patches(std::vector<PatchSite>& sites, ::Section* text);
+
+/*
+ * Patch script section (.multiverse_patch), not loaded. For every variable
+ * left dynamic and every range of values the assignments tell apart, the
+ * bytes to copy when the variable changes into that range. Little endian,
+ * without padding:
+ *
+ *   "MVPS" u32 version u32 n_vars
+ *   n_vars times:
+ *     u64 variable_location u32 n_segments
+ *     n_segments times:
+ *       u32 lower u32 upper u32 n_records
+ *       n_records times (by address, for few protection changes):
+ *         u64 address u8 len u8 bytes[len]
+ *
+ * Addresses are link time addresses, PIE adds its load bias.
+ */
+constexpr char script_magic[4] = {'M', 'V', 'P', 'S'};
+constexpr uint32_t script_version = 1;
+
+}  // namespace bintail
+#endif  // BINTAIL_PATCH_H_
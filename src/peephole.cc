@@ -0,0 +1,142 @@
+#include <bintail/bintail.hpp>
+
+#include <algorithm>
+
+#include "flow.h"
+#include "mvelem.h"
+#include "x86.h"
+
+using namespace std;
+namespace x86 = bintail::x86;
+
+/**
+ * Flags after test/cmp of %eax or %al holding value.
+ *
+ * \return false if insn is not such a comparison
+ **/
+static bool compare_flags(const uint8_t* op, const x86::Insn& insn,
+                          uint32_t value, x86::Flags* f) {
+  if (insn.map != x86::MAP_1BYTE || insn.rex != 0 || insn.opsize ||
+      insn.opc_off != 0)
+    return false;
+  auto eax = insn.has_modrm && insn.modrm == 0xc0;
+  switch (insn.opcode) {
+    case 0x84:  // test %al,%al
+      if (!eax) return false;
+      *f = x86::and_flags(value, value, 1);
+      return true;
+    case 0x85:  // test %eax,%eax
+      if (!eax) return false;
+      *f = x86::and_flags(value, value, 4);
+      return true;
+    case 0x3c:  // cmp $imm8,%al
+      *f = x86::sub_flags(value, op[1], 1);
+      return true;
+    case 0x3d:  // cmp $imm32,%eax
+      *f = x86::sub_flags(value, x86::read_signed(op + 1, 4), 4);
+      return true;
+    case 0x83:  // cmp $simm8,%eax
+      if (insn.modrm != 0xf8) return false;
+      *f = x86::sub_flags(value, x86::read_signed(op + 2, 1), 4);
+      return true;
+  }
+  return false;
+}
+
+PeepholeStats Bintail::peephole() {
+  PeepholeStats r;
+
+  auto map = bintail::code_map(*this);
+  auto start = text.vaddr();
+  auto buf = text.out_buf();
+
+  /* Patch windows keep their encoding, verify() checks them */
+  vector<uint64_t> windows;
+  for (auto& pp : model.pps) windows.push_back(pp.pp.location);
+  sort(windows.begin(), windows.end());
+  auto is_window = [&](uint64_t a) {
+    return binary_search(windows.begin(), windows.end(), a);
+  };
+
+  /* Collapse the nop instructions starting at a into the fewest nops */
+  auto merge_nops = [&](uint64_t a, uint64_t fe) {
+    auto b = a;
+    size_t count = 0;
+    for (x86::Insn insn; b < fe && !is_window(b); b += insn.len, count++) {
+      auto op = buf + (b - start);
+      if (x86::decode(op, fe - b, &insn) == 0 || !x86::is_nop(op, insn))
+        break;
+    }
+    auto merged = (b - a + 8) / 9;
+    if (merged >= count) return false;
+    if (map.entered(a, b)) {
+      r.refused++;
+      return false;
+    }
+    x86::write_nops(buf + (a - start), b - a);
+    r.nops_merged += count - merged;
+    return true;
+  };
+
+  for (auto& pp : model.pps) {
+    if (pp._fn == nullptr || !pp._fn->is_fixed()) continue;
+    auto mvfn = pp._fn->active_mvfn();
+    auto loc = pp.pp.location;
+    if (mvfn == nullptr || pp.pp.type == PP_TYPE_X86_JUMP ||
+        map.is_guarded(loc))
+      continue;
+    auto f = map.function(loc);
+    auto next = loc + pp.size();
+    if (next >= f.second) continue;
+    auto op = buf + (next - start);
+
+    switch (mvfn->type) {
+      case MVFN_TYPE_NONE:  // call; ret -> jmp; ret
+        if (buf[loc - start] != 0xe8 ||
+            (op[0] != 0xc3 && !(op[0] == 0xf3 && op[1] == 0xc3)))
+          break;
+        buf[loc - start] = 0xe9;
+        r.tail_calls++;
+        break;
+
+      case MVFN_TYPE_CONSTANT: {
+        x86::Insn cmp, jcc;
+        x86::Flags flags;
+        if (x86::decode(op, f.second - next, &cmp) == 0 ||
+            !compare_flags(op, cmp, mvfn->constant, &flags))
+          break;
+        auto j = next + cmp.len;
+        auto jop = buf + (j - start);
+        if (x86::decode(jop, f.second - j, &jcc) == 0 ||
+            jcc.branch != x86::BR_JCC ||
+            (jcc.map == x86::MAP_1BYTE && jcc.opcode >= 0xe0))
+          break;
+        auto after = j + jcc.len;
+        auto target = x86::branch_target(jop, jcc, j);
+        auto taken = x86::condition(jcc.opcode & 0xf, flags);
+        auto cont = taken ? target : after;
+        if (map.entered(loc, after) || cont < f.first || cont >= f.second ||
+            !x86::flags_dead(buf + (cont - start), f.second - cont)) {
+          r.refused++;
+          break;
+        }
+        if (taken && !x86::write_jmp(op, next, target, after - next)) {
+          r.refused++;
+          break;
+        }
+        if (!taken) x86::write_nops(op, after - next);
+        r.branches_folded++;
+        if (!taken) merge_nops(next, f.second);
+        break;
+      }
+
+      case MVFN_TYPE_NOP:
+        merge_nops(next, f.second);
+        break;
+
+      default:
+        break;
+    }
+  }
+  return r;
+}
@@ -0,0 +1,89 @@
+#include "pool.h"
+
+namespace bintail {
+
+/* Worker identity, lets tasks spawned by a worker stay on its deque */
+static thread_local ThreadPool *current_pool = nullptr;
+static thread_local size_t current_index = 0;
+
+ThreadPool::ThreadPool(unsigned threads) {
+  if (threads == 0) threads = std::thread::hardware_concurrency();
+  if (threads == 0) threads = 1;
+  for (auto i = 0u; i < threads; i++)
+    queues_.push_back(std::make_unique<Queue>());
+  for (auto i = 0u; i < threads; i++)
+    workers_.emplace_back([this, i] { run(i); });
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> lock{mtx_};
+    stop_ = true;
+  }
+  cv_.notify_all();
+  for (auto &w : workers_) w.join();
+}
+
+void ThreadPool::push(std::function<void()> task) {
+  size_t q;
+  if (current_pool == this) {
+    q = current_index;
+  } else {
+    std::lock_guard<std::mutex> lock{mtx_};
+    q = next_++ % queues_.size();
+  }
+  {
+    std::lock_guard<std::mutex> lock{queues_[q]->mtx};
+    queues_[q]->tasks.push_back(std::move(task));
+  }
+  {
+    std::lock_guard<std::mutex> lock{mtx_};
+    pending_++;
+  }
+  cv_.notify_one();
+}
+
+/**
+ * Newest task of the own deque first (cache warm), then the oldest one of
+ * the other deques.
+ **/
+bool ThreadPool::pop(size_t self, std::function<void()> &task) {
+  {
+    auto &own = *queues_[self];
+    std::lock_guard<std::mutex> lock{own.mtx};
+    if (!own.tasks.empty()) {
+      task = std::move(own.tasks.back());
+      own.tasks.pop_back();
+      return true;
+    }
+  }
+  for (auto i = 1ul; i < queues_.size(); i++) {
+    auto &victim = *queues_[(self + i) % queues_.size()];
+    std::lock_guard<std::mutex> lock{victim.mtx};
+    if (!victim.tasks.empty()) {
+      task = std::move(victim.tasks.front());
+      victim.tasks.pop_front();
+      return true;
+    }
+  }
+  return false;
+}
+
+void ThreadPool::run(size_t self) {
+  current_pool = this;
+  current_index = self;
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock{mtx_};
+      cv_.wait(lock, [this] { return stop_ || pending_ > 0; });
+      if (pending_ == 0) return;  // stop_ and drained
+      pending_--;
+    }
+    /* One queued task is reserved for this worker, find it */
+    std::function<void()> task;
+    while (!pop(self, task)) std::this_thread::yield();
+    task();
+  }
+}
+
+}  // namespace bintail
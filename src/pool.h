@@ -0,0 +1,69 @@
+#ifndef BINTAIL_POOL_H_
+#define BINTAIL_POOL_H_
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace bintail {
+
+/**
+ * Work-stealing pool: every worker owns a deque, takes the newest task from
+ * its own and steals the oldest from the others when it runs dry. Tasks
+ * submitted by a worker stay on its deque, others are spread round robin.
+ * The destructor finishes all queued tasks before joining the workers.
+ **/
+class ThreadPool {
+ public:
+  /**
+   * \param threads number of workers, 0 uses the hardware concurrency
+   **/
+  explicit ThreadPool(unsigned threads = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  /**
+   * Queue f for execution, exceptions are passed on through the future.
+   **/
+  template <typename F>
+  std::future<typename std::result_of<F()>::type> submit(F f) {
+    using R = typename std::result_of<F()>::type;
+    auto task = std::make_shared<std::packaged_task<R()>>(std::move(f));
+    auto fut = task->get_future();
+    push([task] { (*task)(); });
+    return fut;
+  }
+
+  size_t size() const { return workers_.size(); }
+
+ private:
+  struct Queue {
+    std::mutex mtx;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  void push(std::function<void()> task);
+  bool pop(size_t self, std::function<void()> &task);
+  void run(size_t self);
+
+  std::vector<std::unique_ptr<Queue>> queues_;
+  std::vector<std::thread> workers_;
+
+  /* pending_ counts queued tasks not yet claimed by a worker */
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  size_t pending_ = 0;
+  size_t next_ = 0;
+  bool stop_ = false;
+};
+
+}  // namespace bintail
+#endif  // BINTAIL_POOL_H_
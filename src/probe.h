@@ -0,0 +1,45 @@
+#ifndef BINTAIL_PROBE_H_
+#define BINTAIL_PROBE_H_
+
+/*
+ * USDT probes of the provider "bintail", compiled in with
+ * -DBINTAIL_USDT=ON (needs <sys/sdt.h>) and to nothing otherwise.
+ * Arguments are integers, addresses are virtual addresses in the input.
+ *
+ *   load(sections)                     constructor found the sections
+ *   require_start(parts)               reading LOAD_* parts
+ *   require_done(parts, vars, fns, pps)
+ *   init_write_start()
+ *   init_write_done(kept, sections)    sections in output and input
+ *   apply_start(vars)
+ *   fn_applied(body, variant, patchpoints)
+ *   patch_written(location, pp_type, fn_type, len)
+ *   apply_done(sites)
+ *   generate_start()                   InfoArea::generate
+ *   generate_done(bytes, bss_shift)
+ *   relocs_done(relocs, relative, syms)  update_relocs_sym
+ *   section_shifted(offset, shift)     file offset after the shift
+ *   write_start(bytes, parts)          write_elf, before pwritev
+ *   write_done(bytes, iovecs)
+ *   elf_update_start(), elf_update_done()  libelf fallback
+ */
+#ifdef BINTAIL_USDT
+#include <sys/sdt.h>
+#define BINTAIL_PROBE(name) DTRACE_PROBE(bintail, name)
+#define BINTAIL_PROBE1(name, a) DTRACE_PROBE1(bintail, name, a)
+#define BINTAIL_PROBE2(name, a, b) DTRACE_PROBE2(bintail, name, a, b)
+#define BINTAIL_PROBE3(name, a, b, c) DTRACE_PROBE3(bintail, name, a, b, c)
+#define BINTAIL_PROBE4(name, a, b, c, d) \
+  DTRACE_PROBE4(bintail, name, a, b, c, d)
+#else
+/* Arguments are not evaluated */
+#define BINTAIL_PROBE(name) ((void)0)
+#define BINTAIL_PROBE1(name, a) ((void)sizeof(a))
+#define BINTAIL_PROBE2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+#define BINTAIL_PROBE3(name, a, b, c) \
+  ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c))
+#define BINTAIL_PROBE4(name, a, b, c, d) \
+  ((void)sizeof(a), (void)sizeof(b), (void)sizeof(c), (void)sizeof(d))
+#endif
+
+#endif  // BINTAIL_PROBE_H_
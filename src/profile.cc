@@ -0,0 +1,210 @@
+#include <bintail/bintail.hpp>
+
+#include <algorithm>
+#include <cctype>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "mvelem.h"
+
+using namespace std;
+
+/* Samples sorted by address with prefix sums for range queries */
+class Samples {
+ public:
+  void add(uint64_t addr, uint64_t period) { raw.emplace_back(addr, period); }
+
+  void finish() {
+    sort(raw.begin(), raw.end());
+    sums.resize(raw.size() + 1);
+    for (auto i = 0ul; i < raw.size(); i++)
+      sums[i + 1] = sums[i] + raw[i].second;
+  }
+
+  /* Cycles in [start, end) */
+  uint64_t in(uint64_t start, uint64_t end) const {
+    if (end <= start) return 0;
+    auto lo = lower_bound(raw.begin(), raw.end(), make_pair(start, 0ul));
+    auto hi = lower_bound(raw.begin(), raw.end(), make_pair(end, 0ul));
+    return sums[hi - raw.begin()] - sums[lo - raw.begin()];
+  }
+
+  uint64_t total() const { return sums.back(); }
+
+ private:
+  vector<pair<uint64_t, uint64_t>> raw;
+  vector<uint64_t> sums = {0};
+};
+
+static bool parse_hex(const string& s, uint64_t* v) {
+  if (s.empty() || s.size() > 18) return false;
+  size_t pos;
+  try {
+    *v = stoull(s, &pos, 16);
+  } catch (const std::exception&) {
+    return false;
+  }
+  return pos == s.size();
+}
+
+static bool parse_dec(const string& s, uint64_t* v) {
+  if (s.empty() || !all_of(s.begin(), s.end(), ::isdigit)) return false;
+  try {
+    *v = stoull(s);
+  } catch (const std::exception&) {
+    return false;
+  }
+  return true;
+}
+
+/*
+ * One sample per line as printed by perf script -F [period,]ip[,sym,symoff]:
+ *   [period] ip [sym+0xoff] [(dso)]
+ * sym+0xoff is preferred over ip, it does not depend on the load address.
+ */
+static bool parse_sample(const string& line,
+                         const map<string_view, uint64_t>& funcs,
+                         uint64_t* addr, uint64_t* period) {
+  vector<string> tok;
+  istringstream ss{line};
+  for (string t; ss >> t && t[0] != '(' && t[0] != '[';) tok.push_back(t);
+
+  uint64_t p;
+  if (tok.size() >= 2 && parse_dec(tok[0], &p) && parse_hex(tok[1], addr)) {
+    *period = p;
+  } else {
+    *period = 1;
+    if (tok.empty() || !parse_hex(tok[0], addr)) return false;
+  }
+
+  auto sym = find_if(tok.begin(), tok.end(), [](const string& t) {
+    return t.find("+0x") != string::npos;
+  });
+  if (sym != tok.end()) {
+    auto plus = sym->find("+0x");
+    auto f = funcs.find(sym->substr(0, plus));
+    uint64_t off;
+    if (f != funcs.end() && parse_hex(sym->substr(plus + 3), &off))
+      *addr = f->second + off;
+  }
+  return true;
+}
+
+ProfileReport Bintail::profile(const char* perf_script) {
+  require(LOAD_MODEL);
+  ifstream in{perf_script};
+  if (!in) throw std::runtime_error(string("Cannot open ") + perf_script);
+
+  map<string_view, uint64_t> funcs;
+  vector<pair<uint64_t, const symbol*>> callers;  // FUNC symbols by address
+  for (auto& s : syms) {
+    if (GELF_ST_TYPE(s.sym.st_info) != STT_FUNC || s.sym.st_size == 0)
+      continue;
+    funcs.emplace(s.name, s.sym.st_value);
+    callers.emplace_back(s.sym.st_value, &s);
+  }
+  sort(callers.begin(), callers.end());
+
+  ProfileReport r;
+  Samples samples;
+  uint64_t addr, period;
+  for (string line; getline(in, line);) {
+    if (line.find_first_not_of(" \t") == string::npos) continue;
+    if (parse_sample(line, funcs, &addr, &period))
+      samples.add(addr, period);
+    else
+      r.unparsed++;
+  }
+  samples.finish();
+  r.total = samples.total();
+
+  /* Callsites: the patch window and the return address behind it. The
+   * jump at a generic body is part of the body. */
+  map<MVFn*, uint64_t> site_cycles;
+  for (auto& pp : model.pps) {
+    if (pp._fn == nullptr || pp.pp.location == pp._fn->location()) continue;
+    auto loc = pp.pp.location;
+    ProfileReport::Site site{loc, "", string(pp._fn->name()), 0, 0};
+    site.cycles = samples.in(loc, loc + pp.size() + 1);
+    site_cycles[pp._fn] += site.cycles;
+
+    auto it = upper_bound(callers.begin(), callers.end(),
+                          make_pair(loc, (const symbol*)nullptr),
+                          [](auto& a, auto& b) { return a.first < b.first; });
+    if (it != callers.begin()) {
+      auto s = (--it)->second;
+      if (loc < s->sym.st_value + s->sym.st_size) {
+        site.caller = string(s->name);
+        site.caller_cycles =
+            samples.in(s->sym.st_value, s->sym.st_value + s->sym.st_size);
+      }
+    }
+    r.sites.push_back(site);
+  }
+
+  /*
+   * Estimate: a frozen function runs its smallest variant instead of the
+   * generic body, the cost shrinks with the code size. A callsite whose
+   * variant is inlined (nop, constant, cli/sti) loses the call itself.
+   */
+  map<MVFn*, uint64_t> saved;
+  for (auto& fn : model.fns) {
+    ProfileReport::Fn f{string(fn.name()), 0, 0, site_cycles[&fn], 0};
+    f.generic = samples.in(fn.location(), fn.location() + fn.size());
+    auto smallest = fn.size();
+    auto inlined = false;
+    for (auto& v : fn.variants()) {
+      f.variants += samples.in(v.location(), v.location() + v.size());
+      smallest = min(smallest, v.size());
+      inlined |= v.mvfn.type != MVFN_TYPE_NONE;
+    }
+    if (fn.size() != 0) f.saved = f.generic - f.generic * smallest / fn.size();
+    if (inlined) f.saved += f.callsites;
+    r.multiverse += f.generic + f.variants + f.callsites;
+    saved[&fn] = f.saved;
+    r.fns.push_back(f);
+  }
+
+  for (auto& var : model.vars) {
+    ProfileReport::Var v{string(var.name()), 0, {}};
+    for (auto& fn : var.functions()) {
+      v.saved += saved[&fn];
+      v.fns.emplace_back(fn.name());
+    }
+    r.vars.push_back(v);
+  }
+
+  sort(r.fns.begin(), r.fns.end(),
+       [](auto& a, auto& b) { return a.saved > b.saved; });
+  sort(r.sites.begin(), r.sites.end(),
+       [](auto& a, auto& b) { return a.cycles > b.cycles; });
+  sort(r.vars.begin(), r.vars.end(),
+       [](auto& a, auto& b) { return a.saved > b.saved; });
+  return r;
+}
+
+void ProfileReport::print_text(ostream& os, size_t top) const {
+  auto pct = [&](uint64_t c) { return total ? 100.0 * c / total : 0.0; };
+  os << dec << "cycles: " << total << ", multiverse " << multiverse << " ("
+     << pct(multiverse) << "%)";
+  if (unparsed) os << ", " << unparsed << " lines skipped";
+  os << "\n\nvariables by estimated savings:\n";
+  for (auto i = 0ul; i < vars.size() && i < top; i++) {
+    os << "\t" << vars[i].name << "\t" << vars[i].saved << " ("
+       << pct(vars[i].saved) << "%)\t";
+    for (auto& f : vars[i].fns) os << " " << f;
+    os << "\n";
+  }
+  os << "\nfunctions:\n";
+  for (auto i = 0ul; i < fns.size() && i < top; i++)
+    os << "\t" << fns[i].name << "\tsaved=" << fns[i].saved
+       << " generic=" << fns[i].generic << " variants=" << fns[i].variants
+       << " callsites=" << fns[i].callsites << "\n";
+  os << "\nhot callsites:\n";
+  for (auto i = 0ul; i < sites.size() && i < top && sites[i].cycles; i++)
+    os << "\t0x" << hex << sites[i].location << dec << " "
+       << (sites[i].caller.empty() ? "?" : sites[i].caller) << " -> "
+       << sites[i].callee << "\t" << sites[i].cycles << " of "
+       << sites[i].caller_cycles << "\n";
+}
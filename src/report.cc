@@ -0,0 +1,169 @@
+#include <bintail/bintail.hpp>
+
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+#include "checksum.h"
+#include "mvelem.h"
+
+using namespace std;
+
+static const uint64_t page_size = 4096;
+
+/* Checksum of every 4 KiB page (by vaddr) a section touches */
+static vector<uint64_t> page_sums(const uint8_t* buf, uint64_t vaddr,
+                                  size_t size) {
+  vector<uint64_t> sums;
+  for (auto pos = 0ul; pos < size;) {
+    auto len = min<uint64_t>(page_size - (vaddr + pos) % page_size, size - pos);
+    sums.push_back(bintail::fnv1a(buf + pos, len));
+    pos += len;
+  }
+  return sums;
+}
+
+static size_t pages_changed(const vector<uint64_t>& in,
+                            const vector<uint64_t>& out) {
+  auto n = 0ul;
+  for (auto i = 0ul; i < in.size() && i < out.size(); i++) n += in[i] != out[i];
+  return n;
+}
+
+static uint64_t scn_sum(Elf_Scn* scn) {
+  auto d = elf_getdata(scn, nullptr);
+  if (d == nullptr || d->d_buf == nullptr) return 0;
+  return bintail::fnv1a(static_cast<const uint8_t*>(d->d_buf), d->d_size);
+}
+
+void Bintail::enable_report() { report_enabled = true; }
+
+/* Output data still shares the input buffers, sum them before any change */
+void Bintail::snapshot_input() {
+  text_pages_in = page_sums(text.out_buf(), text.vaddr(), text.max_sz());
+  data_pages_in = page_sums(data.out_buf(), data.vaddr(), data.max_sz());
+  sums_in.clear();
+  for (auto& s : secs) sums_in.push_back(scn_sum(s.scn));
+}
+
+TailorReport Bintail::report() {
+  if (!report_enabled)
+    throw std::runtime_error("report() needs enable_report() before writing");
+  TailorReport r;
+
+  for (auto& pp : model.pps) {
+    if (pp._fn == nullptr || !pp._fn->is_fixed()) continue;
+    if (pp.pp.type == PP_TYPE_X86_JUMP) {
+      r.pp_jump++;
+      continue;
+    }
+    switch (pp._fn->active_mvfn()->type) {
+      case MVFN_TYPE_NOP:
+        r.pp_nop++;
+        break;
+      case MVFN_TYPE_CONSTANT:
+        r.pp_constant++;
+        break;
+      case MVFN_TYPE_CLI:
+      case MVFN_TYPE_STI:
+        r.pp_cli_sti++;
+        break;
+      default:
+        r.pp_call++;
+    }
+  }
+  r.calls_eliminated = r.pp_nop + r.pp_constant + r.pp_cli_sti;
+  for (auto& fn : model.fns)
+    for (auto& g : fn.guarded) r.bytes_guarded += g.second;
+
+  r.mv_sections = {{"__multiverse_data_", mvdata.max_sz(), mvdata.size()},
+                   {"__multiverse_fn_", mvfn.max_sz(), mvfn.size()},
+                   {"__multiverse_var_", mvvar.max_sz(), mvvar.size()},
+                   {"__multiverse_callsite_", mvcs.max_sz(), mvcs.size()}};
+  r.relocs_before = relocs_in;
+  r.relocs_after = relocs_out;
+  r.bss_shift = bss_shift;
+
+  auto text_out = page_sums(text.out_buf(), text.vaddr(), text.max_sz());
+  auto data_out = page_sums(data.out_buf(), data.vaddr(), data.max_sz());
+  r.text_pages = text_out.size();
+  r.text_pages_changed = pages_changed(text_pages_in, text_out);
+  r.data_pages = data_out.size();
+  r.data_pages_changed = pages_changed(data_pages_in, data_out);
+
+  for (auto i = 0ul; i < secs.size(); i++) {
+    if (secs[i].shdr.sh_type == SHT_NOBITS) continue;
+    auto out = secs[i].scn_out != nullptr ? scn_sum(secs[i].scn_out) : 0;
+    r.checksums.push_back(
+        {secs[i].name, sums_in[i], out, secs[i].scn_out == nullptr});
+  }
+  return r;
+}
+
+/*
+ * PRINTING
+ */
+static string hex_sum(uint64_t v) {
+  stringstream ss;
+  ss << hex << setw(16) << setfill('0') << v;
+  return ss.str();
+}
+
+/* after - before with sign, prelinking grows what freezing shrinks */
+static string delta(uint64_t before, uint64_t after) {
+  auto d = int64_t(after - before);
+  return (d > 0 ? "+" : "") + to_string(d);
+}
+
+void TailorReport::print_text(ostream& os) const {
+  os << dec << "callsites: nop=" << pp_nop << " constant=" << pp_constant
+     << " cli/sti=" << pp_cli_sti << " call=" << pp_call
+     << " jump=" << pp_jump << "\n"
+     << "calls eliminated: " << calls_eliminated << "\n"
+     << "bytes guarded: " << bytes_guarded << "\n";
+  for (auto& s : mv_sections)
+    os << s.name << ": " << s.before << " -> " << s.after << " ("
+       << delta(s.before, s.after) << ")\n";
+  os << "relocations: " << relocs_before << " -> " << relocs_after << " ("
+     << delta(relocs_before, relocs_after) << ")\n"
+     << ".bss shift: " << bss_shift << "\n"
+     << "text pages changed: " << text_pages_changed << "/" << text_pages
+     << "\n"
+     << "data pages changed: " << data_pages_changed << "/" << data_pages
+     << "\n"
+     << "checksums:\n";
+  for (auto& c : checksums)
+    os << "\t" << setw(28) << left << c.name << right << hex_sum(c.in) << " "
+       << (c.removed ? "removed" : hex_sum(c.out))
+       << (!c.removed && c.in != c.out ? " changed" : "") << "\n";
+}
+
+void TailorReport::print_json(ostream& os) const {
+  os << dec << "{\n"
+     << "  \"callsites\": {\"nop\": " << pp_nop
+     << ", \"constant\": " << pp_constant << ", \"cli_sti\": " << pp_cli_sti
+     << ", \"call\": " << pp_call << ", \"jump\": " << pp_jump << "},\n"
+     << "  \"calls_eliminated\": " << calls_eliminated << ",\n"
+     << "  \"bytes_guarded\": " << bytes_guarded << ",\n"
+     << "  \"mv_sections\": [";
+  for (auto i = 0ul; i < mv_sections.size(); i++)
+    os << (i ? ", " : "") << "{\"name\": \"" << mv_sections[i].name
+       << "\", \"before\": " << mv_sections[i].before
+       << ", \"after\": " << mv_sections[i].after << "}";
+  os << "],\n"
+     << "  \"relocations\": {\"before\": " << relocs_before
+     << ", \"after\": " << relocs_after << "},\n"
+     << "  \"bss_shift\": " << bss_shift << ",\n"
+     << "  \"text_pages\": {\"total\": " << text_pages
+     << ", \"changed\": " << text_pages_changed << "},\n"
+     << "  \"data_pages\": {\"total\": " << data_pages
+     << ", \"changed\": " << data_pages_changed << "},\n"
+     << "  \"checksums\": [";
+  for (auto i = 0ul; i < checksums.size(); i++) {
+    auto& c = checksums[i];
+    os << (i ? ",\n    " : "\n    ") << "{\"name\": \"" << c.name
+       << "\", \"in\": \"" << hex_sum(c.in) << "\", \"out\": "
+       << (c.removed ? "null" : "\"" + hex_sum(c.out) + "\"") << "}";
+  }
+  os << "\n  ]\n}\n";
+}
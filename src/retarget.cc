@@ -0,0 +1,58 @@
+#include <bintail/bintail.hpp>
+
+#include <cstring>
+#include <unordered_map>
+
+#include "mvelem.h"
+
+using namespace std;
+
+/*
+ * Function pointers to a frozen generic body (callback tables, vtables,
+ * GOT entries) enter the variant through the jmp written at the body.
+ * Point them at the variant directly.
+ */
+Retargeted Bintail::retarget_pointers(bool words) {
+  Retargeted r;
+  unordered_map<uint64_t, uint64_t> variant_of;
+  for (auto& fn : model.fns)
+    if (fn.is_fixed() && fn.active_mvfn() != nullptr)
+      variant_of.emplace(fn.location(), fn.active_mvfn()->function_body);
+  if (variant_of.empty()) return r;
+
+  for (auto relocs : {&data.relocs, &rela_other})
+    for (auto& rela : *relocs) {
+      if (GELF_R_TYPE(rela.r_info) != R_X86_64_RELATIVE) continue;
+      auto it = variant_of.find(rela.r_addend);
+      if (it == variant_of.end()) continue;
+      rela.r_addend = it->second;
+      r.relocs++;
+    }
+
+  /*
+   * Without relocations pointers are plain words in the file. Only words
+   * of objects made of 8 byte slots are taken, an integer of the same
+   * value would still be rewritten.
+   */
+  if (!words || ehdr_in.e_type != ET_EXEC) return r;
+  for (auto s : {&data, &rodata}) {
+    auto buf = s->out_buf();
+    auto base = s->vaddr();
+    for (auto& sym : syms) {
+      auto& st = sym.sym;
+      if (GELF_ST_TYPE(st.st_info) != STT_OBJECT || st.st_size == 0 ||
+          st.st_value % 8 != 0 || st.st_size % 8 != 0 ||
+          st.st_value < base || st.st_value + st.st_size > base + s->max_sz())
+        continue;
+      for (auto a = st.st_value; a < st.st_value + st.st_size; a += 8) {
+        uint64_t word;
+        memcpy(&word, buf + (a - base), sizeof(word));
+        auto it = variant_of.find(word);
+        if (it == variant_of.end()) continue;
+        memcpy(buf + (a - base), &it->second, sizeof(word));
+        r.words.push_back(a);
+      }
+    }
+  }
+  return r;
+}
@@ -0,0 +1,178 @@
+#include <bintail/bintail.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <unordered_map>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "mvelem.h"
+#include "x86.h"
+
+using namespace std;
+namespace x86 = bintail::x86;
+
+struct Hit {
+  uint64_t addr;
+  mv_info_patchpoint_type type;
+  MVFn* fn;
+};
+
+/*
+ * Calls each offset in [0, n) whose byte may start e8, e9 or ff 15. The
+ * SSE2 loop compares 16 bytes per step, most blocks have no match.
+ */
+template <class F>
+static void opcode_bytes(const uint8_t* p, size_t n, F f) {
+  size_t i = 0;
+#ifdef __SSE2__
+  auto e8 = _mm_set1_epi8(char(0xe8));
+  auto e9 = _mm_set1_epi8(char(0xe9));
+  auto ff = _mm_set1_epi8(char(0xff));
+  for (; i + 16 <= n; i += 16) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+    auto m = _mm_or_si128(_mm_cmpeq_epi8(v, e8), _mm_cmpeq_epi8(v, e9));
+    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, ff));
+    for (unsigned mask = _mm_movemask_epi8(m); mask != 0; mask &= mask - 1)
+      f(i + __builtin_ctz(mask));
+  }
+#endif
+  for (; i < n; i++)
+    if (p[i] == 0xe8 || p[i] == 0xe9 || p[i] == 0xff) f(i);
+}
+
+/*
+ * 8 byte pointer at vaddr, from a relative relocation or the file. Only
+ * slots the program cannot reassign count: read-only sections, .got and
+ * PT_GNU_RELRO. A patched call would ignore a store to any other.
+ */
+static bool read_slot(uint64_t vaddr,
+                      const unordered_map<uint64_t, uint64_t>& relative,
+                      const vector<struct sec>& secs,
+                      const vector<pair<uint64_t, uint64_t>>& relro,
+                      uint64_t* value) {
+  auto s = find_if(secs.begin(), secs.end(), [&](auto& s) {
+    return (s.shdr.sh_flags & SHF_ALLOC) && vaddr >= s.shdr.sh_addr &&
+           vaddr + 8 <= s.shdr.sh_addr + s.shdr.sh_size;
+  });
+  if (s == secs.end()) return false;
+  auto in_relro = any_of(relro.begin(), relro.end(), [&](auto& r) {
+    return vaddr >= r.first && vaddr + 8 <= r.second;
+  });
+  if ((s->shdr.sh_flags & SHF_WRITE) && s->name != ".got" && !in_relro)
+    return false;
+
+  auto r = relative.find(vaddr);
+  if (r != relative.end()) {
+    *value = r->second;
+    return true;
+  }
+  if (s->shdr.sh_type == SHT_NOBITS) return false;
+  auto d = elf_getdata(s->scn, nullptr);
+  if (d == nullptr || d->d_buf == nullptr) return false;
+  memcpy(value, static_cast<uint8_t*>(d->d_buf) + (vaddr - s->shdr.sh_addr),
+         8);
+  return true;
+}
+
+CallsiteScan Bintail::discover_callsites() {
+  require(LOAD_ALL);
+  CallsiteScan r;
+  unordered_map<uint64_t, MVFn*> fn_at;
+  for (auto& fn : model.fns) fn_at.emplace(fn.location(), &fn);
+  vector<pair<uint64_t, uint64_t>> known;  // patch windows
+  for (auto& pp : model.pps)
+    known.emplace_back(pp.pp.location, pp.pp.location + pp.size());
+  sort(known.begin(), known.end());
+  auto overlaps = [&](uint64_t a, uint64_t len) {
+    auto it = lower_bound(known.begin(), known.end(), make_pair(a + len, 0ul));
+    return it != known.begin() && (--it)->second > a;
+  };
+
+  /* Indirect call slots holding a multiverse function */
+  unordered_map<uint64_t, uint64_t> relative;
+  for (auto& rela : rela_other)
+    if (GELF_R_TYPE(rela.r_info) == R_X86_64_RELATIVE)
+      relative.emplace(rela.r_offset, rela.r_addend);
+  vector<pair<uint64_t, uint64_t>> relro;
+  size_t phnum;
+  GElf_Phdr phdr;
+  elf_getphdrnum(e_in, &phnum);
+  for (auto i = 0u; i < phnum; i++)
+    if (gelf_getphdr(e_in, i, &phdr) && phdr.p_type == PT_GNU_RELRO)
+      relro.emplace_back(phdr.p_vaddr, phdr.p_vaddr + phdr.p_memsz);
+  unordered_map<uint64_t, MVFn*> slot_fn;
+  auto slot = [&](uint64_t vaddr) -> MVFn* {
+    auto it = slot_fn.find(vaddr);
+    if (it != slot_fn.end()) return it->second;
+    uint64_t target;
+    MVFn* fn = nullptr;
+    if (read_slot(vaddr, relative, secs, relro, &target)) {
+      auto f = fn_at.find(target);
+      if (f != fn_at.end()) fn = f->second;
+    }
+    return slot_fn[vaddr] = fn;
+  };
+
+  /* Byte level matches */
+  auto start = text.vaddr();
+  auto size = text.max_sz();
+  auto buf = text.in_buf();
+  vector<Hit> hits;
+  opcode_bytes(buf, size, [&](size_t i) {
+    auto a = start + i;
+    if (buf[i] == 0xff) {
+      if (i + 6 > size || buf[i + 1] != 0x15 || overlaps(a, 6)) return;
+      auto fn = slot(a + 6 + x86::read_signed(buf + i + 2, 4));
+      if (fn != nullptr) hits.push_back({a, PP_TYPE_X86_CALL_INDIRECT, fn});
+      return;
+    }
+    if (i + 5 > size || overlaps(a, 5)) return;
+    auto f = fn_at.find(a + 5 + x86::read_signed(buf + i + 1, 4));
+    if (f == fn_at.end()) return;
+    hits.push_back({a, buf[i] == 0xe8 ? PP_TYPE_X86_CALL : PP_TYPE_X86_JUMP,
+                    f->second});
+  });
+
+  /* Keep matches that the decoder reaches from their function's start */
+  vector<const symbol*> funcs;
+  for (auto& s : syms)
+    if (GELF_ST_TYPE(s.sym.st_info) == STT_FUNC && s.sym.st_size != 0 &&
+        s.sym.st_value >= start &&
+        s.sym.st_value + s.sym.st_size <= start + size)
+      funcs.push_back(&s);
+  sort(funcs.begin(), funcs.end(), [](auto a, auto b) {
+    return a->sym.st_value < b->sym.st_value;
+  });
+
+  for (auto h = hits.begin(); h != hits.end();) {
+    auto f = upper_bound(
+        funcs.begin(), funcs.end(), h->addr,
+        [](uint64_t a, auto s) { return a < s->sym.st_value; });
+    auto a = f != funcs.begin() ? (*(f - 1))->sym.st_value : 0;
+    auto end = f != funcs.begin() ? a + (*(f - 1))->sym.st_size : 0;
+    if (h->addr >= end) {
+      r.rejected++;
+      ++h;
+      continue;
+    }
+    x86::Insn insn;
+    for (; h != hits.end() && h->addr < end; ++h) {
+      while (a < h->addr && x86::decode(buf + (a - start), end - a, &insn))
+        a += insn.len;
+      if (a != h->addr) {
+        r.rejected++;
+        continue;
+      }
+      model.pps.emplace_back(h->fn, h->addr, h->type);
+      if (h->type == PP_TYPE_X86_CALL) r.calls++;
+      if (h->type == PP_TYPE_X86_JUMP) r.jumps++;
+      if (h->type == PP_TYPE_X86_CALL_INDIRECT) r.indirect++;
+    }
+  }
+
+  if (r.found() != 0) model.link_pps();
+  return r;
+}
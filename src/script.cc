@@ -0,0 +1,94 @@
+#include <bintail/bintail.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+#include "mvelem.h"
+#include "patch.h"
+
+using namespace std;
+
+template <class T>
+static void put(vector<uint8_t>& out, T v) {
+  auto p = reinterpret_cast<const uint8_t*>(&v);
+  out.insert(out.end(), p, p + sizeof(v));  // little endian
+}
+
+/* A variable the script cannot select variants for alone, nullptr if none */
+static MVVar* other_dynamic(MVVar& var) {
+  for (auto& fn : var.functions())
+    for (auto& mvfn : fn.variants())
+      for (auto& a : mvfn.assigns())
+        if (a.var != &var && !a.var->frozen) return a.var;
+  return nullptr;
+}
+
+PatchScript Bintail::patch_script() {
+  PatchScript r;
+  struct Record {
+    uint64_t address;
+    vector<uint8_t> bytes;
+  };
+  vector<uint8_t> out(begin(bintail::script_magic),
+                      end(bintail::script_magic));
+  put(out, bintail::script_version);
+  put(out, uint32_t{0});  // n_vars, below
+
+  for (auto& var : model.vars) {
+    if (var.frozen) continue;
+    auto fns = var.functions();
+    if (fns.size() == 0) continue;
+    auto other = other_dynamic(var);
+    if (other != nullptr) {
+      r.skipped.push_back({string(var.name()),
+                           "shares functions with " + string(other->name())});
+      continue;
+    }
+
+    auto segments = var.segments();
+    put(out, var.location());
+    put(out, uint32_t(segments.size()));
+    auto saved = var._value;
+    for (auto& s : segments) {
+      /* MVFn::apply with the variable in this segment, generic if no
+       * variant matches */
+      var._value = s.first;
+      vector<Record> records;
+      for (auto& fn : fns) {
+        if (fn.is_fixed()) continue;
+        auto mvfns = fn.variants();
+        auto chosen = find_if(mvfns.begin(), mvfns.end(),
+                              [](auto& m) { return m.active(); });
+        for (auto& pp : fn.patchpoints()) {
+          Record rec{pp.pp.location, vector<uint8_t>(pp.size())};
+          if (chosen != mvfns.end())
+            bintail::encode_patch(pp.patch(&chosen->mvfn), rec.bytes.data());
+          else
+            memcpy(rec.bytes.data(), text.in_buf(rec.address), pp.size());
+          records.push_back(move(rec));
+        }
+      }
+      sort(records.begin(), records.end(),
+           [](auto& a, auto& b) { return a.address < b.address; });
+
+      put(out, s.first);
+      put(out, s.second);
+      put(out, uint32_t(records.size()));
+      for (auto& rec : records) {
+        put(out, rec.address);
+        put(out, uint8_t(rec.bytes.size()));
+        out.insert(out.end(), rec.bytes.begin(), rec.bytes.end());
+      }
+      r.segments++;
+      r.records += records.size();
+    }
+    var._value = saved;
+    r.vars++;
+  }
+
+  auto n_vars = uint32_t(r.vars);
+  memcpy(out.data() + 8, &n_vars, sizeof(n_vars));
+  script = r.vars == 0 ? vector<uint8_t>{} : move(out);
+  r.bytes = script.size();
+  return r;
+}
@@ -0,0 +1,164 @@
+#include <bintail/bintail.hpp>
+
+#include <dirent.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <future>
+
+#include "mvelem.h"
+#include "pool.h"
+
+using namespace std;
+
+namespace {
+
+/* Closes on every return */
+struct File {
+  explicit File(const string& path)
+      : fd{open(path.c_str(), O_RDONLY | O_CLOEXEC)} {}
+  ~File() {
+    if (fd != -1) close(fd);
+  }
+  bool read(void* buf, size_t size, uint64_t offset) {
+    return pread(fd, buf, size, offset) == ssize_t(size);
+  }
+  int fd;
+};
+
+}  // namespace
+
+/* Sections load() requires */
+static const char* const needed[] = {".symtab",  ".rela.dyn", ".rodata",
+                                     ".data",    ".dynamic",   ".text",
+                                     ".bss",     "__multiverse_var_"};
+
+Preflight preflight(const string& path) {
+  Preflight r;
+  r.path = path;
+  auto fail = [&](string reason) {
+    r.reason = move(reason);
+    return r;
+  };
+
+  File f{path};
+  struct stat st;
+  if (f.fd == -1 || fstat(f.fd, &st) == -1)
+    return fail("open failed. "s + strerror(errno));
+  uint64_t file_size = st.st_size;
+  /* Sizes from the file are checked before they size a buffer */
+  auto fits = [&](uint64_t offset, uint64_t size) {
+    return offset <= file_size && size <= file_size - offset;
+  };
+  Elf64_Ehdr ehdr;
+  if (!f.read(&ehdr, sizeof(ehdr), 0) || memcmp(ehdr.e_ident, ELFMAG, SELFMAG))
+    return fail("not an ELF file");
+  if (ehdr.e_ident[EI_CLASS] != ELFCLASS64 || ehdr.e_machine != EM_X86_64)
+    return fail("not x86-64");
+  if (ehdr.e_type != ET_EXEC && ehdr.e_type != ET_DYN)
+    return fail("not an executable");
+  r.pic = ehdr.e_type == ET_DYN;
+
+  /* Section table, counts beyond 16 bit live in section 0 */
+  Elf64_Shdr first;
+  if (ehdr.e_shoff == 0 || ehdr.e_shentsize != sizeof(Elf64_Shdr) ||
+      !f.read(&first, sizeof(first), ehdr.e_shoff))
+    return fail("no section table");
+  size_t shnum = ehdr.e_shnum != 0 ? ehdr.e_shnum : first.sh_size;
+  size_t shstrndx =
+      ehdr.e_shstrndx != SHN_XINDEX ? ehdr.e_shstrndx : first.sh_link;
+  if (shstrndx >= shnum || shnum > file_size / sizeof(Elf64_Shdr) ||
+      !fits(ehdr.e_shoff, shnum * sizeof(Elf64_Shdr)))
+    return fail("truncated section table");
+  vector<Elf64_Shdr> shdrs(shnum);
+  if (!f.read(shdrs.data(), shnum * sizeof(Elf64_Shdr), ehdr.e_shoff))
+    return fail("truncated section table");
+  auto& strtab = shdrs[shstrndx];
+  if (!fits(strtab.sh_offset, strtab.sh_size))
+    return fail("truncated section names");
+  string names(strtab.sh_size, '\0');
+  if (!f.read(&names[0], names.size(), strtab.sh_offset))
+    return fail("truncated section names");
+
+  auto find = [&](const char* name) -> const Elf64_Shdr* {
+    for (auto& s : shdrs)
+      if (s.sh_name < names.size() && !strcmp(names.c_str() + s.sh_name, name))
+        return &s;
+    return nullptr;
+  };
+  for (auto name : needed)
+    if (find(name) == nullptr) return fail("no "s + name);
+
+  auto count = [&](const char* name, size_t size) -> size_t {
+    auto s = find(name);
+    return s == nullptr ? 0 : s->sh_size / size;
+  };
+  r.vars = count("__multiverse_var_", sizeof(mv_info_var));
+  r.fns = count("__multiverse_fn_", sizeof(mv_info_fn));
+  r.callsites = count("__multiverse_callsite_", sizeof(mv_info_callsite));
+  if (r.vars == 0) return fail("no multiverse variables");
+  r.ok = true;
+  return r;
+}
+
+/* Directories that cannot be read end up in failed */
+static void walk(const string& path, vector<string>& files,
+                 vector<Preflight>& failed) {
+  struct stat st;
+  if (lstat(path.c_str(), &st) == -1) {
+    files.push_back(path);  // reported by preflight
+    return;
+  }
+  if (S_ISREG(st.st_mode)) files.push_back(path);
+  if (!S_ISDIR(st.st_mode)) return;
+
+  auto d = opendir(path.c_str());
+  if (d == nullptr) {
+    Preflight r;
+    r.path = path;
+    r.reason = "opendir failed. "s + strerror(errno);
+    failed.push_back(r);
+    return;
+  }
+  struct dirent* e;
+  while ((e = readdir(d)) != nullptr) {
+    if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, "..")) continue;
+    auto sub = path + "/" + e->d_name;
+    if (e->d_type == DT_REG)
+      files.push_back(sub);
+    else if (e->d_type == DT_DIR || e->d_type == DT_UNKNOWN)
+      walk(sub, files, failed);
+  }
+  closedir(d);
+}
+
+vector<Preflight> triage(const vector<string>& paths, unsigned threads) {
+  vector<string> files;
+  vector<Preflight> failed;
+  for (auto& p : paths) {
+    struct stat st;
+    /* Links given by name are followed */
+    if (stat(p.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+      files.push_back(p);
+    else
+      walk(p, files, failed);
+  }
+  sort(files.begin(), files.end());
+
+  vector<Preflight> results(files.size());
+  {
+    bintail::ThreadPool pool{threads};
+    vector<future<void>> done;
+    for (auto i = 0ul; i < files.size(); i++)
+      done.push_back(pool.submit(
+          [&files, &results, i] { results[i] = preflight(files[i]); }));
+    for (auto& d : done) d.get();
+  }
+  results.insert(results.end(), failed.begin(), failed.end());
+  sort(results.begin(), results.end(),
+       [](auto& a, auto& b) { return a.path < b.path; });
+  return results;
+}
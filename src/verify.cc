@@ -0,0 +1,140 @@
+#include <bintail/bintail.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+
+#include "mvelem.h"
+#include "x86.h"
+
+using namespace std;
+namespace x86 = bintail::x86;
+
+typedef pair<uint64_t, uint64_t> Range;  // [first, second)
+
+static bool contains(const vector<Range>& sorted, uint64_t addr) {
+  auto it = upper_bound(sorted.begin(), sorted.end(), Range{addr, UINT64_MAX});
+  if (it == sorted.begin()) return false;
+  --it;
+  return addr >= it->first && addr < it->second;
+}
+
+static string hex_addr(uint64_t addr) {
+  stringstream ss;
+  ss << "0x" << hex << addr;
+  return ss.str();
+}
+
+/* First instruction of a patch window, see patch_templates */
+static bool expected_first(const uint8_t* op, const x86::Insn& insn,
+                           uint64_t loc, mv_info_patchpoint_type type,
+                           const struct mv_info_mvfn* mvfn) {
+  auto single = insn.map == x86::MAP_1BYTE && insn.len == 1;
+  if (type == PP_TYPE_X86_JUMP)
+    return insn.map == x86::MAP_1BYTE && insn.opcode == 0xe9 &&
+           x86::branch_target(op, insn, loc) == mvfn->function_body;
+
+  switch (mvfn->type) {
+    case MVFN_TYPE_NOP:
+      return x86::is_nop(op, insn);
+    case MVFN_TYPE_CONSTANT: {
+      uint32_t imm;
+      memcpy(&imm, op + insn.imm_off, sizeof(imm));
+      return insn.map == x86::MAP_1BYTE && insn.opcode == 0xb8 &&
+             insn.len == 5 && imm == mvfn->constant;
+    }
+    case MVFN_TYPE_CLI:
+      return single && insn.opcode == 0xfa;
+    case MVFN_TYPE_STI:
+      return single && insn.opcode == 0xfb;
+    default:  // call, or jmp if peephole() made it a tail call
+      return insn.map == x86::MAP_1BYTE &&
+             (insn.opcode == 0xe8 || insn.opcode == 0xe9) &&
+             x86::branch_target(op, insn, loc) == mvfn->function_body;
+  }
+}
+
+/* The window has to decode to the expected instruction plus nop padding */
+static bool check_window(const uint8_t* op, uint64_t loc, size_t len,
+                         mv_info_patchpoint_type type,
+                         const struct mv_info_mvfn* mvfn) {
+  x86::Insn insn;
+  for (auto pos = 0ul; pos < len; pos += insn.len) {
+    if (x86::decode(op + pos, len - pos, &insn) == 0) return false;
+    if (pos == 0 && !expected_first(op, insn, loc, type, mvfn)) return false;
+    if (pos != 0 && !x86::is_nop(op + pos, insn)) return false;
+  }
+  return true;
+}
+
+VerifyReport Bintail::verify() {
+  VerifyReport r;
+  auto start = text.vaddr();
+  auto end = start + text.max_sz();
+  auto buf = text.out_buf();
+  auto in_text = [&](uint64_t a, size_t n) {
+    return a >= start && a + n <= end;
+  };
+
+  /* Patch windows */
+  vector<Range> windows;
+  for (auto& pp : model.pps) {
+    if (pp._fn == nullptr || !pp._fn->is_fixed()) continue;
+    auto loc = pp.pp.location;
+    windows.emplace_back(loc, loc + pp.size());
+    r.patchpoints++;
+    if (!in_text(loc, pp.size())) {
+      r.errors.push_back("patchpoint " + hex_addr(loc) + " outside .text");
+      continue;
+    }
+    if (!check_window(buf + (loc - start), loc, pp.size(), pp.pp.type,
+                      pp._fn->active_mvfn()))
+      r.errors.push_back("patchpoint " + hex_addr(loc) +
+                         " does not match its variant");
+  }
+  sort(windows.begin(), windows.end());
+
+  /* Guarded code is int3 except for patch windows inside */
+  vector<Range> guarded;
+  for (auto& fn : model.fns)
+    for (auto& g : fn.guarded)
+      guarded.emplace_back(g.first, g.first + g.second);
+  sort(guarded.begin(), guarded.end());
+  for (auto& g : guarded) {
+    if (!in_text(g.first, g.second - g.first)) {
+      r.errors.push_back("guarded " + hex_addr(g.first) + " outside .text");
+      continue;
+    }
+    for (auto a = g.first; a < g.second; a++) {
+      if (contains(windows, a)) continue;
+      r.guarded_bytes++;
+      if (buf[a - start] != 0xcc) {
+        r.errors.push_back("guarded byte " + hex_addr(a) + " is not int3");
+        break;
+      }
+    }
+  }
+
+  /* No surviving direct branch may land in guarded code */
+  for (auto& s : syms) {
+    auto sz = s.sym.st_size;
+    auto a = s.sym.st_value;
+    if (GELF_ST_TYPE(s.sym.st_info) != STT_FUNC || sz == 0) continue;
+    if (!in_text(a, sz) || contains(guarded, a)) continue;
+    for (x86::Insn insn; a < s.sym.st_value + sz; a += insn.len) {
+      auto op = buf + (a - start);
+      if (x86::decode(op, s.sym.st_value + sz - a, &insn) == 0) {
+        r.undecodable++;
+        break;
+      }
+      if (insn.branch == x86::BR_NONE) continue;
+      r.branches++;
+      auto target = x86::branch_target(op, insn, a);
+      if (contains(guarded, target) && !contains(windows, target))
+        r.errors.push_back("branch at " + hex_addr(a) + " in " +
+                           string(s.name) + " targets guarded " +
+                           hex_addr(target));
+    }
+  }
+  return r;
+}
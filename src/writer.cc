@@ -0,0 +1,115 @@
+#include "writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "probe.h"
+
+using namespace std;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+static const unsigned char host_data = ELFDATA2LSB;
+#else
+static const unsigned char host_data = ELFDATA2MSB;
+#endif
+
+namespace {
+
+struct Extent {
+  uint64_t offset;
+  const void* buf;
+  size_t size;
+};
+
+}  // namespace
+
+static void write_all(int fd, vector<iovec>& iov) {
+  off_t pos = 0;
+  size_t i = 0;
+  while (i < iov.size()) {
+    auto cnt = min<size_t>(iov.size() - i, IOV_MAX);
+    auto n = pwritev(fd, &iov[i], cnt, pos);
+    if (n == -1 && errno == EINTR) continue;
+    if (n == -1) throw runtime_error("pwritev failed. "s + strerror(errno));
+    if (n == 0) throw runtime_error("pwritev wrote nothing.");
+    pos += n;
+    for (; i < iov.size() && size_t(n) >= iov[i].iov_len; i++)
+      n -= iov[i].iov_len;
+    if (n > 0) {
+      iov[i].iov_base = static_cast<char*>(iov[i].iov_base) + n;
+      iov[i].iov_len -= n;
+    }
+  }
+}
+
+bool bintail::write_elf(Elf* e, int fd, uint8_t fill) {
+  auto ehdr = elf64_getehdr(e);
+  if (ehdr == nullptr || ehdr->e_ident[EI_DATA] != host_data) return false;
+
+  vector<Extent> parts{{0, ehdr, sizeof(*ehdr)}};
+  auto phdr = ehdr->e_phnum > 0 ? elf64_getphdr(e) : nullptr;
+  if (phdr != nullptr)
+    parts.push_back(
+        {ehdr->e_phoff, phdr, ehdr->e_phnum * sizeof(Elf64_Phdr)});
+  size_t shnum;
+  elf_getshdrnum(e, &shnum);
+  vector<Elf64_Shdr> shdrs(shnum);
+  for (auto i = 0u; i < shnum; i++) {
+    auto scn = elf_getscn(e, i);
+    shdrs[i] = *elf64_getshdr(scn);
+    if (i == 0 || shdrs[i].sh_type == SHT_NOBITS) continue;
+    Elf_Data* d = nullptr;
+    while ((d = elf_getdata(scn, d)) != nullptr)
+      if (d->d_buf != nullptr && d->d_size > 0)
+        parts.push_back({shdrs[i].sh_offset + d->d_off, d->d_buf, d->d_size});
+  }
+  if (shnum > 0)
+    parts.push_back(
+        {ehdr->e_shoff, shdrs.data(), shnum * sizeof(Elf64_Shdr)});
+  sort(parts.begin(), parts.end(),
+       [](auto& a, auto& b) { return a.offset < b.offset; });
+
+  /* Gaps point into one page of fill */
+  vector<uint8_t> pad(4096, fill);
+  vector<iovec> iov;
+  uint64_t end = 0;
+  for (auto& p : parts) {
+    if (p.offset < end)
+      throw runtime_error("write_elf: overlapping data at offset " +
+                          to_string(p.offset));
+    for (; end < p.offset; end += iov.back().iov_len)
+      iov.push_back({pad.data(), min<size_t>(p.offset - end, pad.size())});
+    iov.push_back({const_cast<void*>(p.buf), p.size});
+    end += p.size;
+  }
+
+  BINTAIL_PROBE2(write_start, end, parts.size());
+  /* Allocate up front, ftruncate where fallocate is not supported */
+  if (fallocate(fd, 0, 0, end) == -1 && ftruncate(fd, end) == -1)
+    throw runtime_error("ftruncate failed. "s + strerror(errno));
+  write_all(fd, iov);
+  BINTAIL_PROBE2(write_done, end, iov.size());
+  return true;
+}
+
+void bintail::update_elf(Elf* e, int fd, uint8_t fill) {
+  if (write_elf(e, fd, fill)) return;
+  /* elf_fill() is global to libelf */
+  static mutex fill_lock;
+  lock_guard<mutex> lock{fill_lock};
+  elf_fill(fill);
+  BINTAIL_PROBE(elf_update_start);
+  if (elf_update(e, ELF_C_WRITE) < 0)
+    throw runtime_error("elf_update(write) failed. "s +
+                        elf_errmsg(elf_errno()));
+  BINTAIL_PROBE(elf_update_done);
+}
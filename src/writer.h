@@ -0,0 +1,28 @@
+#ifndef BINTAIL_WRITER_H_
+#define BINTAIL_WRITER_H_
+
+#include <libelf.h>
+#include <cstdint>
+
+namespace bintail {
+
+/**
+ * Write an ELF with manual layout (ELF_F_LAYOUT) to fd without
+ * elf_update(): the file is sized once, then the headers, the section data
+ * and the gaps between them (filled with fill) go out in order through
+ * pwritev. The memory image is written as is, so this only handles 64 bit
+ * files in host byte order and returns false for others, elf_update() has
+ * to translate those.
+ *
+ * Throws std::runtime_error if two parts overlap or writing fails.
+ **/
+bool write_elf(Elf *e, int fd, uint8_t fill);
+
+/**
+ * write_elf(), or elf_update() for the files it does not handle. Safe to
+ * call from several threads for different Elf descriptors.
+ **/
+void update_elf(Elf *e, int fd, uint8_t fill);
+
+}  // namespace bintail
+#endif  // BINTAIL_WRITER_H_
@@ -0,0 +1,419 @@
+#include "x86.h"
+
+#include <cstring>
+
+namespace bintail {
+namespace x86 {
+
+static const size_t max_len = 15;
+
+/* Opcodes without meaning in 64 bit mode */
+static bool op1_invalid(uint8_t op) {
+  switch (op) {
+    case 0x06: case 0x07: case 0x0e: case 0x16: case 0x17: case 0x1e:
+    case 0x1f: case 0x27: case 0x2f: case 0x37: case 0x3f: case 0x60:
+    case 0x61: case 0x82: case 0x9a: case 0xce: case 0xd4: case 0xd5:
+    case 0xd6: case 0xea:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool op1_modrm(uint8_t op) {
+  if (op < 0x40) return (op & 0x7) < 4;
+  if (op >= 0x80 && op <= 0x8f) return true;
+  if (op >= 0xd0 && op <= 0xd3) return true;
+  if (op >= 0xd8 && op <= 0xdf) return true;  // x87
+  switch (op) {
+    case 0x63: case 0x69: case 0x6b: case 0xc0: case 0xc1: case 0xc6:
+    case 0xc7: case 0xf6: case 0xf7: case 0xfe: case 0xff:
+      return true;
+    default:
+      return false;
+  }
+}
+
+/* Immediate size, opsz is the size of a z operand (2 or 4) */
+static size_t op1_imm(uint8_t op, const Insn &insn, size_t opsz) {
+  if (op < 0x40) {
+    if ((op & 0x7) == 4) return 1;
+    if ((op & 0x7) == 5) return opsz;
+    return 0;
+  }
+  if (op >= 0x70 && op <= 0x7f) return 1;  // jcc rel8
+  if (op >= 0xb0 && op <= 0xb7) return 1;
+  if (op >= 0xb8 && op <= 0xbf) return insn.rex_w() ? 8 : opsz;
+  if (op >= 0xe0 && op <= 0xe7) return 1;  // loop, jrcxz, in, out
+  if (op >= 0xa0 && op <= 0xa3) return insn.addrsize ? 4 : 8;  // moffs
+  switch (op) {
+    case 0x68: case 0x69: case 0x81: case 0xa9: case 0xc7:
+      return opsz;
+    case 0x6a: case 0x6b: case 0x80: case 0x83: case 0xa8: case 0xc0:
+    case 0xc1: case 0xc6: case 0xcd: case 0xeb:
+      return 1;
+    case 0xc2: case 0xca:
+      return 2;
+    case 0xc8:
+      return 3;
+    case 0xe8: case 0xe9:
+      return 4;  // rel32, operand size prefix ignored in 64 bit mode
+    case 0xf6:
+      return insn.reg() < 2 ? 1 : 0;
+    case 0xf7:
+      return insn.reg() < 2 ? opsz : 0;
+    default:
+      return 0;
+  }
+}
+
+static bool op0f_invalid(uint8_t op) {
+  switch (op) {
+    case 0x04: case 0x0a: case 0x0c: case 0x36: case 0x39: case 0x3b:
+    case 0x3c: case 0x3d: case 0x3e: case 0x3f:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static bool op0f_modrm(uint8_t op) {
+  if (op >= 0x30 && op <= 0x37) return false;  // wrmsr, rdtsc, sysenter...
+  if (op >= 0x80 && op <= 0x8f) return false;  // jcc rel32
+  if (op >= 0xc8 && op <= 0xcf) return false;  // bswap
+  switch (op) {
+    case 0x05: case 0x06: case 0x07: case 0x08: case 0x09: case 0x0b:
+    case 0x0e: case 0x77: case 0xa0: case 0xa1: case 0xa2: case 0xa8:
+    case 0xa9: case 0xaa:
+      return false;
+    default:
+      return true;
+  }
+}
+
+static size_t op0f_imm(uint8_t op) {
+  if (op >= 0x70 && op <= 0x73) return 1;
+  if (op >= 0x80 && op <= 0x8f) return 4;
+  switch (op) {
+    case 0x0f:  // 3DNow! suffix
+    case 0xa4: case 0xac: case 0xba: case 0xc2: case 0xc4: case 0xc5:
+    case 0xc6:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+size_t decode(const uint8_t *p, size_t avail, Insn *insn) {
+  memset(insn, 0, sizeof(*insn));
+  if (avail > max_len) avail = max_len;
+  size_t pos = 0;
+
+  /* Legacy prefixes */
+  for (; pos < avail; pos++) {
+    auto b = p[pos];
+    if (b == 0x66)
+      insn->opsize = true;
+    else if (b == 0x67)
+      insn->addrsize = true;
+    else if (b == 0xf3)
+      insn->rep = true;
+    else if (b == 0xf2)
+      insn->repne = true;
+    else if (b != 0xf0 && b != 0x26 && b != 0x2e && b != 0x36 && b != 0x3e &&
+             b != 0x64 && b != 0x65)
+      break;
+  }
+  if (pos < avail && (p[pos] & 0xf0) == 0x40) insn->rex = p[pos++];
+  if (pos >= avail) return 0;
+
+  /* Opcode */
+  auto op = p[pos];
+  if (op == 0xc4 || op == 0xc5 || op == 0x62) {
+    /* VEX/EVEX: map from the payload, always followed by a ModRM */
+    size_t payload = op == 0xc5 ? 1 : op == 0xc4 ? 2 : 3;
+    if (pos + payload + 1 >= avail) return 0;
+    insn->vex = true;
+    if (op == 0xc5) {
+      insn->map = MAP_0F;
+    } else {
+      auto mm = p[pos + 1] & (op == 0xc4 ? 0x1f : 0x03);
+      if (mm < 1 || mm > 3) return 0;
+      insn->map = mm;
+    }
+    pos += 1 + payload;
+    insn->opc_off = pos;
+    insn->opcode = p[pos++];
+    insn->has_modrm = !(insn->map == MAP_0F && insn->opcode == 0x77);
+  } else if (op == 0x0f) {
+    if (++pos >= avail) return 0;
+    if (p[pos] == 0x38 || p[pos] == 0x3a) {
+      insn->map = p[pos] == 0x38 ? MAP_0F38 : MAP_0F3A;
+      if (++pos >= avail) return 0;
+      insn->has_modrm = true;
+    } else {
+      insn->map = MAP_0F;
+      if (op0f_invalid(p[pos])) return 0;
+      insn->has_modrm = op0f_modrm(p[pos]);
+    }
+    insn->opc_off = pos;
+    insn->opcode = p[pos++];
+  } else {
+    if (op1_invalid(op)) return 0;
+    insn->map = MAP_1BYTE;
+    insn->opc_off = pos;
+    insn->opcode = p[pos++];
+    insn->has_modrm = op1_modrm(op);
+  }
+
+  /* ModRM, SIB, displacement */
+  if (insn->has_modrm) {
+    if (pos >= avail) return 0;
+    insn->modrm = p[pos++];
+    if (insn->mod() != 3) {
+      if (insn->rm() == 4) {
+        if (pos >= avail) return 0;
+        auto sib = p[pos++];
+        if (insn->mod() == 0 && (sib & 0x7) == 5) insn->disp_size = 4;
+      }
+      if (insn->mod() == 0 && insn->rm() == 5) {
+        insn->disp_size = 4;
+        insn->rip_relative = true;
+      }
+      if (insn->mod() == 1) insn->disp_size = 1;
+      if (insn->mod() == 2) insn->disp_size = 4;
+    }
+    insn->disp_off = pos;
+    pos += insn->disp_size;
+  }
+
+  /* Immediate */
+  size_t opsz = insn->opsize ? 2 : 4;
+  switch (insn->map) {
+    case MAP_1BYTE:
+      insn->imm_size = op1_imm(insn->opcode, *insn, opsz);
+      break;
+    case MAP_0F:
+      if (!insn->vex || insn->opcode < 0x80 || insn->opcode > 0x8f)
+        insn->imm_size = op0f_imm(insn->opcode);
+      break;
+    case MAP_0F3A:
+      insn->imm_size = 1;
+      break;
+  }
+  insn->imm_off = pos;
+  pos += insn->imm_size;
+  if (pos > avail) return 0;
+
+  /* Relative control transfers */
+  if (insn->map == MAP_1BYTE) {
+    auto o = insn->opcode;
+    if (o == 0xe8)
+      insn->branch = BR_CALL;
+    else if (o == 0xe9 || o == 0xeb)
+      insn->branch = BR_JMP;
+    else if ((o >= 0x70 && o <= 0x7f) || (o >= 0xe0 && o <= 0xe3))
+      insn->branch = BR_JCC;
+  } else if (insn->map == MAP_0F && !insn->vex && insn->opcode >= 0x80 &&
+             insn->opcode <= 0x8f) {
+    insn->branch = BR_JCC;
+  }
+
+  insn->len = pos;
+  return pos;
+}
+
+int64_t read_signed(const uint8_t *p, size_t size) {
+  switch (size) {
+    case 1: {
+      int8_t v;
+      memcpy(&v, p, 1);
+      return v;
+    }
+    case 2: {
+      int16_t v;
+      memcpy(&v, p, 2);
+      return v;
+    }
+    case 4: {
+      int32_t v;
+      memcpy(&v, p, 4);
+      return v;
+    }
+    case 8: {
+      int64_t v;
+      memcpy(&v, p, 8);
+      return v;
+    }
+    default:
+      return 0;
+  }
+}
+
+uint64_t branch_target(const uint8_t *p, const Insn &insn, uint64_t addr) {
+  return addr + insn.len + read_signed(p + insn.imm_off, insn.imm_size);
+}
+
+uint64_t rip_target(const uint8_t *p, const Insn &insn, uint64_t addr) {
+  return addr + insn.len + read_signed(p + insn.disp_off, insn.disp_size);
+}
+
+bool is_nop(const uint8_t *p, const Insn &insn) {
+  (void)p;
+  if (insn.map == MAP_0F && !insn.vex && insn.opcode == 0x1f)
+    return insn.reg() == 0;
+  if (insn.map == MAP_1BYTE && insn.opcode == 0x90)
+    return !insn.rep && (insn.rex & 0x1) == 0;  // 41 90: xchg %eax,%r8d
+  return false;
+}
+
+/* Recommended multi byte nops, by length */
+static const uint8_t nops[10][9] = {
+    {},
+    {0x90},
+    {0x66, 0x90},
+    {0x0f, 0x1f, 0x00},
+    {0x0f, 0x1f, 0x40, 0x00},
+    {0x0f, 0x1f, 0x44, 0x00, 0x00},
+    {0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00},
+    {0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00},
+    {0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+    {0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+};
+
+size_t write_nops(uint8_t *p, size_t n) {
+  size_t count = 0;
+  for (; n != 0; count++) {
+    auto len = n < 9 ? n : 9;
+    memcpy(p, nops[len], len);
+    p += len;
+    n -= len;
+  }
+  return count;
+}
+
+bool write_jmp(uint8_t *p, uint64_t addr, uint64_t target, size_t space) {
+  auto disp = int64_t(target - (addr + 2));
+  size_t len = 2;
+  if (space >= 2 && disp >= -128 && disp < 128) {
+    p[0] = 0xeb;
+    p[1] = uint8_t(disp);
+  } else if (space >= 5) {
+    int32_t rel = target - (addr + 5);
+    p[0] = 0xe9;
+    memcpy(p + 1, &rel, sizeof(rel));
+    len = 5;
+  } else {
+    return false;
+  }
+  write_nops(p + len, space - len);
+  return true;
+}
+
+static Flags result_flags(uint64_t r, size_t size) {
+  auto sign = uint64_t{1} << (size * 8 - 1);
+  auto mask = sign | (sign - 1);
+  return {false, (r & mask) == 0, (r & sign) != 0, false,
+          __builtin_parity(r & 0xff) == 0};
+}
+
+Flags sub_flags(uint64_t a, uint64_t b, size_t size) {
+  auto sign = uint64_t{1} << (size * 8 - 1);
+  auto mask = sign | (sign - 1);
+  a &= mask;
+  b &= mask;
+  auto r = (a - b) & mask;
+  auto f = result_flags(r, size);
+  f.cf = a < b;
+  f.of = ((a ^ b) & (a ^ r) & sign) != 0;
+  return f;
+}
+
+Flags and_flags(uint64_t a, uint64_t b, size_t size) {
+  return result_flags(a & b, size);
+}
+
+bool condition(uint8_t cc, const Flags &f) {
+  bool r;
+  switch ((cc >> 1) & 7) {
+    case 0: r = f.of; break;
+    case 1: r = f.cf; break;
+    case 2: r = f.zf; break;
+    case 3: r = f.cf || f.zf; break;
+    case 4: r = f.sf; break;
+    case 5: r = f.pf; break;
+    case 6: r = f.sf != f.of; break;
+    default: r = f.zf || f.sf != f.of; break;
+  }
+  return r != (cc & 1);
+}
+
+static bool reads_flags(const Insn &insn) {
+  auto o = insn.opcode;
+  auto carry = insn.reg() == 2 || insn.reg() == 3;  // adc, sbb, rcl, rcr
+  switch (insn.map) {
+    case MAP_1BYTE:
+      return (o >= 0x10 && o <= 0x1d) || (o >= 0x70 && o <= 0x7f) ||
+             o == 0x9c || o == 0x9f || o == 0xf5 ||
+             (o >= 0xd8 && o <= 0xdf) || (o >= 0xe0 && o <= 0xe3) ||
+             ((o >= 0x80 && o <= 0x83) && carry) ||
+             ((o == 0xc0 || o == 0xc1 || (o >= 0xd0 && o <= 0xd3)) && carry);
+    case MAP_0F:
+      return (o >= 0x40 && o <= 0x4f) || (o >= 0x80 && o <= 0x9f);
+    case MAP_0F38:
+      return o == 0xf6;  // adcx, adox
+  }
+  return false;
+}
+
+/* Sets all status flags without reading them */
+static bool writes_flags(const Insn &insn) {
+  if (insn.map != MAP_1BYTE || insn.vex) return false;
+  auto o = insn.opcode;
+  if (o < 0x40) return (o & 7) < 6 && (o < 0x10 || o >= 0x20);
+  if (o >= 0x80 && o <= 0x83) return insn.reg() != 2 && insn.reg() != 3;
+  if (o == 0xf6 || o == 0xf7) return insn.reg() < 2;  // test
+  return o == 0x84 || o == 0x85 || o == 0xa8 || o == 0xa9;
+}
+
+bool flags_dead(const uint8_t *p, size_t avail) {
+  Insn insn;
+  for (auto i = 0; i < 16 && avail != 0; i++) {
+    if (decode(p, avail, &insn) == 0 || reads_flags(insn)) return false;
+    if (writes_flags(insn)) return true;
+    if (insn.map == MAP_1BYTE) {
+      auto o = insn.opcode;
+      if (o == 0xe8 || o == 0xc3 || o == 0xc2) return true;
+      if (o == 0xff && (insn.reg() == 2 || insn.reg() == 3)) return true;
+      if (o == 0xff && (insn.reg() == 4 || insn.reg() == 5)) return false;
+      if (o == 0xcc) return false;
+    }
+    if (insn.branch != BR_NONE) return false;
+    if (insn.map == MAP_0F && insn.opcode == 0x0b) return false;  // ud2
+    p += insn.len;
+    avail -= insn.len;
+  }
+  return false;
+}
+
+bool reads_only(const Insn &insn) {
+  auto o = insn.opcode;
+  auto r = insn.reg();
+  switch (insn.map) {
+    case MAP_1BYTE:
+      if (o < 0x40)
+        return (o & 7) == 2 || (o & 7) == 3 || o == 0x38 || o == 0x39;
+      if (o >= 0x80 && o <= 0x83) return r == 7;         // cmp
+      if (o == 0xf6 || o == 0xf7) return r < 2;          // test
+      if (o == 0xff) return r == 2 || r == 4 || r == 6;  // call, jmp, push
+      return o == 0x63 || o == 0x69 || o == 0x6b || o == 0x84 || o == 0x85 ||
+             o == 0x8a || o == 0x8b;
+    case MAP_0F:
+      return (o >= 0x40 && o <= 0x4f) || o == 0xaf || o == 0xb6 ||
+             o == 0xb7 || o == 0xbe || o == 0xbf;
+  }
+  return false;
+}
+
+}  // namespace x86
+}  // namespace bintail
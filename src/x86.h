@@ -0,0 +1,120 @@
+#ifndef BINTAIL_X86_H_
+#define BINTAIL_X86_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace bintail {
+namespace x86 {
+
+/* Opcode maps */
+enum Map : uint8_t { MAP_1BYTE, MAP_0F, MAP_0F38, MAP_0F3A };
+
+/* Direct control transfers with a relative target */
+enum Branch : uint8_t { BR_NONE, BR_CALL, BR_JMP, BR_JCC };
+
+/**
+ * Layout of one decoded instruction. Offsets are relative to the first
+ * byte including prefixes. Only the length relevant parts are decoded,
+ * the operation itself is not interpreted.
+ **/
+struct Insn {
+  uint8_t len;
+  uint8_t map;
+  uint8_t opcode;    // last opcode byte
+  uint8_t opc_off;   // offset of the opcode byte
+  uint8_t rex;       // 0 if there is none
+  uint8_t modrm;     // valid if has_modrm
+  uint8_t disp_off;  // memory displacement
+  uint8_t disp_size;
+  uint8_t imm_off;   // immediate or relative branch offset
+  uint8_t imm_size;
+  Branch branch;
+  bool has_modrm;
+  bool opsize;        // 0x66
+  bool addrsize;      // 0x67
+  bool rep;           // 0xf3
+  bool repne;         // 0xf2
+  bool vex;           // VEX or EVEX encoded
+  bool rip_relative;  // memory operand relative to the next instruction
+
+  constexpr uint8_t reg() const { return (modrm >> 3) & 7; }
+  constexpr uint8_t rm() const { return modrm & 7; }
+  constexpr uint8_t mod() const { return modrm >> 6; }
+  constexpr bool rex_w() const { return rex & 0x8; }
+};
+
+/**
+ * Decode the instruction at p, reading at most avail bytes.
+ *
+ * \return length of the instruction, 0 if invalid or truncated
+ **/
+size_t decode(const uint8_t *p, size_t avail, Insn *insn);
+
+/**
+ * Sign extended little endian value of size 1, 2, 4 or 8 bytes.
+ **/
+int64_t read_signed(const uint8_t *p, size_t size);
+
+/**
+ * Target of a direct call, jmp, jcc or loop decoded at address addr.
+ **/
+uint64_t branch_target(const uint8_t *p, const Insn &insn, uint64_t addr);
+
+/**
+ * Address referenced by a rip relative memory operand.
+ **/
+uint64_t rip_target(const uint8_t *p, const Insn &insn, uint64_t addr);
+
+/**
+ * nop, 0f 1f /0 (multi byte nop) and xchg %ax,%ax forms.
+ **/
+bool is_nop(const uint8_t *p, const Insn &insn);
+
+/**
+ * Write n bytes of the recommended multi byte nops, longest first.
+ *
+ * \return number of instructions written
+ **/
+size_t write_nops(uint8_t *p, size_t n);
+
+/**
+ * jmp from addr to target padded with nops to space bytes.
+ *
+ * \return false if the jmp does not fit, nothing is written then
+ **/
+bool write_jmp(uint8_t *p, uint64_t addr, uint64_t target, size_t space);
+
+/* Status flags read by jcc */
+struct Flags {
+  bool cf, zf, sf, of, pf;
+};
+
+/**
+ * Flags of cmp (a - b) and test (a & b) on operands of 1, 2, 4 or 8
+ * bytes.
+ **/
+Flags sub_flags(uint64_t a, uint64_t b, size_t size);
+Flags and_flags(uint64_t a, uint64_t b, size_t size);
+
+/**
+ * Whether jcc with condition code cc (low nibble of the opcode) jumps.
+ **/
+bool condition(uint8_t cc, const Flags &f);
+
+/**
+ * Whether the straight line code at p overwrites cf, zf, sf, of and pf
+ * before anything reads them, within avail bytes. Calls and returns end
+ * their lifetime, the ABI does not preserve them.
+ **/
+bool flags_dead(const uint8_t *p, size_t avail);
+
+/**
+ * Whether an instruction only reads its memory operand: loads, compares,
+ * arithmetic into a register, indirect call, jmp and push.
+ **/
+bool reads_only(const Insn &insn);
+
+}  // namespace x86
+}  // namespace bintail
+#endif  // BINTAIL_X86_H_
@@ -0,0 +1,120 @@
+#include "x86.h"
+
+#include <catch2/catch.hpp>
+
+#include "patch.h"
+
+using namespace bintail;
+
+static size_t len(std::initializer_list<uint8_t> bytes) {
+  std::vector<uint8_t> buf{bytes};
+  x86::Insn insn;
+  return x86::decode(buf.data(), buf.size(), &insn);
+}
+
+TEST_CASE("Instruction lengths are decoded") {
+  REQUIRE(len({0xc3}) == 1);                                // ret
+  REQUIRE(len({0x55}) == 1);                                // push %rbp
+  REQUIRE(len({0x48, 0x89, 0xe5}) == 3);                    // mov %rsp,%rbp
+  REQUIRE(len({0xe8, 0, 0, 0, 0}) == 5);                    // call
+  REQUIRE(len({0xff, 0x15, 0, 0, 0, 0}) == 6);              // call *(%rip)
+  REQUIRE(len({0xb8, 1, 0, 0, 0}) == 5);                    // mov $1,%eax
+  REQUIRE(len({0x48, 0xb8, 1, 0, 0, 0, 0, 0, 0, 0}) == 10); // movabs
+  REQUIRE(len({0x66, 0x0f, 0x1f, 0x44, 0, 0}) == 6);        // nopw
+  REQUIRE(len({0x83, 0x3d, 0, 0, 0, 0, 1}) == 7);           // cmpl $1,(%rip)
+  REQUIRE(len({0xf6, 0x05, 0, 0, 0, 0, 1}) == 7);           // testb $1,(%rip)
+  REQUIRE(len({0x8b, 0x44, 0x24, 0x08}) == 4);              // mov 8(%rsp),%eax
+  REQUIRE(len({0x0f, 0x84, 0, 0, 0, 0}) == 6);              // je rel32
+  REQUIRE(len({0xc5, 0xf8, 0x77}) == 3);                    // vzeroupper
+  REQUIRE(len({0xc4, 0xe3, 0x79, 0x16, 0xc0, 1}) == 6);     // vpextrd
+  REQUIRE(len({0x06}) == 0);                                // invalid
+  REQUIRE(len({0xe8, 0, 0}) == 0);                          // truncated
+}
+
+TEST_CASE("Branch targets and rip relative operands are resolved") {
+  uint8_t call[] = {0xe8, 0x10, 0, 0, 0};
+  uint8_t jmp[] = {0xeb, 0xfe};
+  uint8_t load[] = {0x8b, 0x05, 0x20, 0, 0, 0};
+  x86::Insn insn;
+
+  x86::decode(call, sizeof(call), &insn);
+  REQUIRE(insn.branch == x86::BR_CALL);
+  REQUIRE(x86::branch_target(call, insn, 0x1000) == 0x1015);
+
+  x86::decode(jmp, sizeof(jmp), &insn);
+  REQUIRE(insn.branch == x86::BR_JMP);
+  REQUIRE(x86::branch_target(jmp, insn, 0x1000) == 0x1000);
+
+  x86::decode(load, sizeof(load), &insn);
+  REQUIRE(insn.rip_relative);
+  REQUIRE(x86::rip_target(load, insn, 0x1000) == 0x1026);
+}
+
+TEST_CASE("Patch templates fill the window with whole instructions") {
+  for (auto pp :
+       {PP_TYPE_X86_CALL, PP_TYPE_X86_CALL_INDIRECT, PP_TYPE_X86_JUMP})
+    for (auto fn : {MVFN_TYPE_NONE, MVFN_TYPE_NOP, MVFN_TYPE_CONSTANT,
+                    MVFN_TYPE_CLI, MVFN_TYPE_STI}) {
+      auto t = patch_template(pp, fn);
+      REQUIRE(t != nullptr);
+      x86::Insn insn;
+      auto pos = 0u;
+      while (pos < t->len && x86::decode(t->bytes + pos, t->len - pos, &insn))
+        pos += insn.len;
+      REQUIRE(pos == t->len);
+    }
+}
+
+TEST_CASE("Constant comparisons decide conditional branches") {
+  auto je = 0x4, jne = 0x5, jb = 0x2, jl = 0xc, jg = 0xf;
+  REQUIRE(x86::condition(je, x86::and_flags(0, 0, 4)));
+  REQUIRE(x86::condition(jne, x86::and_flags(0x100, 0x100, 4)));
+  REQUIRE_FALSE(x86::condition(jne, x86::and_flags(0x100, 0x100, 1)));
+  REQUIRE(x86::condition(jb, x86::sub_flags(1, 2, 4)));
+  REQUIRE(x86::condition(jl, x86::sub_flags(-1, 1, 4)));
+  REQUIRE_FALSE(x86::condition(jb, x86::sub_flags(-1, 1, 4)));
+  REQUIRE(x86::condition(jg, x86::sub_flags(0x80, 0x7f, 8)));
+  REQUIRE_FALSE(x86::condition(jg, x86::sub_flags(0x80, 0x7f, 1)));
+
+  /* Nops and the jmp replacing a branch decode to whole instructions */
+  uint8_t buf[16];
+  for (auto n = 1u; n <= sizeof(buf); n++) {
+    REQUIRE(x86::write_nops(buf, n) == (n + 8) / 9);
+    x86::Insn insn;
+    auto pos = 0u;
+    while (pos < n && x86::decode(buf + pos, n - pos, &insn) &&
+           x86::is_nop(buf + pos, insn))
+      pos += insn.len;
+    REQUIRE(pos == n);
+  }
+  x86::Insn insn;
+  REQUIRE(x86::write_jmp(buf, 0x1000, 0x1010, 4));
+  REQUIRE(x86::decode(buf, 4, &insn) == 2);
+  REQUIRE(x86::branch_target(buf, insn, 0x1000) == 0x1010);
+  REQUIRE_FALSE(x86::write_jmp(buf, 0x1000, 0x2000, 4));
+  REQUIRE(x86::write_jmp(buf, 0x1000, 0x2000, 6));
+  REQUIRE(x86::decode(buf, 6, &insn) == 5);
+  REQUIRE(x86::branch_target(buf, insn, 0x1000) == 0x2000);
+
+  /* test %eax,%eax ends the flags, jne reads them */
+  const uint8_t test[] = {0x85, 0xc0}, jne_[] = {0x75, 0x00};
+  REQUIRE(x86::flags_dead(test, sizeof(test)));
+  REQUIRE_FALSE(x86::flags_dead(jne_, sizeof(jne_)));
+}
+
+static bool reads_only(std::initializer_list<uint8_t> bytes) {
+  std::vector<uint8_t> buf{bytes};
+  x86::Insn insn;
+  REQUIRE(x86::decode(buf.data(), buf.size(), &insn) == buf.size());
+  return x86::reads_only(insn);
+}
+
+TEST_CASE("Stores and taken addresses do not only read memory") {
+  REQUIRE(reads_only({0x8b, 0x05, 0, 0, 0, 0}));           // mov (%rip),%eax
+  REQUIRE(reads_only({0x0f, 0xb6, 0x05, 0, 0, 0, 0}));     // movzbl
+  REQUIRE(reads_only({0x83, 0x3d, 0, 0, 0, 0, 1}));        // cmpl $1,(%rip)
+  REQUIRE(reads_only({0xff, 0x15, 0, 0, 0, 0}));           // call *(%rip)
+  REQUIRE_FALSE(reads_only({0x89, 0x05, 0, 0, 0, 0}));     // mov %eax,(%rip)
+  REQUIRE_FALSE(reads_only({0x83, 0x05, 0, 0, 0, 0, 1}));  // addl $1,(%rip)
+  REQUIRE_FALSE(reads_only({0x48, 0x8d, 0x05, 0, 0, 0, 0}));  // lea
+}
@@ -2,16 +2,6 @@
 
 cd _measure
 
-echo " === Full Apply and Guard === "
-rm *-patched
-
-for f in ./*
-do
-    echo "$f & $(../bintail -A $f $f-patched)"
-done
-
-echo " === Check Guard === "
-for g in ./*-patched
-do
-    echo "$g $(../callsite-check.py $g)"
-done
+echo " === Full Apply, Guard and Verify === "
+rm -rf patched
+../bintail -A -V -b patched ./*